@@ -1,7 +1,19 @@
 #include "api.h"
 #include "utils.h"
 #include "wifi_manager.h"
+#include "outbox.h"
+#include "storage.h"
+#include "http_stream.h"
+#include "downlink.h"
+#include "mqtt_transport.h"
+#include "tls_client.h"
+#include "link_client.h"
+#include "clock_service.h"
+#include "circuit_breaker.h"
+#include "sequence.h"
+#include "config.h"
 #include <ArduinoJson.h>
+#include <time.h>
 
 // API endpoint URLs
 static String latitudeApiUrl;
@@ -9,10 +21,74 @@ static String longitudeApiUrl;
 static String notificationApiUrl;
 static String batteryStatusApiUrl;
 static String childDataApiUrl;
+static String telemetryBatchApiUrl;
 static String userId;
 
-// Initialize API with user ID
+// Set once apiInit() has filled in the URLs above; the network task touches them only after that
+static bool apiReady = false;
+
+// Persistent connection to API_BASE_URL, kept alive between requests over WiFi or GPRS
+static HTTPClient apiHttp;
+static LinkClient apiLinkClient(GSM_SOCKET_API);
+#if API_USE_TLS
+static TlsClient apiTlsClient(apiLinkClient);
+static WiFiClient& apiClient = apiTlsClient;
+#else
+static WiFiClient& apiClient = apiLinkClient;
+#endif
+static unsigned long apiLastRequestTime = 0;
+
+// Per-request timeout and abort check, set by the network task for the class being sent
+static uint16_t apiRequestTimeout = HTTP_TIMEOUT;
+static ApiAbortCheck apiAbortCheck = NULL;
+static bool apiIgnoreBackoff = false;
+
+// Set once the request in progress has given up for higher priority traffic
+static bool apiAborted = false;
+
+// Failure tracking per endpoint, plus one breaker for the server and link as a whole
+enum ApiEndpoint {
+  API_ENDPOINT_LATITUDE,
+  API_ENDPOINT_LONGITUDE,
+  API_ENDPOINT_NOTIFICATION,
+  API_ENDPOINT_BATTERY,
+  API_ENDPOINT_CHILD_DATA,
+  API_ENDPOINT_TELEMETRY,
+  API_ENDPOINT_OTHER,
+  API_ENDPOINT_COUNT
+};
+static const String* endpointUrls[API_ENDPOINT_OTHER] = {
+  &latitudeApiUrl, &longitudeApiUrl, &notificationApiUrl, &batteryStatusApiUrl, &childDataApiUrl, &telemetryBatchApiUrl
+};
+static const char* endpointNames[API_ENDPOINT_COUNT] = {
+  "latitude", "longitude", "notification", "battery", "child_data", "telemetry", "other"
+};
+static CircuitBreaker endpointBreakers[API_ENDPOINT_COUNT];
+static CircuitBreaker serverBreaker;
+
+#if API_USE_TLS
+// Root CA that signed the API server certificate (PEM)
+// Replace with the CA of your server; the certificate must name API_HOST (or carry it as a DNS SAN)
+static const char apiRootCa[] =
+  "-----BEGIN CERTIFICATE-----\n"
+  "REPLACE_WITH_YOUR_ROOT_CA\n"
+  "-----END CERTIFICATE-----\n";
+#endif
+
+// Fixed transmit buffer, and a small receive buffer for chunked acknowledgements;
+// used only by the task running API requests
+static uint8_t apiTxBuffer[API_TX_BUFFER_SIZE];
+static char apiRxBuffer[API_RX_BUFFER_SIZE];
+
+// Initialize API with user ID; runs once, from setup() or later from the main loop
+// Everything is set up before apiReady is published, so the network task, which checks
+// isApiInitialized() first, never sees the URLs or the broker session half written
 void apiInit(const String& id) {
+  if (isApiInitialized()) {
+    logWarning("API", "API already initialized, ignoring userId " + id);
+    return;
+  }
+  
   // Store user ID
   userId = id;
   logInfo("API", "Initializing API with userId: " + userId);
@@ -23,134 +99,430 @@ void apiInit(const String& id) {
   notificationApiUrl = String(API_BASE_URL) + "/add-notification/" + userId + "/";
   batteryStatusApiUrl = String(API_BASE_URL) + "/save-battery-status/" + userId + "/";
   childDataApiUrl = String(API_BASE_URL) + "/child_data/" + userId + "/";
+  telemetryBatchApiUrl = String(API_BASE_URL) + "/save-telemetry-batch/" + userId + "/";
+  
+  // Keep the TCP connection open between requests to the same server
+  apiHttp.setReuse(true);
+  
+#if API_USE_TLS
+  // Reconnects resume the cached TLS session instead of a full handshake
+  if (!apiTlsClient.setCACert(apiRootCa)) {
+    logError("API", "TLS not available, API requests will fail");
+  }
+#endif
   
+  // Nothing has failed yet
+  breakerInit(&serverBreaker, "server");
+  for (int i = 0; i < API_ENDPOINT_COUNT; i++) {
+    breakerInit(&endpointBreakers[i], endpointNames[i]);
+  }
+  
+  // Broker session for uplink when available; connects from the network task
+  mqttInit(userId);
+  
+  __atomic_store_n(&apiReady, true, __ATOMIC_RELEASE);
   logInfo("API", "API endpoints configured");
 }
 
+// Check if API has been initialized with a user ID
+bool isApiInitialized() {
+  return __atomic_load_n(&apiReady, __ATOMIC_ACQUIRE);
+}
+
+// Requests need a link and the endpoint URLs
+static bool apiOnline() {
+  return isApiInitialized() && isNetworkConnected();
+}
+
+// Close the persistent API connection
+void apiDisconnect() {
+  if (apiClient.connected()) {
+    logInfo("API", "Closing API connection");
+  }
+  apiHttp.end();
+  apiClient.stop();
+}
+
+// Set the connect and response timeout for following requests
+void apiSetRequestTimeout(uint16_t timeoutMs) {
+  apiRequestTimeout = timeoutMs;
+}
+
+// Set a check that makes a request give up, before it starts or while it is running
+void apiSetAbortCheck(ApiAbortCheck check) {
+  apiAbortCheck = check;
+}
+
+// Let following requests through even while their circuit is open (used for emergencies)
+void apiSetIgnoreBackoff(bool ignore) {
+  apiIgnoreBackoff = ignore;
+}
+
+// Find the breaker for a request URL
+static CircuitBreaker* breakerForUrl(const String& url) {
+  for (int i = 0; i < API_ENDPOINT_OTHER; i++) {
+    if (url == *endpointUrls[i]) {
+      return &endpointBreakers[i];
+    }
+  }
+  return &endpointBreakers[API_ENDPOINT_OTHER];
+}
+
+// Check the server and endpoint breakers before using the radio
+static bool requestAllowed(CircuitBreaker* endpoint, const String& url) {
+  if (!apiIgnoreBackoff) {
+    CircuitBreaker* blocking = !breakerReady(&serverBreaker) ? &serverBreaker
+                             : !breakerReady(endpoint) ? endpoint : NULL;
+    if (blocking != NULL) {
+      LOGI("API", "Backing off %s for another %lus (%s)", url, breakerWaitTime(blocking) / 1000, blocking->name);
+      return false;
+    }
+  }
+  breakerBegin(&serverBreaker);
+  breakerBegin(endpoint);
+  return true;
+}
+
+// Check whether the current request should give up; once it has, it stays aborted
+// Also polled by the link client while the request connects, waits and reads
+static bool requestAborted() {
+  if (!apiAborted && apiAbortCheck != NULL && apiAbortCheck()) {
+    apiAborted = true;
+  }
+  return apiAborted;
+}
+
+// Check whether the last request gave up for higher priority traffic
+bool apiLastRequestAborted() {
+  return apiAborted;
+}
+
+// Close the kept-alive connection if it has been idle longer than the server keeps it open
+static void closeIdleConnection() {
+  if (apiClient.connected() && millis() - apiLastRequestTime > API_KEEPALIVE_IDLE_TIMEOUT) {
+    logInfo("API", "API connection idle for too long, closing");
+    apiDisconnect();
+  }
+}
+
+// Location and battery values handed to the encoders
+struct CoordinateContext {
+  const char* key;
+  float value;
+  bool withUserId;
+  uint32_t seq;
+};
+
+// A whole fix, for the single MQTT location message
+struct LocationContext {
+  float latitude;
+  float longitude;
+  uint32_t seq;
+};
+
+// Battery reading handed to the encoder
+struct BatteryContext {
+  int percentage;
+  uint32_t seq;
+};
+
+// Notification fields handed to the encoder
+struct NotificationContext {
+  const char* title;
+  const char* message;
+  int priority;
+  const char* deliveredAt;
+  uint32_t seq;
+};
+
+// Encode {"latitude": ..., "userId": ..., "seq": ...} or {"longitude": ..., "seq": ...}
+static bool encodeCoordinate(PayloadWriter* writer, const void* context) {
+  const CoordinateContext* coordinate = (const CoordinateContext*)context;
+  payloadBeginMap(writer, coordinate->withUserId ? 3 : 2);
+  payloadKey(writer, coordinate->key);
+  payloadFloat(writer, coordinate->value, 6);
+  if (coordinate->withUserId) {
+    payloadKey(writer, "userId");
+    payloadString(writer, userId.c_str());
+  }
+  payloadKey(writer, "seq");
+  payloadUInt(writer, coordinate->seq);
+  payloadEndMap(writer);
+  return true;
+}
+
+// Encode {"latitude": ..., "longitude": ..., "seq": ...} for a single MQTT location message
+static bool encodeLocation(PayloadWriter* writer, const void* context) {
+  const LocationContext* location = (const LocationContext*)context;
+  payloadBeginMap(writer, 3);
+  payloadKey(writer, "latitude");
+  payloadFloat(writer, location->latitude, 6);
+  payloadKey(writer, "longitude");
+  payloadFloat(writer, location->longitude, 6);
+  payloadKey(writer, "seq");
+  payloadUInt(writer, location->seq);
+  payloadEndMap(writer);
+  return true;
+}
+
+// Encode {"batteryPercentage": ..., "seq": ...}
+static bool encodeBattery(PayloadWriter* writer, const void* context) {
+  const BatteryContext* battery = (const BatteryContext*)context;
+  payloadBeginMap(writer, 2);
+  payloadKey(writer, "batteryPercentage");
+  payloadInt(writer, battery->percentage);
+  payloadKey(writer, "seq");
+  payloadUInt(writer, battery->seq);
+  payloadEndMap(writer);
+  return true;
+}
+
+// Encode a notification
+static bool encodeNotification(PayloadWriter* writer, const void* context) {
+  const NotificationContext* notification = (const NotificationContext*)context;
+  payloadBeginMap(writer, 5);
+  payloadKey(writer, "title");
+  payloadString(writer, notification->title);
+  payloadKey(writer, "message");
+  payloadString(writer, notification->message);
+  payloadKey(writer, "priority");
+  payloadInt(writer, notification->priority);
+  payloadKey(writer, "delivered_at"); // Campo renombrado de timestamp a delivered_at
+  payloadString(writer, notification->deliveredAt);
+  payloadKey(writer, "seq");
+  payloadUInt(writer, notification->seq);
+  payloadEndMap(writer);
+  return true;
+}
+
+// Encode a JSON body into the transmit buffer and publish it on the broker session
+// MQTT carries no content type, so this path always uses JSON
+static bool publishEncoded(const char* subtopic, PayloadEncoder encoder, const void* context, int qos) {
+  PayloadWriter writer;
+  payloadBegin(&writer, apiTxBuffer, sizeof(apiTxBuffer), PAYLOAD_JSON);
+  if (!encoder(&writer, context) || payloadOverflowed(&writer)) {
+    logError("API", "MQTT payload does not fit in transmit buffer: " + String(subtopic));
+    return false;
+  }
+  return mqttPublish(subtopic, apiTxBuffer, payloadLength(&writer), qos);
+}
+
+// Service the broker session (call often from the network task)
+void apiPoll() {
+  mqttMaintain();
+}
+
 // Send GPS data to API
+// The fix takes one sequence number, shared by both coordinate requests and any replay;
+// the two requests go to different endpoints, so each gets its own key suffix
 bool sendGpsData(float latitude, float longitude) {
-  if (!isNetworkConnected()) {
-    logError("API", "Network not connected, cannot send GPS data");
+  uint32_t seq = sequenceNext();
+  if (!apiOnline()) {
+    logError("API", "API offline, storing GPS data in outbox");
+    outboxStoreLocation(latitude, longitude, seq);
     return false;
   }
   
-  logInfo("API", "Sending GPS data: Lat: " + String(latitude, 6) + ", Lon: " + String(longitude, 6));
-  
-  // Create JSON payloads
-  StaticJsonDocument<128> latDoc;
-  latDoc["latitude"] = latitude;
-  latDoc["userId"] = userId;
+  LOGI("API", "Sending GPS data: Lat: %.6f, Lon: %.6f", latitude, longitude);
   
-  StaticJsonDocument<128> lonDoc;
-  lonDoc["longitude"] = longitude;
-  
-  // Serialize JSON
-  String latPayload;
-  String lonPayload;
-  serializeJson(latDoc, latPayload);
-  serializeJson(lonDoc, lonPayload);
+  // Routine fixes go fire-and-forget when the broker session is up
+  if (mqttIsConnected()) {
+    LocationContext location = { latitude, longitude, seq };
+    if (publishEncoded("gps", encodeLocation, &location, MQTT_QOS_ROUTINE)) {
+      return true;
+    }
+  }
   
   // Send both latitude and longitude
-  bool latSuccess = false;
-  bool lonSuccess = false;
-  String response;
+  CoordinateContext latContext = { "latitude", latitude, true, seq };
+  CoordinateContext lonContext = { "longitude", longitude, false, seq };
+  char key[SEQUENCE_KEY_LENGTH];
+  sequenceFormatKey(key, sizeof(key), seq);
+  char latKey[SEQUENCE_KEY_LENGTH];
+  char lonKey[SEQUENCE_KEY_LENGTH];
+  snprintf(latKey, sizeof(latKey), "%s-lat", key);
+  snprintf(lonKey, sizeof(lonKey), "%s-lon", key);
   
-  latSuccess = sendHttpRequest(latitudeApiUrl, latPayload, &response);
+  bool latSuccess = sendEncodedRequest(latitudeApiUrl, encodeCoordinate, &latContext, latKey);
   if (latSuccess) {
     logInfo("API", "Latitude sent successfully");
   } else {
     logError("API", "Failed to send latitude");
   }
   
-  lonSuccess = sendHttpRequest(longitudeApiUrl, lonPayload, &response);
+  bool lonSuccess = sendEncodedRequest(longitudeApiUrl, encodeCoordinate, &lonContext, lonKey);
   if (lonSuccess) {
     logInfo("API", "Longitude sent successfully");
   } else {
     logError("API", "Failed to send longitude");
   }
   
+  // Keep the fix for replay through the batch endpoint
+  if (!latSuccess || !lonSuccess) {
+    outboxStoreLocation(latitude, longitude, seq);
+  }
+  
   return latSuccess && lonSuccess;
 }
 
 // Send battery status to API
 bool sendBatteryStatus(int percentage) {
-  if (!isNetworkConnected()) {
-    logError("API", "Network not connected, cannot send battery status");
+  BatteryContext battery = { percentage, sequenceNext() };
+  if (!apiOnline()) {
+    logError("API", "API offline, storing battery status in outbox");
+    outboxStoreBattery(percentage, battery.seq);
     return false;
   }
   
-  logInfo("API", "Sending battery status: " + String(percentage) + "%");
+  LOGI("API", "Sending battery status: %d%%", percentage);
   
-  // Create JSON payload
-  StaticJsonDocument<128> doc;
-  doc["batteryPercentage"] = percentage;
-  
-  // Serialize JSON
-  String payload;
-  serializeJson(doc, payload);
-  
-  // Send request
-  String response;
-  bool success = sendHttpRequest(batteryStatusApiUrl, payload, &response);
+  bool success = false;
+  if (mqttIsConnected()) {
+    success = publishEncoded("battery", encodeBattery, &battery, MQTT_QOS_ROUTINE);
+  }
+  if (!success) {
+    char key[SEQUENCE_KEY_LENGTH];
+    sequenceFormatKey(key, sizeof(key), battery.seq);
+    success = sendEncodedRequest(batteryStatusApiUrl, encodeBattery, &battery, key);
+  }
   
   if (success) {
     logInfo("API", "Battery status sent successfully");
   } else {
     logError("API", "Failed to send battery status");
+    outboxStoreBattery(percentage, battery.seq);
   }
   
   return success;
 }
 
-// Send notification to API
+// Post a notification with the given delivery time string
+static bool postNotification(const char* title, const char* message, int priority, const char* deliveredAt,
+                             uint32_t seq) {
+  LOGI("API", "Sending notification %lu: %s - %s", seq, title, message);
+  
+  NotificationContext context = { title, message, priority, deliveredAt, seq };
+  bool success = false;
+  if (mqttIsConnected()) {
+    success = publishEncoded("notification", encodeNotification, &context, MQTT_QOS_RELIABLE);
+  }
+  if (!success) {
+    char key[SEQUENCE_KEY_LENGTH];
+    sequenceFormatKey(key, sizeof(key), seq);
+    success = sendEncodedRequest(notificationApiUrl, encodeNotification, &context, key);
+  }
+  
+  if (success) {
+    logInfo("API", "Notification sent successfully");
+  } else {
+    logError("API", "Failed to send notification");
+  }
+  
+  return success;
+}
+
+// Send notification to API; undelivered notifications are kept in the outbox
 bool sendNotification(const char* title, const char* message, int priority) {
-  if (!isNetworkConnected()) {
-    logError("API", "Network not connected, cannot send notification");
+  uint32_t seq = sequenceNext();
+  if (!apiOnline()) {
+    logError("API", "API offline, storing notification in outbox");
+    outboxStoreNotification(title, message, priority, seq);
     return false;
   }
   
-  logInfo("API", "Sending notification: " + String(title) + " - " + String(message));
+  bool success = postNotification(title, message, priority, getCurrentTimeString().c_str(), seq);
+  if (!success) {
+    outboxStoreNotification(title, message, priority, seq);
+  }
+  
+  return success;
+}
+
+// Send a notification replayed from the outbox with its original time and sequence number
+bool sendStoredNotification(const char* title, const char* message, int priority, uint32_t wallTime,
+                            uint32_t seq) {
+  if (!apiOnline()) {
+    return false;
+  }
   
-  // Create JSON payload
-  StaticJsonDocument<256> doc;
-  doc["title"] = title;
-  doc["message"] = message;
-  doc["priority"] = priority;
-  doc["delivered_at"] = getCurrentTimeString(); // Campo renombrado de timestamp a delivered_at
+  char deliveredAt[CLOCK_TIMESTAMP_LENGTH] = "Time not set";
+  if (wallTime > 0) {
+    clockFormatUnix(wallTime, deliveredAt, sizeof(deliveredAt));
+  }
   
-  // Serialize JSON
-  String payload;
-  serializeJson(doc, payload);
+  return postNotification(title, message, priority, deliveredAt, seq);
+}
+
+// Send a batch of telemetry samples to API; the encoder writes the batch body
+// Over MQTT a reliable batch is published with QoS 1, a housekeeping-only batch with QoS 0
+// Every sample carries its own seq, so a batch resent in a different grouping is still deduplicated
+bool sendTelemetryBatch(PayloadEncoder encoder, const void* context, const char* idempotencyKey, bool reliable) {
+  if (!apiOnline()) {
+    logError("API", "API offline, cannot send telemetry batch");
+    return false;
+  }
   
-  // Send request
-  String response;
-  bool success = sendHttpRequest(notificationApiUrl, payload, &response);
+  bool success = false;
+  if (mqttIsConnected()) {
+    success = publishEncoded("telemetry", encoder, context, reliable ? MQTT_QOS_RELIABLE : MQTT_QOS_ROUTINE);
+  }
+  if (!success) {
+    success = sendEncodedRequest(telemetryBatchApiUrl, encoder, context, idempotencyKey);
+  }
   
   if (success) {
-    logInfo("API", "Notification sent successfully");
+    logInfo("API", "Telemetry batch sent successfully");
   } else {
-    logError("API", "Failed to send notification");
+    logError("API", "Failed to send telemetry batch");
   }
   
   return success;
 }
 
-// Fetch child data from API
-bool fetchChildData(String* childData) {
-  if (!isNetworkConnected()) {
-    logError("API", "Network not connected, cannot fetch child data");
+// Fetch child data from API into buffer (bounded by capacity)
+// The stored copy is revalidated with its ETag and only downloaded again when it changed
+bool fetchChildData(char* buffer, size_t capacity) {
+  if (!apiOnline()) {
+    logError("API", "API offline, cannot fetch child data");
     return false;
   }
   
   logInfo("API", "Fetching child data from API");
   
-  // Send request
-  String response;
-  bool success = sendHttpRequest(childDataApiUrl, "", &response);
+  String storedEtag = loadString("child_etag", "");
+  HttpConditional conditional;
+  conditional.ifNoneMatch = storedEtag.length() > 0 ? storedEtag.c_str() : NULL;
+  
+  // Stream the response straight into the caller's buffer
+  BufferSink sink;
+  bufferSinkBegin(&sink, buffer, capacity);
+  bool success = sendHttpRequestToSink(childDataApiUrl, bufferSinkWrite, &sink, &conditional);
+  
+  if (success && conditional.notModified) {
+    if (loadCachedChildData(buffer, capacity)) {
+      logInfo("API", "Child data unchanged, using stored copy");
+      return true;
+    }
+    // The ETag outlived its data; forget it so the next fetch downloads in full
+    removeKey("child_etag");
+    return false;
+  }
   
-  if (success && response.length() > 0) {
-    *childData = response;
-    logInfo("API", "Child data fetched successfully");
+  if (sink.overflowed) {
+    logError("API", "Child data larger than " + String(capacity - 1) + " bytes");
+    buffer[0] = '\0';
+    return false;
+  }
+  
+  if (success && sink.length > 0) {
+    // Data first, so an interrupted update never pairs a new ETag with old data
+    saveBytes("child_data", buffer, sink.length);
+    if (conditional.etag[0] != '\0') {
+      saveString("child_etag", conditional.etag);
+    } else if (storedEtag.length() > 0) {
+      removeKey("child_etag");
+    }
+    LOGI("API", "Child data fetched successfully (%u bytes)", sink.length);
     return true;
   } else {
     logError("API", "Failed to fetch child data");
@@ -158,81 +530,325 @@ bool fetchChildData(String* childData) {
   }
 }
 
-// Enhanced HTTP request with proper error handling and response validation
-bool sendHttpRequest(String url, String payload, String* response, int maxRetries) {
+// Load the last fetched child data from preferences
+bool loadCachedChildData(char* buffer, size_t capacity) {
+  size_t length = loadBytes("child_data", buffer, capacity - 1);
+  buffer[length] = '\0';
+  return length > 0;
+}
+
+// Current request body encoding: JSON, unless the server has asked for MessagePack
+// Older servers may misread a MessagePack body rather than refuse it, so it is never assumed
+PayloadFormat apiPayloadFormat() {
+  return configGetBool(CONFIG_API_MSGPACK) ? PAYLOAD_MSGPACK : PAYLOAD_JSON;
+}
+
+// Read the success flag and any downlink config of an acknowledgement straight from the response stream
+// The filter keeps only "success" and "cfg", so the document stays small whatever else the server sends
+// Sets *clean to false when bytes of the body may be left unread on the socket
+static bool readAcknowledgement(bool msgpack, bool* clean) {
+  StaticJsonDocument<32> filter;
+  filter["success"] = true;
+  filter["cfg"] = true;
+  StaticJsonDocument<API_ACK_DOCUMENT_SIZE> doc;
+  DeserializationError error;
+  
+  *clean = true;
+  int size = apiHttp.getSize();
+  
+  // Empty response but status code is 200, consider it a success
+  if (size == 0) {
+    return true;
+  }
+  
+  if (size > 0) {
+    // Known length: parse incrementally, then skip whatever the parser did not need
+    if (requestAborted()) {
+      *clean = false;
+      return false;
+    }
+    BoundedStream body(*apiHttp.getStreamPtr(), size);
+    if (msgpack) {
+      error = deserializeMsgPack(doc, body, DeserializationOption::Filter(filter));
+    } else {
+      error = deserializeJson(doc, body, DeserializationOption::Filter(filter));
+    }
+    *clean = body.drain();
+  } else {
+    // Chunked: the client decodes the chunks into the small receive buffer
+    BufferSink sink;
+    bufferSinkBegin(&sink, apiRxBuffer, sizeof(apiRxBuffer));
+    SinkStream out(bufferSinkWrite, &sink);
+    *clean = apiHttp.writeToStream(&out) >= 0;
+    if (msgpack) {
+      error = deserializeMsgPack(doc, apiRxBuffer, sink.length, DeserializationOption::Filter(filter));
+    } else {
+      error = deserializeJson(doc, apiRxBuffer, sink.length, DeserializationOption::Filter(filter));
+    }
+  }
+  
+  if (error) {
+    // Response could not be parsed, but status code is 200, so it's probably OK
+    logInfo("API", "Response is not JSON but status code is OK (" + String(error.c_str()) + ")");
+    return true;
+  }
+  
+  // Config pushed by the server rides on the acknowledgement
+  if (doc.containsKey("cfg")) {
+    downlinkReceive(doc["cfg"].as<JsonObjectConst>());
+  }
+  
+  // Check for success indicator in response
+  if (doc.containsKey("success")) {
+    return doc["success"].as<bool>();
+  }
+  
+  // No explicit success field, assume success since status code is 200
+  return true;
+}
+
+// Stream the response body to a sink in fixed-size pieces
+// Sets *clean to false when the rest of the body was left unread on the socket
+static bool streamResponseBody(HttpBodySink sink, void* context, bool* clean) {
+  int size = apiHttp.getSize();
+  
+  // Chunked: the client decodes the chunks and writes them to the sink
+  if (size < 0) {
+    SinkStream out(sink, context);
+    int written = apiHttp.writeToStream(&out);
+    *clean = written >= 0;
+    return written >= 0 && !out.failed();
+  }
+  
+  BoundedStream body(*apiHttp.getStreamPtr(), size);
+  char chunk[API_STREAM_CHUNK_SIZE];
+  while (body.remaining() > 0) {
+    if (requestAborted()) {
+      *clean = false;
+      return false;
+    }
+    size_t count = body.readBytes(chunk, sizeof(chunk));
+    if (count == 0 || !sink((const uint8_t*)chunk, count, context)) {
+      *clean = false;
+      return false;
+    }
+  }
+  
+  *clean = true;
+  return true;
+}
+
+// Send a request body, unless the endpoint is backing off
+// Without a sink only the success flag of the response is read; with a sink the whole body
+// is streamed to it
+// A failed request is not retried here: its outcome feeds the breakers and the caller keeps
+// the data (outbox, next interval) until breakerReady() allows another attempt
+// Requests share one kept-alive connection; a stale socket is reopened transparently
+// The abort check is polled from connect until the body is read; an aborted request closes
+// the connection and leaves the breakers as they were
+// Sets *formatRejected when the server answers 415 to a MessagePack body
+static bool performRequest(const String& url, const uint8_t* body, size_t length, PayloadFormat format,
+                           HttpBodySink sink, void* sinkContext, HttpConditional* conditional,
+                           const char* idempotencyKey, bool* formatRejected) {
+  static const char* responseHeaders[] = { "Content-Type", "ETag", "Retry-After", "Date" };
+  *formatRejected = false;
+  if (!isApiInitialized()) {
+    return false;
+  }
+  
+  CircuitBreaker* endpoint = breakerForUrl(url);
   bool success = false;
-  int attempts = 0;
   
-  while (!success && attempts < maxRetries) {
-    HTTPClient http;
-    http.setTimeout(HTTP_TIMEOUT);
+  if (conditional != NULL) {
+    conditional->etag[0] = '\0';
+    conditional->notModified = false;
+  }
+  apiAborted = false;
+  if (requestAborted()) {
+    LOGI("API", "Request aborted for higher priority traffic: %s", url);
+    return false;
+  }
+  if (!requestAllowed(endpoint, url)) {
+    return false;
+  }
+  closeIdleConnection();
+  apiLinkClient.setAbortCheck(requestAborted);
+  
+  for (;;) {
+    // Remember whether this attempt rides on an already open connection
+    bool reusingConnection = apiClient.connected();
     
-    // Begin connection
-    http.begin(url);
+    // Begin request on the persistent connection
+    apiHttp.setConnectTimeout(apiRequestTimeout);
+    apiHttp.setTimeout(apiRequestTimeout);
+    apiHttp.begin(apiClient, url);
+    apiHttp.collectHeaders(responseHeaders, 4);
     
     // Add headers including authentication
-    http.addHeader("Content-Type", "application/json");
-    http.addHeader("X-API-KEY", API_KEY);
+    apiHttp.addHeader("Content-Type", payloadContentType(format));
+    if (sink != NULL || format == PAYLOAD_JSON) {
+      apiHttp.addHeader("Accept", "application/json");
+    } else {
+      apiHttp.addHeader("Accept", "application/msgpack, application/json");
+    }
+    apiHttp.addHeader("X-API-KEY", API_KEY);
+    if (idempotencyKey != NULL) {
+      apiHttp.addHeader("Idempotency-Key", idempotencyKey);
+    }
+    if (conditional != NULL && conditional->ifNoneMatch != NULL) {
+      apiHttp.addHeader("If-None-Match", conditional->ifNoneMatch);
+    }
     
     // Send request
     int httpCode;
-    if (payload.length() > 0) {
-      httpCode = http.POST(payload);
+    if (length > 0) {
+      httpCode = apiHttp.POST((uint8_t*)body, length);
     } else {
-      httpCode = http.GET();
+      httpCode = apiHttp.GET();
     }
     
     // Check response
+    bool keepConnection = httpCode >= 0;
+    bool streamFailed = false;
+    bool aborted = false;
+    uint32_t retryAfter = apiHttp.header("Retry-After").toInt() * 1000UL;
+    if (httpCode > 0) {
+      // Keeps the clock set on links without SNTP or network time
+      clockSyncHttpDate(apiHttp.header("Date").c_str());
+    }
     if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_CREATED) {
-      String responseStr = http.getString();
-      
-      // If response is not empty, try to parse it as JSON
-      if (responseStr.length() > 0) {
-        StaticJsonDocument<512> doc;
-        DeserializationError error = deserializeJson(doc, responseStr);
-        
-        if (!error) {
-          // Check for success indicator in response
-          if (doc.containsKey("success")) {
-            success = doc["success"].as<bool>();
-          } else {
-            // No explicit success field, assume success since status code is 200
-            success = true;
-          }
-        } else {
-          // Response is not valid JSON, but status code is 200, so it's probably OK
-          logInfo("API", "Response is not JSON but status code is OK: " + responseStr);
-          success = true;
-        }
+      bool clean;
+      if (conditional != NULL) {
+        strncpy(conditional->etag, apiHttp.header("ETag").c_str(), API_ETAG_MAX_LENGTH - 1);
+        conditional->etag[API_ETAG_MAX_LENGTH - 1] = '\0';
+      }
+      if (sink != NULL) {
+        success = streamResponseBody(sink, sinkContext, &clean);
+        streamFailed = !success && !apiAborted;
       } else {
-        // Empty response but status code is 200, consider it a success
-        success = true;
+        bool msgpack = apiHttp.header("Content-Type").indexOf("msgpack") >= 0;
+        success = readAcknowledgement(msgpack, &clean);
       }
       
-      // Store response if pointer provided
-      if (response != NULL) {
-        *response = responseStr;
+      // Unread bytes would corrupt the next response on this socket
+      if (!clean) {
+        keepConnection = false;
       }
       
       if (success) {
-        logInfo("API", "HTTP request successful: " + url);
+        LOGI("API", "HTTP request successful: %s (%u bytes sent)", url, length);
+      } else if (apiAborted) {
+        aborted = true;
+        LOGI("API", "Response read aborted for higher priority traffic: %s", url);
       } else {
         logError("API", "API returned error in response body");
       }
+    } else if (httpCode == HTTP_CODE_NOT_MODIFIED && conditional != NULL) {
+      // Stored copy is current; a 304 has no body
+      conditional->notModified = true;
+      success = true;
+      LOGI("API", "Not modified: %s", url);
+    } else if (httpCode == HTTP_CODE_UNSUPPORTED_MEDIA_TYPE && format == PAYLOAD_MSGPACK) {
+      // The caller re-encodes the body as JSON and sends it straight away
+      *formatRejected = true;
+      apiHttp.end();
+      apiLinkClient.setAbortCheck(NULL);
+      apiLastRequestTime = millis();
+      breakerSuccess(&serverBreaker);
+      breakerSuccess(endpoint);
+      return false;
+    } else if (httpCode < 0 && apiAborted) {
+      aborted = true;
+      LOGI("API", "Request aborted for higher priority traffic: %s", url);
+    } else if (httpCode < 0 && reusingConnection) {
+      // The server closed the kept-alive socket while it was idle; reconnect
+      // and resend straight away without counting this as a failed attempt
+      logInfo("API", "Kept-alive connection was closed by server, reconnecting");
+      apiDisconnect();
+      continue;
     } else {
-      logError("API", "HTTP request failed with code: " + String(httpCode));
+      LOGE("API", "HTTP request failed with code: %d", httpCode);
+    }
+    
+    // Release the request; the socket stays open for reuse unless it can no longer be trusted
+    apiLinkClient.setAbortCheck(NULL);
+    apiHttp.end();
+    if (!keepConnection) {
+      apiClient.stop();
     }
+    apiLastRequestTime = millis();
     
-    http.end();
-    attempts++;
+    if (streamFailed) {
+      LOGE("API", "Response body could not be stored: %s", url);
+    }
     
-    // If request failed, wait before retry with progressive backoff
-    if (!success && attempts < maxRetries) {
-      int delayTime = 500 * attempts;
-      logInfo("API", "Retrying in " + String(delayTime) + "ms...");
-      delay(delayTime);
+    // No answer means the link or server is down; 408, 429 and 5xx mean this endpoint is
+    // struggling. Any other answer proves both alive, even if the request itself was refused.
+    // An aborted request says nothing about either.
+    if (aborted) {
+      breakerCancel(&serverBreaker);
+      breakerCancel(endpoint);
+    } else if (httpCode < 0) {
+      breakerFailure(&serverBreaker);
+      breakerFailure(endpoint);
+    } else if (httpCode == 408 || httpCode == 429 || httpCode >= 500) {
+      breakerSuccess(&serverBreaker);
+      breakerFailure(endpoint, retryAfter);
+    } else {
+      breakerSuccess(&serverBreaker);
+      breakerSuccess(endpoint);
     }
+    
+    return success;
+  }
+}
+
+// Encode a body in the current format straight into the transmit buffer and send it
+// If the server refuses MessagePack the body is re-encoded as JSON and JSON is kept until the
+// server asks for MessagePack again
+// idempotencyKey (sequence.h) lets the server recognise a resend of the same data
+bool sendEncodedRequest(const String& url, PayloadEncoder encoder, const void* context, const char* idempotencyKey) {
+  for (;;) {
+    PayloadFormat format = apiPayloadFormat();
+    PayloadWriter writer;
+    payloadBegin(&writer, apiTxBuffer, sizeof(apiTxBuffer), format);
+    if (!encoder(&writer, context) || payloadOverflowed(&writer)) {
+      logError("API", "Request body does not fit in transmit buffer: " + url);
+      return false;
+    }
+    
+    bool formatRejected;
+    bool success = performRequest(url, apiTxBuffer, payloadLength(&writer), format, NULL, NULL, NULL,
+                                  idempotencyKey, &formatRejected);
+    if (!formatRejected) {
+      return success;
+    }
+    
+    logWarning("API", "Server does not accept MessagePack, switching to JSON");
+    configSetBool(CONFIG_API_MSGPACK, false);
+  }
+}
+
+// Send a JSON body (or GET when empty) and return up to API_RX_BUFFER_SIZE bytes of the response
+bool sendHttpRequest(String url, String payload, String* response) {
+  bool formatRejected;
+  if (response == NULL) {
+    return performRequest(url, (const uint8_t*)payload.c_str(), payload.length(), PAYLOAD_JSON, NULL, NULL, NULL,
+                          NULL, &formatRejected);
   }
   
+  BufferSink sink;
+  bufferSinkBegin(&sink, apiRxBuffer, sizeof(apiRxBuffer));
+  bool success = performRequest(url, (const uint8_t*)payload.c_str(), payload.length(), PAYLOAD_JSON,
+                                bufferSinkWrite, &sink, NULL, NULL, &formatRejected);
+  if (success) {
+    *response = apiRxBuffer;
+  }
   return success;
 }
+
+// GET url and stream the response body to sink, optionally as a conditional request
+bool sendHttpRequestToSink(const String& url, HttpBodySink sink, void* context, HttpConditional* conditional) {
+  bool formatRejected;
+  return performRequest(url, NULL, 0, PAYLOAD_JSON, sink, context, conditional, NULL, &formatRejected);
+}
@@ -3,23 +3,70 @@
 
 #include <Arduino.h>
 #include <HTTPClient.h>
+#include <WiFiClient.h>
+#include "payload_writer.h"
+#include "http_stream.h"
 
 // API settings
 #define HTTP_TIMEOUT 10000
-#define HTTP_MAX_RETRIES 3
+#define API_KEEPALIVE_IDLE_TIMEOUT 30000  // Close the kept-alive connection after 30s idle
+#define API_TX_BUFFER_SIZE 3072            // Largest encoded request body (a full telemetry batch)
+#define API_RX_BUFFER_SIZE 256             // Chunked acknowledgements and short text responses
+#define API_STREAM_CHUNK_SIZE 128          // Piece size when streaming a body to a sink
+#define API_ACK_DOCUMENT_SIZE 768          // Parsed acknowledgement including a downlink config block
+#define API_CHILD_DATA_MAX_SIZE 512        // Largest child data body accepted
+#define API_ETAG_MAX_LENGTH 64
 
 // API Authentication
 #define API_KEY "safety_bracelet_api_key"  // Replace with your actual API key
 
+// TLS for the API connection (build with -DAPI_USE_TLS=1 for production)
+#ifndef API_USE_TLS
+#define API_USE_TLS 0
+#endif
+
 // API Endpoints base
+// Over TLS the server certificate is checked against the host in the URL, which is also sent
+// as SNI, so it has to be the name the certificate was issued for rather than an IP address
+#if API_USE_TLS
+#ifndef API_HOST
+#error "API_USE_TLS needs -DAPI_HOST=\"<host name on the server certificate>\""
+#endif
+#define API_BASE_URL "https://" API_HOST ":8443"
+#else
 #define API_BASE_URL "http://16.170.159.206:8000"
+#endif
+
+// Conditional GET: sends ifNoneMatch, receives the new ETag and whether the stored copy is still current
+struct HttpConditional {
+  const char* ifNoneMatch;
+  char etag[API_ETAG_MAX_LENGTH];
+  bool notModified;
+};
+
+// Returns true when the current request should give up
+typedef bool (*ApiAbortCheck)();
 
 // Functions
 void apiInit(const String& userId);
+bool isApiInitialized();
 bool sendGpsData(float latitude, float longitude);
 bool sendBatteryStatus(int percentage);
 bool sendNotification(const char* title, const char* message, int priority);
-bool fetchChildData(String* childData);
-bool sendHttpRequest(String url, String payload, String* response, int maxRetries = HTTP_MAX_RETRIES);
+bool sendStoredNotification(const char* title, const char* message, int priority, uint32_t wallTime, uint32_t seq);
+bool sendTelemetryBatch(PayloadEncoder encoder, const void* context, const char* idempotencyKey, bool reliable);
+bool fetchChildData(char* buffer, size_t capacity);
+bool loadCachedChildData(char* buffer, size_t capacity);
+bool sendHttpRequest(String url, String payload, String* response);
+bool sendHttpRequestToSink(const String& url, HttpBodySink sink, void* context, HttpConditional* conditional = NULL);
+bool sendEncodedRequest(const String& url, PayloadEncoder encoder, const void* context,
+                        const char* idempotencyKey = NULL);
+PayloadFormat apiPayloadFormat();
+void apiDisconnect();
+void apiPoll();
+void apiSetRequestTimeout(uint16_t timeoutMs);
+void apiSetAbortCheck(ApiAbortCheck check);
+bool apiLastRequestAborted();
+void apiSetIgnoreBackoff(bool ignore);
 
 #endif // API_H
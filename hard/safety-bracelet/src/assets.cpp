@@ -0,0 +1,146 @@
+#include "assets.h"
+#include "utils.h"
+#include <esp_partition.h>
+#include <esp32/rom/crc.h>
+
+static_assert(sizeof(AssetBundleHeader) == 20, "AssetBundleHeader must match tools/mkassets.py");
+static_assert(sizeof(AssetEntry) == 32, "AssetEntry must match tools/mkassets.py");
+
+// Mapped bundle; stays mapped for the life of the program
+static const uint8_t* bundle = NULL;
+static const AssetBundleHeader* header = NULL;
+static const AssetEntry* entries = NULL;
+static spi_flash_mmap_handle_t mapHandle;
+
+// Check that the header and index describe a bundle that fits the partition
+static bool validBundle(const esp_partition_t* partition) {
+  if (header->magic != ASSETS_MAGIC) {
+    logInfo("ASSETS", "No asset bundle flashed");
+    return false;
+  }
+  if (header->formatVersion != ASSETS_FORMAT_VERSION) {
+    LOGE("ASSETS", "Asset bundle format %u, expected %u", (unsigned)header->formatVersion, ASSETS_FORMAT_VERSION);
+    return false;
+  }
+  uint32_t indexEnd = sizeof(AssetBundleHeader) + header->count * sizeof(AssetEntry);
+  if (header->size < indexEnd || header->size > partition->size) {
+    LOGE("ASSETS", "Asset bundle size %lu does not fit the partition", header->size);
+    return false;
+  }
+  if (crc32_le(0, bundle + sizeof(AssetBundleHeader), header->size - sizeof(AssetBundleHeader)) != header->crc) {
+    logError("ASSETS", "Asset bundle CRC mismatch, flash it again");
+    return false;
+  }
+
+  const AssetEntry* index = (const AssetEntry*)(bundle + sizeof(AssetBundleHeader));
+  for (uint16_t i = 0; i < header->count; i++) {
+    const AssetEntry& entry = index[i];
+    if (entry.name[ASSETS_NAME_LENGTH - 1] != '\0' || entry.offset % 4 != 0 || entry.offset < indexEnd ||
+        entry.offset > header->size || entry.size > header->size - entry.offset) {
+      LOGE("ASSETS", "Asset entry %u is invalid", (unsigned)i);
+      return false;
+    }
+    // assetFind searches the index by halves, so a name out of order would hide others
+    if (i > 0 && strncmp(index[i - 1].name, entry.name, ASSETS_NAME_LENGTH) >= 0) {
+      LOGE("ASSETS", "Asset entry %u is not sorted by name", (unsigned)i);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Map the asset partition and check the bundle once (call early in setup)
+bool assetsInit() {
+  const esp_partition_t* partition =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, ASSETS_PARTITION_LABEL);
+  if (partition == NULL) {
+    logError("ASSETS", "Partition not found: " + String(ASSETS_PARTITION_LABEL));
+    return false;
+  }
+
+  const void* mapped;
+  if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &mapHandle) != ESP_OK) {
+    logError("ASSETS", "Failed to map the asset partition");
+    return false;
+  }
+  bundle = (const uint8_t*)mapped;
+  header = (const AssetBundleHeader*)bundle;
+
+  if (!validBundle(partition)) {
+    spi_flash_munmap(mapHandle);
+    bundle = NULL;
+    header = NULL;
+    return false;
+  }
+
+  entries = (const AssetEntry*)(bundle + sizeof(AssetBundleHeader));
+  LOGI("ASSETS", "Asset bundle revision %lu mapped, %u assets, %lu bytes", header->revision,
+       (unsigned)header->count, header->size);
+  return true;
+}
+
+// Revision of the mapped bundle, 0 without one
+uint32_t assetsRevision() {
+  return header != NULL ? header->revision : 0;
+}
+
+// Find an asset of the given type by name; returns a pointer into flash or NULL
+const void* assetFind(const char* name, AssetType type, uint32_t* size) {
+  if (entries == NULL) {
+    return NULL;
+  }
+
+  // The index is sorted by name
+  int low = 0;
+  int high = header->count - 1;
+  while (low <= high) {
+    int middle = (low + high) / 2;
+    const AssetEntry& entry = entries[middle];
+    int order = strncmp(name, entry.name, ASSETS_NAME_LENGTH);
+    if (order == 0) {
+      if (entry.type != type) {
+        LOGW("ASSETS", "Asset %s has type %u, expected %u", name, (unsigned)entry.type, (unsigned)type);
+        return NULL;
+      }
+      if (size != NULL) {
+        *size = entry.size;
+      }
+      return bundle + entry.offset;
+    }
+    if (order < 0) {
+      high = middle - 1;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return NULL;
+}
+
+// 1-bit bitmap rows, MSB first, each row padded to a whole byte
+const uint8_t* assetBitmap(const char* name, uint16_t* width, uint16_t* height) {
+  uint32_t size;
+  const AssetBitmapHeader* bitmap = (const AssetBitmapHeader*)assetFind(name, ASSET_BITMAP, &size);
+  if (bitmap == NULL || size < sizeof(AssetBitmapHeader) ||
+      size - sizeof(AssetBitmapHeader) < (uint32_t)(bitmap->width + 7) / 8 * bitmap->height) {
+    return NULL;
+  }
+  *width = bitmap->width;
+  *height = bitmap->height;
+  return (const uint8_t*)(bitmap + 1);
+}
+
+// Records of a table asset; recordSize must match what the caller reads
+const void* assetTable(const char* name, uint16_t recordSize, uint32_t* count) {
+  uint32_t size;
+  const AssetTableHeader* table = (const AssetTableHeader*)assetFind(name, ASSET_TABLE, &size);
+  if (table == NULL || size < sizeof(AssetTableHeader)) {
+    return NULL;
+  }
+  if (table->recordSize != recordSize || (size - sizeof(AssetTableHeader)) / recordSize < table->count) {
+    LOGW("ASSETS", "Table %s has %u-byte records, expected %u", name, (unsigned)table->recordSize,
+         (unsigned)recordSize);
+    return NULL;
+  }
+  *count = table->count;
+  return table + 1;
+}
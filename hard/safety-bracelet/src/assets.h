@@ -0,0 +1,66 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <Arduino.h>
+
+// Asset bundle: read-only data (bitmaps, lookup tables, model weights) kept in its own
+// flash partition and memory-mapped at boot, so assets are used in place through the
+// flash cache without copies into RAM. The bundle is built by tools/mkassets.py and
+// flashed on its own, without rebuilding the application.
+//
+// Layout, little-endian, every asset starting on a 4-byte boundary:
+//   AssetBundleHeader
+//   AssetEntry[count], sorted by name
+//   asset data
+// A bitmap asset is AssetBitmapHeader followed by 1-bit rows as drawBitmap() takes them;
+// a table asset is AssetTableHeader followed by count fixed-size records.
+
+// Bundle settings
+#define ASSETS_PARTITION_LABEL "assets"
+#define ASSETS_MAGIC 0x54455341UL          // "ASET"
+#define ASSETS_FORMAT_VERSION 1
+#define ASSETS_NAME_LENGTH 20              // Including the terminator
+
+// Asset types
+enum AssetType : uint16_t {
+  ASSET_BLOB,
+  ASSET_BITMAP,
+  ASSET_TABLE
+};
+
+struct AssetBundleHeader {
+  uint32_t magic;
+  uint16_t formatVersion;
+  uint16_t count;             // Index entries
+  uint32_t revision;          // Bundle revision, chosen when building it
+  uint32_t size;              // Bytes including this header
+  uint32_t crc;               // CRC32 over the bytes after this header
+};
+
+struct AssetEntry {
+  char name[ASSETS_NAME_LENGTH];
+  uint16_t type;              // AssetType
+  uint16_t reserved;
+  uint32_t offset;            // From the start of the bundle
+  uint32_t size;
+};
+
+struct AssetBitmapHeader {
+  uint16_t width;
+  uint16_t height;
+};
+
+struct AssetTableHeader {
+  uint16_t recordSize;
+  uint16_t reserved;
+  uint32_t count;
+};
+
+// Functions
+bool assetsInit();
+uint32_t assetsRevision();
+const void* assetFind(const char* name, AssetType type, uint32_t* size);
+const uint8_t* assetBitmap(const char* name, uint16_t* width, uint16_t* height);
+const void* assetTable(const char* name, uint16_t recordSize, uint32_t* count);
+
+#endif // ASSETS_H
@@ -1,6 +1,9 @@
 #include "ble_manager.h"
 #include "utils.h"
 #include "storage.h"
+#include "flight_recorder.h"
+#include "config.h"
+#include "journal.h"
 
 // Private variables
 static BLEServer *pServer = NULL;
@@ -55,8 +58,8 @@ class ServerCallbacks: public BLEServerCallbacks {
         logWarning("BLE", "Suspicious connection pattern detected. Disabling BLE temporarily.");
         enableBLE(false);
         // Auto re-enable after 5 minutes
-        saveBool("ble_temp_disabled", true);
-        saveULong("ble_reenable_time", millis() + 300000);
+        configSetBool(CONFIG_BLE_TEMP_DISABLED, true);
+        configSetULong(CONFIG_BLE_REENABLE_TIME, millis() + 300000);
       }
     }
   }
@@ -78,6 +81,44 @@ class ServerCallbacks: public BLEServerCallbacks {
   }
 };
 
+// Send one journal record as "EVT:<id>,<time>,<type>,<severity>,<lat>,<lon>,<delivery>,<detail>"
+static bool notifyJournalEvent(uint32_t id, const JournalRecord& record, uint8_t delivery, void* context) {
+  char line[JOURNAL_LINE_LENGTH];
+  if (isnan(record.latitude)) {
+    snprintf(line, sizeof(line), "EVT:%lu,%lu,%s,%u,,,%u,%s", (unsigned long)id, (unsigned long)record.wallTime,
+             journalTypeName(record.type), (unsigned)record.severity, (unsigned)delivery, record.detail);
+  } else {
+    snprintf(line, sizeof(line), "EVT:%lu,%lu,%s,%u,%.6f,%.6f,%u,%s", (unsigned long)id,
+             (unsigned long)record.wallTime, journalTypeName(record.type), (unsigned)record.severity,
+             record.latitude, record.longitude, (unsigned)delivery, record.detail);
+  }
+  pTxCharacteristic->setValue(line);
+  pTxCharacteristic->notify();
+  return deviceConnected;
+}
+
+// Answer "EVENTS:<from>:<to>[:<id>]" with the journal records in that Unix time range
+// The answer ends with "EVENTS_END:<id>" to continue from, or "EVENTS_END" when complete
+static void sendJournalEvents(const String& query) {
+  unsigned long fromTime = 0;
+  unsigned long toTime = UINT32_MAX;
+  unsigned long startId = 0;
+  int fields = sscanf(query.c_str(), "%lu:%lu:%lu", &fromTime, &toTime, &startId);
+  if (fields < 2 || fromTime > toTime) {
+    pTxCharacteristic->setValue("ERROR:EVENTS_FORMAT");
+    pTxCharacteristic->notify();
+    return;
+  }
+  if (fields < 3) {
+    startId = journalOldestId();
+  }
+
+  uint32_t next = journalQuery(fromTime, toTime, startId, JOURNAL_SYNC_BATCH, notifyJournalEvent, NULL);
+  String endMsg = next == journalHeadId() ? String("EVENTS_END") : "EVENTS_END:" + String(next);
+  pTxCharacteristic->setValue(endMsg.c_str());
+  pTxCharacteristic->notify();
+}
+
 // RX Characteristic callbacks (for data received from app)
 class RxCharacteristicCallbacks: public BLECharacteristicCallbacks {
   void onWrite(BLECharacteristic *pCharacteristic) {
@@ -111,13 +152,19 @@ class RxCharacteristicCallbacks: public BLECharacteristicCallbacks {
       }
       else if (data.startsWith("NAME:")) {
         // Set device name
+        // The advertising name follows through deviceNameChanged()
         deviceName = data.substring(5);
-        saveString("device_name", deviceName);
         logInfo("BLE", "Device name set: " + deviceName);
         sendResponse("OK:NAME");
-        
-        // Update BLE advertising name
-        updateDeviceName();
+        configSetString(CONFIG_DEVICE_NAME, deviceName.c_str());
+      }
+      else if (data.startsWith("EVENTS:")) {
+        // Journal sync; the app confirms what it stored with EVENTS_ACK
+        sendJournalEvents(data.substring(7));
+      }
+      else if (data.startsWith("EVENTS_ACK:")) {
+        journalAcknowledgeApp(strtoul(data.c_str() + 11, NULL, 10));
+        sendResponse("OK:EVENTS_ACK");
       }
       else if (data.startsWith("PING")) {
         // Simple heartbeat check
@@ -137,6 +184,8 @@ class RxCharacteristicCallbacks: public BLECharacteristicCallbacks {
           feedWatchdog();
           delay(50);
         }
+        configCommit();
+        logFlush();
         ESP.restart();
       }
       else {
@@ -160,8 +209,8 @@ class RxCharacteristicCallbacks: public BLECharacteristicCallbacks {
     String receivedToken = authData.substring(0, separatorIndex);
     String timestamp = authData.substring(separatorIndex + 1);
     
-    // Load passkey from storage (default to a simple key if not set)
-    String savedPasskey = loadString("ble_passkey", "safety123");
+    // Passkey from the config registry (defaults to a simple key if not set)
+    String savedPasskey = configGetString(CONFIG_BLE_PASSKEY);
     
     // Generate expected token
     uint32_t timestampValue = timestamp.toInt();
@@ -222,11 +271,11 @@ class AuthCharacteristicCallbacks: public BLECharacteristicCallbacks {
         String newPasskey = data.substring(separatorIndex + 1);
         
         // Verify old passkey
-        String savedPasskey = loadString("ble_passkey", "safety123");
+        String savedPasskey = configGetString(CONFIG_BLE_PASSKEY);
         if (oldPasskey.equals(savedPasskey)) {
           // Save new passkey
-          if (newPasskey.length() >= 6) {
-            saveString("ble_passkey", newPasskey);
+          if (newPasskey.length() >= 6 && newPasskey.length() < CONFIG_STRING_LENGTH) {
+            configSetString(CONFIG_BLE_PASSKEY, newPasskey.c_str());
             logInfo("BLE", "BLE passkey updated successfully");
             
             // Respond via TX characteristic
@@ -234,6 +283,12 @@ class AuthCharacteristicCallbacks: public BLECharacteristicCallbacks {
               pTxCharacteristic->setValue("OK:PASSKEY_UPDATED");
               pTxCharacteristic->notify();
             }
+          } else if (newPasskey.length() >= CONFIG_STRING_LENGTH) {
+            logWarning("BLE", "New passkey too long (max " + String(CONFIG_STRING_LENGTH - 1) + " chars)");
+            if (pTxCharacteristic != NULL) {
+              pTxCharacteristic->setValue("ERROR:PASSKEY_TOO_LONG");
+              pTxCharacteristic->notify();
+            }
           } else {
             logWarning("BLE", "New passkey too short (min 6 chars)");
             if (pTxCharacteristic != NULL) {
@@ -253,10 +308,10 @@ class AuthCharacteristicCallbacks: public BLECharacteristicCallbacks {
   }
 };
 
-// Update device name from storage
+// Update device name from the config registry
 void updateDeviceName() {
   // Get device name from storage or use default
-  deviceName = loadString("device_name", "");
+  deviceName = configGetString(CONFIG_DEVICE_NAME);
   String advertisingName;
   
   if (deviceName.length() > 0) {
@@ -281,26 +336,32 @@ void updateDeviceName() {
   }
 }
 
+// Device name setting changed
+static void deviceNameChanged(ConfigKey key) {
+  updateDeviceName();
+}
+
 // Initialize BLE
 void bleInit() {
   logInfo("BLE", "Initializing BLE");
+  configSubscribe(CONFIG_DEVICE_NAME, deviceNameChanged);
   
   // Check if BLE was temporarily disabled due to suspicious activity
-  if (loadBool("ble_temp_disabled", false)) {
-    unsigned long reenableTime = loadULong("ble_reenable_time", 0);
+  if (configGetBool(CONFIG_BLE_TEMP_DISABLED)) {
+    unsigned long reenableTime = configGetULong(CONFIG_BLE_REENABLE_TIME);
     if (millis() < reenableTime) {
       logInfo("BLE", "BLE temporarily disabled due to security concerns. Will re-enable later.");
       bleEnabled = false;
       return;
     } else {
       // Re-enable BLE
-      saveBool("ble_temp_disabled", false);
+      configSetBool(CONFIG_BLE_TEMP_DISABLED, false);
       logInfo("BLE", "Re-enabling BLE after security timeout");
     }
   }
   
   // Get device name from storage
-  deviceName = loadString("device_name", "");
+  deviceName = configGetString(CONFIG_DEVICE_NAME);
   String advertisingName;
   
   if (deviceName.length() > 0) {
@@ -380,6 +441,20 @@ void bleHandleEvents() {
       
       pTxCharacteristic->setValue(statusMsg.c_str());
       pTxCharacteristic->notify();
+      
+      // After a crash, send what the flight recorder had (one notification per line)
+      if (flightRecorderCrashed()) {
+        String crashMsg = "CRASH:" + String(flightRecorderSummary());
+        pTxCharacteristic->setValue(crashMsg.c_str());
+        pTxCharacteristic->notify();
+        char line[FLIGHT_LINE_LENGTH];
+        for (int i = 0; i < flightRecorderReportCount(); i++) {
+          flightRecorderReportLine(i, line, sizeof(line));
+          String eventMsg = "EV:" + String(line);
+          pTxCharacteristic->setValue(eventMsg.c_str());
+          pTxCharacteristic->notify();
+        }
+      }
     }
   }
   
@@ -423,11 +498,11 @@ void bleHandleEvents() {
   }
   
   // Check for re-enabling BLE after security timeout
-  if (!bleEnabled && loadBool("ble_temp_disabled", false)) {
-    unsigned long reenableTime = loadULong("ble_reenable_time", 0);
+  if (!bleEnabled && configGetBool(CONFIG_BLE_TEMP_DISABLED)) {
+    unsigned long reenableTime = configGetULong(CONFIG_BLE_REENABLE_TIME);
     if (millis() > reenableTime) {
       // Re-enable BLE
-      saveBool("ble_temp_disabled", false);
+      configSetBool(CONFIG_BLE_TEMP_DISABLED, false);
       logInfo("BLE", "Re-enabling BLE after security timeout");
       bleEnabled = true;
       bleInit();
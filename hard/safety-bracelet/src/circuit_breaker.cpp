@@ -0,0 +1,89 @@
+#include "circuit_breaker.h"
+#include "utils.h"
+
+// Spread a delay over [delay/2, delay] so devices drift apart
+static uint32_t withJitter(uint32_t delay) {
+  return delay / 2 + random(delay / 2 + 1);
+}
+
+// Start closed with no failures
+void breakerInit(CircuitBreaker* breaker, const char* name) {
+  breaker->name = name;
+  breaker->state = BREAKER_CLOSED;
+  breaker->failures = 0;
+  breaker->openTime = 0;
+  breaker->retryAt = millis();
+}
+
+// Check whether an attempt may be made now (a half-open circuit waits for its probe)
+bool breakerReady(const CircuitBreaker* breaker) {
+  if (breaker->state == BREAKER_HALF_OPEN) {
+    return false;
+  }
+  return (long)(millis() - breaker->retryAt) >= 0;
+}
+
+// Mark the start of an attempt; an open circuit whose time is up lets this one through as the probe
+void breakerBegin(CircuitBreaker* breaker) {
+  if (breaker->state == BREAKER_OPEN) {
+    breaker->state = BREAKER_HALF_OPEN;
+    logInfo("BREAKER", String(breaker->name) + ": probing");
+  }
+}
+
+// Record a successful attempt and close the circuit
+void breakerSuccess(CircuitBreaker* breaker) {
+  if (breaker->state != BREAKER_CLOSED) {
+    logInfo("BREAKER", String(breaker->name) + ": circuit closed");
+  }
+  breaker->state = BREAKER_CLOSED;
+  breaker->failures = 0;
+  breaker->openTime = 0;
+  breaker->retryAt = millis();
+}
+
+// Record a failed attempt; retryAfter is the server's Retry-After in ms, or 0
+void breakerFailure(CircuitBreaker* breaker, uint32_t retryAfter) {
+  if (breaker->failures < 255) {
+    breaker->failures++;
+  }
+
+  uint32_t delay;
+  if (breaker->state == BREAKER_HALF_OPEN) {
+    // Probe failed: stay away twice as long as last time
+    breaker->openTime = min((uint32_t)BREAKER_MAX_DELAY, breaker->openTime * 2);
+    breaker->state = BREAKER_OPEN;
+    delay = withJitter(breaker->openTime);
+    logWarning("BREAKER", String(breaker->name) + ": probe failed, circuit open for " + String(delay / 1000) + "s");
+  } else if (breaker->failures >= BREAKER_FAILURE_THRESHOLD) {
+    breaker->openTime = BREAKER_OPEN_TIME;
+    breaker->state = BREAKER_OPEN;
+    delay = withJitter(breaker->openTime);
+    logWarning("BREAKER", String(breaker->name) + ": " + String(breaker->failures) +
+               " failures, circuit open for " + String(delay / 1000) + "s");
+  } else {
+    // 2s, 4s, ... before the circuit opens
+    delay = withJitter(BREAKER_BASE_DELAY << (breaker->failures - 1));
+    logInfo("BREAKER", String(breaker->name) + ": failure " + String(breaker->failures) +
+            ", next attempt in " + String(delay) + "ms");
+  }
+
+  // The server may ask for a longer pause than our own backoff
+  if (retryAfter > delay) {
+    delay = min((uint32_t)BREAKER_MAX_DELAY, retryAfter);
+  }
+  breaker->retryAt = millis() + delay;
+}
+
+// Forget an attempt that gave up without an outcome; a probe goes back to waiting for the next one
+void breakerCancel(CircuitBreaker* breaker) {
+  if (breaker->state == BREAKER_HALF_OPEN) {
+    breaker->state = BREAKER_OPEN;
+  }
+}
+
+// Milliseconds until the next attempt is allowed
+uint32_t breakerWaitTime(const CircuitBreaker* breaker) {
+  long remaining = (long)(breaker->retryAt - millis());
+  return remaining > 0 ? remaining : 0;
+}
@@ -0,0 +1,44 @@
+#ifndef CIRCUIT_BREAKER_H
+#define CIRCUIT_BREAKER_H
+
+#include <Arduino.h>
+
+// Failure tracking for one endpoint (or for the server as a whole).
+// Consecutive failures push the next allowed attempt out exponentially, with random
+// jitter so a fleet that lost the server at the same moment does not retry in lockstep.
+// After BREAKER_FAILURE_THRESHOLD failures the circuit opens: requests fail straight away
+// without touching the radio. When the open period ends one probe request is let through
+// (half-open); its success closes the circuit, its failure reopens it for twice as long.
+// Nothing here waits; callers ask breakerReady() and keep their data for later if not.
+
+// Backoff settings
+#define BREAKER_BASE_DELAY 2000           // Backoff after the first failure
+#define BREAKER_FAILURE_THRESHOLD 3       // Consecutive failures that open the circuit
+#define BREAKER_OPEN_TIME 60000           // First open period
+#define BREAKER_MAX_DELAY 900000          // Cap for backoff and open periods (15 minutes)
+
+enum BreakerState {
+  BREAKER_CLOSED,
+  BREAKER_OPEN,
+  BREAKER_HALF_OPEN
+};
+
+// Breaker state
+struct CircuitBreaker {
+  const char* name;
+  BreakerState state;
+  uint8_t failures;             // Consecutive failures
+  uint32_t openTime;            // Current open period, doubles with every failed probe
+  unsigned long retryAt;        // No attempt before this time (millis)
+};
+
+// Functions
+void breakerInit(CircuitBreaker* breaker, const char* name);
+bool breakerReady(const CircuitBreaker* breaker);
+void breakerBegin(CircuitBreaker* breaker);
+void breakerSuccess(CircuitBreaker* breaker);
+void breakerFailure(CircuitBreaker* breaker, uint32_t retryAfter = 0);
+void breakerCancel(CircuitBreaker* breaker);
+uint32_t breakerWaitTime(const CircuitBreaker* breaker);
+
+#endif // CIRCUIT_BREAKER_H
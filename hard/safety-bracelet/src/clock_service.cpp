@@ -0,0 +1,210 @@
+#include "clock_service.h"
+#include "utils.h"
+#include "wifi_manager.h"
+#include <esp_timer.h>
+#include <esp_sntp.h>
+#include <sys/time.h>
+
+// Clock base: Unix time = uptime + offset, shared by every task that logs
+static portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t unixOffsetMs = 0;
+static ClockSource currentSource = CLOCK_SOURCE_NONE;
+static uint64_t lastSyncUptime = 0;
+
+// Sync bookkeeping, main loop only
+static bool sntpStarted = false;
+static uint64_t lastGsmSyncAttempt = 0;
+
+static const char* const sourceNames[] = { "none", "http", "gsm", "sntp" };
+
+// Convert days since 1970-01-01 to a calendar date
+static void civilFromDays(int32_t days, int* year, int* month, int* day) {
+  days += 719468;
+  int32_t era = days / 146097;
+  uint32_t dayOfEra = days - era * 146097;
+  uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  uint32_t monthIndex = (5 * dayOfYear + 2) / 153;
+  *day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+  *month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+  *year = yearOfEra + era * 400 + (*month <= 2 ? 1 : 0);
+}
+
+// Convert a UTC calendar time to Unix time (years 1970 and later)
+uint32_t clockFromCivil(int year, int month, int day, int hour, int minute, int second) {
+  year -= month <= 2 ? 1 : 0;
+  int32_t era = year / 400;
+  uint32_t yearOfEra = year - era * 400;
+  uint32_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  int32_t days = era * 146097 + dayOfEra - 719468;
+  return (uint32_t)days * 86400UL + hour * 3600UL + minute * 60UL + second;
+}
+
+// SNTP has set the system time (runs on the lwIP task)
+static void sntpSynced(struct timeval* tv) {
+  clockSync((uint64_t)tv->tv_sec * 1000ULL + tv->tv_usec / 1000, CLOCK_SOURCE_SNTP);
+}
+
+// Initialize the clock service
+void clockInit() {
+  sntp_set_time_sync_notification_cb(sntpSynced);
+  logInfo("CLOCK", "Clock service ready, waiting for a time source");
+}
+
+// Start or refresh time sources for the current link (call from main loop)
+void clockProcess() {
+  if (!isNetworkConnected()) {
+    return;
+  }
+  ConnectionMode mode = getCurrentConnectionMode();
+
+  // SNTP runs in the background on the lwIP task and only works over WiFi
+  if (!sntpStarted && mode == WIFI_MODE) {
+    configTime(0, 0, CLOCK_NTP_SERVER_1, CLOCK_NTP_SERVER_2);
+    sntpStarted = true;
+    logInfo("CLOCK", "SNTP started");
+  }
+
+  // On GPRS the modem clock carries the network time; the link check reads it, so the first
+  // reading can come a while after the link is up and is picked up as soon as it does
+  uint64_t now = clockUptimeMs();
+  if (mode == GPRS_MODE &&
+      (lastGsmSyncAttempt == 0 || now - lastGsmSyncAttempt > CLOCK_GSM_SYNC_INTERVAL)) {
+    uint32_t networkTime;
+    if (gsmNetworkTime(&networkTime)) {
+      lastGsmSyncAttempt = now;
+      clockSync(networkTime * 1000ULL + 500, CLOCK_SOURCE_GSM);
+    }
+  }
+}
+
+// Milliseconds since boot; 64 bits, so it does not wrap like millis()
+uint64_t clockUptimeMs() {
+  return (uint64_t)(esp_timer_get_time() / 1000);
+}
+
+// Check if the wall clock has been set from any source
+bool clockIsSet() {
+  return currentSource != CLOCK_SOURCE_NONE;
+}
+
+// Current Unix time in ms, or 0 if the clock has not been set yet
+uint64_t clockUnixTimeMs() {
+  portENTER_CRITICAL(&clockMux);
+  bool set = currentSource != CLOCK_SOURCE_NONE;
+  int64_t offset = unixOffsetMs;
+  portEXIT_CRITICAL(&clockMux);
+  return set ? clockUptimeMs() + offset : 0;
+}
+
+// Current Unix time, or 0 if the clock has not been set yet
+uint32_t clockUnixTime() {
+  return clockUnixTimeMs() / 1000;
+}
+
+// Source of the last accepted sync
+ClockSource clockSource() {
+  return currentSource;
+}
+
+// Offer a time reading; a source only replaces a more precise one once that has gone stale
+// Returns true if the reading was accepted
+bool clockSync(uint64_t unixTimeMs, ClockSource source) {
+  if (unixTimeMs / 1000 < CLOCK_MIN_VALID_TIME) {
+    return false;
+  }
+
+  uint64_t now = clockUptimeMs();
+  int64_t offset = (int64_t)(unixTimeMs - now);
+  ClockSource previousSource;
+  int64_t drift;
+  bool stepped = false;
+
+  portENTER_CRITICAL(&clockMux);
+  previousSource = currentSource;
+  drift = offset - unixOffsetMs;
+  bool stale = currentSource == CLOCK_SOURCE_NONE || now - lastSyncUptime > CLOCK_SOURCE_STALE_AGE;
+  bool accepted = source >= currentSource || stale;
+  if (accepted) {
+    // A coarse source that agrees with the clock only refreshes it
+    stepped = currentSource == CLOCK_SOURCE_NONE || source == CLOCK_SOURCE_SNTP ||
+              drift >= CLOCK_STEP_THRESHOLD || drift <= -CLOCK_STEP_THRESHOLD;
+    if (stepped) {
+      unixOffsetMs = offset;
+    }
+    currentSource = source;
+    lastSyncUptime = now;
+  }
+  portEXIT_CRITICAL(&clockMux);
+
+  if (!accepted) {
+    return false;
+  }
+
+  // Keep time() and localtime() in step; SNTP has already set them
+  if (stepped && source != CLOCK_SOURCE_SNTP) {
+    struct timeval tv = { (time_t)(unixTimeMs / 1000), (suseconds_t)(unixTimeMs % 1000) * 1000 };
+    settimeofday(&tv, NULL);
+  }
+
+  if (previousSource == CLOCK_SOURCE_NONE) {
+    logInfo("CLOCK", "Clock set from " + String(sourceNames[source]));
+  } else if (stepped && (drift >= CLOCK_STEP_THRESHOLD || drift <= -CLOCK_STEP_THRESHOLD)) {
+    logInfo("CLOCK", "Clock corrected by " + String((long)drift) + "ms from " + String(sourceNames[source]));
+  }
+  return true;
+}
+
+// Offer the Date header of an HTTP response, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+bool clockSyncHttpDate(const char* date) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int day, year, hour, minute, second;
+
+  if (date == NULL ||
+      sscanf(date, "%*[^,], %d %3s %d %d:%d:%d", &day, month, &year, &hour, &minute, &second) != 6) {
+    return false;
+  }
+  const char* found = strstr(months, month);
+  if (found == NULL || strlen(month) != 3 || (found - months) % 3 != 0) {
+    return false;
+  }
+
+  // The header has whole seconds; assume the middle of the second
+  uint32_t unixTime = clockFromCivil(year, (found - months) / 3 + 1, day, hour, minute, second);
+  return clockSync(unixTime * 1000ULL + 500, CLOCK_SOURCE_HTTP);
+}
+
+// Format a Unix time as "YYYY-MM-DD HH:MM:SS" (UTC)
+size_t clockFormatUnix(uint32_t unixTime, char* buffer, size_t size) {
+  int year, month, day;
+  civilFromDays(unixTime / 86400, &year, &month, &day);
+  uint32_t secondOfDay = unixTime % 86400;
+  int length = snprintf(buffer, size, "%04d-%02d-%02d %02lu:%02lu:%02lu", year, month, day,
+                        (unsigned long)(secondOfDay / 3600), (unsigned long)(secondOfDay / 60 % 60),
+                        (unsigned long)(secondOfDay % 60));
+  return length > 0 ? (size_t)length : 0;
+}
+
+// Format the time at an uptime for a log line, with milliseconds; uptime until the clock is set
+// Never blocks, so it is safe on every task and before any network is up
+size_t clockFormatLog(uint64_t uptime, char* buffer, size_t size) {
+  portENTER_CRITICAL(&clockMux);
+  bool set = currentSource != CLOCK_SOURCE_NONE;
+  int64_t offset = unixOffsetMs;
+  portEXIT_CRITICAL(&clockMux);
+
+  uint64_t unixTimeMs = uptime + offset;
+  if (!set) {
+    int length = snprintf(buffer, size, "up %lu.%03us", (unsigned long)(uptime / 1000),
+                          (unsigned)(uptime % 1000));
+    return length > 0 ? (size_t)length : 0;
+  }
+
+  size_t length = clockFormatUnix(unixTimeMs / 1000, buffer, size);
+  if (length + 4 < size) {
+    length += snprintf(buffer + length, size - length, ".%03u", (unsigned)(unixTimeMs % 1000));
+  }
+  return length;
+}
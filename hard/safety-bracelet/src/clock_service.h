@@ -0,0 +1,41 @@
+#ifndef CLOCK_SERVICE_H
+#define CLOCK_SERVICE_H
+
+#include <Arduino.h>
+
+// Wall clock kept as an offset from the 64-bit esp_timer, which never wraps and keeps
+// counting through light sleep. The offset is set from the best time source seen so far;
+// reading and formatting the time never waits for a sync.
+
+// Clock settings
+#define CLOCK_NTP_SERVER_1 "pool.ntp.org"
+#define CLOCK_NTP_SERVER_2 "time.google.com"
+#define CLOCK_GSM_SYNC_INTERVAL 3600000UL     // Ask the modem for network time while on GPRS
+#define CLOCK_SOURCE_STALE_AGE 86400000UL     // After a day any source may replace a better one
+#define CLOCK_STEP_THRESHOLD 2000             // Ignore coarse sources that agree within this (ms)
+#define CLOCK_MIN_VALID_TIME 1700000000UL     // Anything earlier is an unset modem or server clock
+#define CLOCK_TIMESTAMP_LENGTH 24             // "YYYY-MM-DD HH:MM:SS.mmm" plus terminator
+
+// Time sources, in increasing order of precision
+enum ClockSource {
+  CLOCK_SOURCE_NONE,
+  CLOCK_SOURCE_HTTP,     // Date header of an API response, whole seconds
+  CLOCK_SOURCE_GSM,      // Network time (NITZ) from the SIM800 clock
+  CLOCK_SOURCE_SNTP
+};
+
+// Functions
+void clockInit();
+void clockProcess();
+uint64_t clockUptimeMs();
+bool clockIsSet();
+uint32_t clockUnixTime();
+uint64_t clockUnixTimeMs();
+ClockSource clockSource();
+bool clockSync(uint64_t unixTimeMs, ClockSource source);
+bool clockSyncHttpDate(const char* date);
+uint32_t clockFromCivil(int year, int month, int day, int hour, int minute, int second);
+size_t clockFormatUnix(uint32_t unixTime, char* buffer, size_t size);
+size_t clockFormatLog(uint64_t uptimeMs, char* buffer, size_t size);
+
+#endif // CLOCK_SERVICE_H
@@ -0,0 +1,224 @@
+#include "config.h"
+#include "storage.h"
+#include "utils.h"
+
+// Setting types
+enum ConfigType : uint8_t {
+  CONFIG_TYPE_BOOL,
+  CONFIG_TYPE_ULONG,
+  CONFIG_TYPE_STRING
+};
+
+// Where a setting lives and what it starts as
+struct ConfigDefinition {
+  const char* key;
+  ConfigType type;
+  unsigned long defaultNumber;
+  const char* defaultText;
+};
+
+// Cached value of a setting
+struct ConfigValue {
+  unsigned long number;             // bool and ulong settings
+  char text[CONFIG_STRING_LENGTH];  // string settings
+  bool dirty;
+};
+
+struct ConfigListener {
+  ConfigKey key;
+  ConfigChangeCallback callback;
+};
+
+// Same order as ConfigKey
+static const ConfigDefinition definitions[CONFIG_KEY_COUNT] = {
+  { "ble_temp_disabled", CONFIG_TYPE_BOOL, 0, NULL },
+  { "ble_reenable_time", CONFIG_TYPE_ULONG, 0, NULL },
+  { "ble_passkey", CONFIG_TYPE_STRING, 0, "safety123" },
+  { "device_name", CONFIG_TYPE_STRING, 0, "" },
+  { "api_msgpack", CONFIG_TYPE_BOOL, 0, NULL }
+};
+
+// Values are shared with the BLE and network tasks
+static portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
+static ConfigValue values[CONFIG_KEY_COUNT];
+static bool pending = false;
+static unsigned long firstChangeTime = 0;
+static unsigned long lastChangeTime = 0;
+
+// Registered from setup and the main loop
+static ConfigListener listeners[CONFIG_MAX_LISTENERS];
+static int listenerCount = 0;
+
+// Load every setting once (call after storageInit)
+void configInit() {
+  for (int k = 0; k < CONFIG_KEY_COUNT; k++) {
+    const ConfigDefinition& definition = definitions[k];
+    ConfigValue& value = values[k];
+    switch (definition.type) {
+      case CONFIG_TYPE_BOOL:
+        value.number = loadBool(definition.key, definition.defaultNumber != 0);
+        break;
+      case CONFIG_TYPE_ULONG:
+        value.number = loadULong(definition.key, definition.defaultNumber);
+        break;
+      case CONFIG_TYPE_STRING:
+        strncpy(value.text, loadString(definition.key, definition.defaultText).c_str(), CONFIG_STRING_LENGTH - 1);
+        value.text[CONFIG_STRING_LENGTH - 1] = '\0';
+        break;
+    }
+    value.dirty = false;
+  }
+  logInfo("CONFIG", "Loaded " + String(CONFIG_KEY_COUNT) + " settings");
+}
+
+// Tell the listeners of a key about a change
+static void notifyListeners(ConfigKey key) {
+  for (int i = 0; i < listenerCount; i++) {
+    if (listeners[i].key == key) {
+      listeners[i].callback(key);
+    }
+  }
+}
+
+// Mark a key for write-back (caller holds configMux)
+static void markDirty(ConfigKey key) {
+  unsigned long now = millis();
+  values[key].dirty = true;
+  if (!pending) {
+    pending = true;
+    firstChangeTime = now;
+  }
+  lastChangeTime = now;
+}
+
+// Write back changed settings once they have settled (call from main loop)
+void configProcess() {
+  portENTER_CRITICAL(&configMux);
+  bool due = pending && (millis() - lastChangeTime >= CONFIG_COMMIT_DELAY ||
+                         millis() - firstChangeTime >= CONFIG_COMMIT_MAX_DELAY);
+  portEXIT_CRITICAL(&configMux);
+  if (due) {
+    configCommit();
+  }
+}
+
+// Write back all changed settings now, e.g. before a restart
+void configCommit() {
+  int written = 0;
+  for (int k = 0; k < CONFIG_KEY_COUNT; k++) {
+    // Take a copy; a change made meanwhile marks the key again
+    ConfigValue value;
+    portENTER_CRITICAL(&configMux);
+    value = values[k];
+    values[k].dirty = false;
+    portEXIT_CRITICAL(&configMux);
+    if (!value.dirty) {
+      continue;
+    }
+
+    const ConfigDefinition& definition = definitions[k];
+    bool saved = false;
+    switch (definition.type) {
+      case CONFIG_TYPE_BOOL:
+        saved = saveBool(definition.key, value.number != 0);
+        break;
+      case CONFIG_TYPE_ULONG:
+        saved = saveULong(definition.key, value.number);
+        break;
+      case CONFIG_TYPE_STRING:
+        saved = saveString(definition.key, value.text);
+        break;
+    }
+    if (!saved) {
+      // Try again with the next commit
+      portENTER_CRITICAL(&configMux);
+      markDirty((ConfigKey)k);
+      portEXIT_CRITICAL(&configMux);
+    } else {
+      written++;
+    }
+  }
+
+  portENTER_CRITICAL(&configMux);
+  bool dirty = false;
+  for (int k = 0; k < CONFIG_KEY_COUNT; k++) {
+    dirty |= values[k].dirty;
+  }
+  pending = dirty;
+  portEXIT_CRITICAL(&configMux);
+
+  if (written > 0) {
+    LOGD("CONFIG", "Committed %d settings", written);
+  }
+}
+
+bool configGetBool(ConfigKey key) {
+  return configGetULong(key) != 0;
+}
+
+unsigned long configGetULong(ConfigKey key) {
+  portENTER_CRITICAL(&configMux);
+  unsigned long number = values[key].number;
+  portEXIT_CRITICAL(&configMux);
+  return number;
+}
+
+String configGetString(ConfigKey key) {
+  char text[CONFIG_STRING_LENGTH];
+  portENTER_CRITICAL(&configMux);
+  memcpy(text, values[key].text, CONFIG_STRING_LENGTH);
+  portEXIT_CRITICAL(&configMux);
+  return String(text);
+}
+
+void configSetBool(ConfigKey key, bool value) {
+  configSetULong(key, value ? 1 : 0);
+}
+
+// Change a setting in RAM; unchanged values are not written or announced
+void configSetULong(ConfigKey key, unsigned long value) {
+  portENTER_CRITICAL(&configMux);
+  bool changed = values[key].number != value;
+  if (changed) {
+    values[key].number = value;
+    markDirty(key);
+  }
+  portEXIT_CRITICAL(&configMux);
+  if (changed) {
+    notifyListeners(key);
+  }
+}
+
+// Change a string setting; values longer than CONFIG_STRING_LENGTH - 1 are cut off
+void configSetString(ConfigKey key, const char* value) {
+  char text[CONFIG_STRING_LENGTH] = { 0 };
+  strncpy(text, value, CONFIG_STRING_LENGTH - 1);
+
+  portENTER_CRITICAL(&configMux);
+  bool changed = strcmp(values[key].text, text) != 0;
+  if (changed) {
+    memcpy(values[key].text, text, CONFIG_STRING_LENGTH);
+    markDirty(key);
+  }
+  portEXIT_CRITICAL(&configMux);
+  if (changed) {
+    notifyListeners(key);
+  }
+}
+
+// Ask to be told when a setting changes (call from setup or main loop)
+bool configSubscribe(ConfigKey key, ConfigChangeCallback callback) {
+  for (int i = 0; i < listenerCount; i++) {
+    if (listeners[i].key == key && listeners[i].callback == callback) {
+      return true;
+    }
+  }
+  if (listenerCount >= CONFIG_MAX_LISTENERS) {
+    logError("CONFIG", "No room for another config listener");
+    return false;
+  }
+  listeners[listenerCount].key = key;
+  listeners[listenerCount].callback = callback;
+  __atomic_store_n(&listenerCount, listenerCount + 1, __ATOMIC_RELEASE);
+  return true;
+}
@@ -0,0 +1,42 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <Arduino.h>
+
+// Config registry: settings read on hot paths are loaded from preferences once at boot
+// and served from RAM. Changes go to RAM right away and are written back from the main
+// loop once they have settled, so a burst of changes costs one write per key.
+// Any task may read or change a setting; listeners are told about changes.
+
+// Registry settings
+#define CONFIG_STRING_LENGTH 33             // Longest string setting plus terminator
+#define CONFIG_COMMIT_DELAY 2000            // Write once nothing has changed for this long (ms)
+#define CONFIG_COMMIT_MAX_DELAY 10000       // ... but never hold a change longer than this
+#define CONFIG_MAX_LISTENERS 8
+
+// Settings held in the registry; the NVS keys and defaults are in config.cpp
+enum ConfigKey {
+  CONFIG_BLE_TEMP_DISABLED,      // bool: BLE off after suspicious connection attempts
+  CONFIG_BLE_REENABLE_TIME,      // ulong: millis() at which BLE may come back
+  CONFIG_BLE_PASSKEY,            // string
+  CONFIG_DEVICE_NAME,            // string, shown in the advertising name
+  CONFIG_API_MSGPACK,            // bool: MessagePack request bodies, switched on by the server (downlink)
+  CONFIG_KEY_COUNT
+};
+
+// Called after a setting changed, on the task that changed it
+typedef void (*ConfigChangeCallback)(ConfigKey key);
+
+// Functions
+void configInit();
+void configProcess();
+void configCommit();
+bool configGetBool(ConfigKey key);
+unsigned long configGetULong(ConfigKey key);
+String configGetString(ConfigKey key);
+void configSetBool(ConfigKey key, bool value);
+void configSetULong(ConfigKey key, unsigned long value);
+void configSetString(ConfigKey key, const char* value);
+bool configSubscribe(ConfigKey key, ConfigChangeCallback callback);
+
+#endif // CONFIG_H
@@ -3,6 +3,7 @@
 #include "ble_manager.h"
 #include "wifi_manager.h"
 #include "sensors.h"
+#include "assets.h"
 
 // Display instance
 static Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
@@ -114,8 +115,15 @@ const unsigned char logo [] PROGMEM = {
 void displayLogo() {
   display.clearDisplay();
   
-  // Draw the bitmap logo
-  display.drawBitmap(0, 0, logo, SCREEN_WIDTH, SCREEN_HEIGHT, SSD1306_WHITE);
+  // Draw the bitmap logo; one in the asset bundle replaces the built-in one
+  uint16_t width, height;
+  const uint8_t* bundleLogo = assetBitmap("logo", &width, &height);
+  if (bundleLogo != NULL) {
+    display.drawBitmap((SCREEN_WIDTH - width) / 2, (SCREEN_HEIGHT - height) / 2, bundleLogo, width, height,
+                       SSD1306_WHITE);
+  } else {
+    display.drawBitmap(0, 0, logo, SCREEN_WIDTH, SCREEN_HEIGHT, SSD1306_WHITE);
+  }
   
   // Update display with bitmap data
   display.display();
@@ -288,6 +296,7 @@ void displayQrCodePage() {
   display.println("EMERGENCY INFO");
   
   // If we have a QR code URL, display it
+  uint16_t width, height;
   if (qrCodeUrl.length() > 0) {
     // Generate QR code
     QRCode qrcode;
@@ -309,11 +318,18 @@ void displayQrCodePage() {
       }
     }
   } else {
-    // No QR code data available
-    display.setCursor(10, 30);
-    display.println("No emergency");
-    display.setCursor(10, 40);
-    display.println("data available");
+    // No child data yet; show the pre-rendered QR code from the asset bundle if there is one
+    const uint8_t* bitmap = assetBitmap("qr_info", &width, &height);
+    if (bitmap != NULL) {
+      display.drawBitmap((display.width() - width) / 2, ((display.height() - height) / 2) + 5, bitmap, width,
+                         height, SSD1306_WHITE);
+    } else {
+      // No QR code data available
+      display.setCursor(10, 30);
+      display.println("No emergency");
+      display.setCursor(10, 40);
+      display.println("data available");
+    }
   }
   
   // Page number
@@ -33,5 +33,6 @@ void displayQrCodePage();
 void displayInstructionsPage();
 void displayEmergencyMessage(const char* message);
 void displayQRCode(const String& data);
+void setChildData(const String& data);
 
 #endif // DISPLAY_H
@@ -0,0 +1,237 @@
+#include "downlink.h"
+#include "utils.h"
+#include "storage.h"
+#include "report_policy.h"
+#include "config.h"
+
+// Applied config version, read by the network task when it encodes a batch
+static volatile uint32_t appliedVersion = 0;
+
+// Config staged by the network task, applied on the main loop
+static DownlinkConfig stagedConfig;
+static bool configStaged = false;
+static SemaphoreHandle_t downlinkMutex = NULL;
+
+// Set when a config announced new child data, consumed by the main loop
+static bool childDataRefresh = false;
+
+// Initialize the downlink and load the applied config version
+void downlinkInit() {
+  downlinkMutex = xSemaphoreCreateMutex();
+  appliedVersion = loadULong("cfg_version", 0);
+  logInfo("DOWNLINK", "Applied config version " + String(appliedVersion));
+}
+
+// Check that a phone number is a plausible dialable string ("+" and digits)
+static bool isValidPhone(const char* phone) {
+  size_t length = strlen(phone);
+  if (length < 3 || length >= DOWNLINK_PHONE_LENGTH) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    if (!isdigit(phone[i]) && !(i == 0 && phone[i] == '+')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Read an interval member into *seconds; false if present but out of range
+static bool readInterval(JsonObjectConst cfg, const char* key, uint32_t minimum, uint32_t maximum,
+                         uint32_t* seconds, bool* present) {
+  *present = cfg.containsKey(key);
+  if (!*present) {
+    return true;
+  }
+  uint32_t value = cfg[key].as<uint32_t>();
+  if (value < minimum || value > maximum) {
+    logWarning("DOWNLINK", String(key) + " out of range: " + String(value));
+    return false;
+  }
+  *seconds = value;
+  return true;
+}
+
+// Read a "policy" block into config; members missing from a channel keep their current value
+static bool readPolicies(JsonObjectConst block, DownlinkConfig* config) {
+  for (int c = 0; c < REPORT_CHANNEL_COUNT; c++) {
+    const char* name = reportChannelName((ReportChannel)c);
+    if (!block.containsKey(name)) {
+      continue;
+    }
+    JsonObjectConst entry = block[name].as<JsonObjectConst>();
+    ReportPolicy policy = reportPolicyGet((ReportChannel)c);
+    policy.minInterval = entry["min"] | policy.minInterval;
+    policy.maxInterval = entry["max"] | policy.maxInterval;
+    policy.threshold = entry["thr"] | policy.threshold;
+    policy.emergencyInterval = entry["sos"] | policy.emergencyInterval;
+    if (!reportPolicyValid(policy)) {
+      logWarning("DOWNLINK", "Invalid report policy for " + String(name));
+      return false;
+    }
+    config->policies[c] = policy;
+    config->policyChannels |= 1 << c;
+  }
+  return true;
+}
+
+// Validate a "cfg" block and stage it for the main loop (called on the network task)
+// The whole block is rejected if any member is invalid, so a config is applied completely or not at all
+bool downlinkReceive(JsonObjectConst cfg) {
+  if (downlinkMutex == NULL || !cfg.containsKey("v")) {
+    return false;
+  }
+
+  DownlinkConfig config;
+  memset(&config, 0, sizeof(config));
+  config.version = cfg["v"].as<uint32_t>();
+
+  // Already applied, or a newer one is waiting
+  xSemaphoreTake(downlinkMutex, portMAX_DELAY);
+  uint32_t newestKnown = configStaged ? stagedConfig.version : appliedVersion;
+  xSemaphoreGive(downlinkMutex);
+  if ((int32_t)(config.version - newestKnown) <= 0) {
+    return false;
+  }
+
+  if (cfg.containsKey("contacts")) {
+    JsonArrayConst contacts = cfg["contacts"].as<JsonArrayConst>();
+    if (contacts.size() == 0 || contacts.size() > EMERGENCY_MAX_CONTACTS) {
+      logWarning("DOWNLINK", "Rejected config " + String(config.version) + ": bad contact count");
+      return false;
+    }
+    for (size_t i = 0; i < contacts.size(); i++) {
+      const char* phone = contacts[i].as<const char*>();
+      if (phone == NULL || !isValidPhone(phone)) {
+        logWarning("DOWNLINK", "Rejected config " + String(config.version) + ": bad contact " + String(i));
+        return false;
+      }
+      strncpy(config.contacts[i], phone, DOWNLINK_PHONE_LENGTH - 1);
+    }
+    config.contactCount = contacts.size();
+    config.fields |= DOWNLINK_HAS_CONTACTS;
+  }
+
+  bool present;
+  if (!readInterval(cfg, "gps_int", DOWNLINK_MIN_GPS_INTERVAL, DOWNLINK_MAX_GPS_INTERVAL,
+                    &config.gpsInterval, &present)) {
+    return false;
+  }
+  if (present) {
+    config.fields |= DOWNLINK_HAS_GPS_INTERVAL;
+  }
+
+  if (!readInterval(cfg, "bat_int", DOWNLINK_MIN_BATTERY_INTERVAL, DOWNLINK_MAX_BATTERY_INTERVAL,
+                    &config.batteryInterval, &present)) {
+    return false;
+  }
+  if (present) {
+    config.fields |= DOWNLINK_HAS_BATTERY_INTERVAL;
+  }
+
+  if (cfg.containsKey("msgpack")) {
+    config.msgpack = cfg["msgpack"].as<bool>();
+    config.fields |= DOWNLINK_HAS_ENCODING;
+  }
+
+  if (cfg["child"].as<bool>()) {
+    config.fields |= DOWNLINK_HAS_CHILD_DATA;
+  }
+
+  if (cfg.containsKey("policy")) {
+    if (!readPolicies(cfg["policy"].as<JsonObjectConst>(), &config)) {
+      logWarning("DOWNLINK", "Rejected config " + String(config.version) + ": bad report policy");
+      return false;
+    }
+    config.fields |= DOWNLINK_HAS_POLICY;
+  }
+
+  xSemaphoreTake(downlinkMutex, portMAX_DELAY);
+  stagedConfig = config;
+  configStaged = true;
+  xSemaphoreGive(downlinkMutex);
+
+  logInfo("DOWNLINK", "Staged config version " + String(config.version));
+  return true;
+}
+
+// Set a channel's heartbeat interval (seconds)
+static void applyHeartbeat(ReportChannel channel, uint32_t seconds) {
+  ReportPolicy policy = reportPolicyGet(channel);
+  policy.maxInterval = seconds;
+  policy.minInterval = min(policy.minInterval, seconds);
+  reportPolicySet(channel, policy);
+}
+
+// Apply a staged config (call from main loop)
+// The version is stored last, so after a reset part way through the server resends the same delta
+void downlinkProcess() {
+  if (downlinkMutex == NULL) {
+    return;
+  }
+
+  DownlinkConfig config;
+  xSemaphoreTake(downlinkMutex, portMAX_DELAY);
+  bool pending = configStaged;
+  if (pending) {
+    config = stagedConfig;
+    configStaged = false;
+  }
+  xSemaphoreGive(downlinkMutex);
+
+  if (!pending) {
+    return;
+  }
+
+  logInfo("DOWNLINK", "Applying config version " + String(config.version));
+
+  if (config.fields & DOWNLINK_HAS_CONTACTS) {
+    String contacts[EMERGENCY_MAX_CONTACTS];
+    for (int i = 0; i < config.contactCount; i++) {
+      contacts[i] = config.contacts[i];
+    }
+    setEmergencyContacts(contacts, config.contactCount);
+  }
+
+  if (config.fields & DOWNLINK_HAS_POLICY) {
+    for (int c = 0; c < REPORT_CHANNEL_COUNT; c++) {
+      if (config.policyChannels & (1 << c)) {
+        reportPolicySet((ReportChannel)c, config.policies[c]);
+      }
+    }
+  }
+
+  // Interval shortcuts set the heartbeat, pulling the minimum interval down with it if needed
+  if (config.fields & DOWNLINK_HAS_GPS_INTERVAL) {
+    applyHeartbeat(REPORT_LOCATION, config.gpsInterval);
+  }
+  if (config.fields & DOWNLINK_HAS_BATTERY_INTERVAL) {
+    applyHeartbeat(REPORT_BATTERY, config.batteryInterval);
+  }
+
+  if (config.fields & DOWNLINK_HAS_CHILD_DATA) {
+    childDataRefresh = true;
+  }
+
+  if (config.fields & DOWNLINK_HAS_ENCODING) {
+    configSetBool(CONFIG_API_MSGPACK, config.msgpack);
+  }
+
+  // The server does not resend a version we acknowledge, so every setting it carried must be
+  // in flash before the version is; registry settings would otherwise wait for the write-back
+  configCommit();
+  saveULong("cfg_version", config.version);
+  appliedVersion = config.version;
+}
+
+// Version of the last applied config
+uint32_t downlinkConfigVersion() {
+  return appliedVersion;
+}
+
+// Check and clear the request to fetch child data again
+bool downlinkTakeChildDataRefresh() {
+  bool refresh = childDataRefresh;
+  childDataRefresh = false;
+  return refresh;
+}
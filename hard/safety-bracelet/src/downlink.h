@@ -0,0 +1,54 @@
+#ifndef DOWNLINK_H
+#define DOWNLINK_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "emergency.h"
+#include "report_policy.h"
+
+// Server-to-device configuration carried in the "cfg" block of any API acknowledgement:
+//   {"success": true, "cfg": {"v": 7, "contacts": ["+34600000000"], "gps_int": 600, "bat_int": 120, "child": true,
+//    "policy": {"loc": {"min": 60, "max": 900, "thr": 50, "sos": 30}}}}
+// "v" is required and must be newer than the applied version; every other member is optional
+// and leaves that setting unchanged when missing. gps_int and bat_int set the location and
+// battery heartbeat (report policy maxInterval); "msgpack" turns MessagePack request bodies
+// on or off (JSON is the default); "policy" replaces whole channel policies,
+// with missing members taken from the current policy. The device reports its applied version as
+// "cfg_v" in telemetry batches, so the server knows when to stop sending a delta.
+
+// Downlink settings
+#define DOWNLINK_PHONE_LENGTH 20
+#define DOWNLINK_MIN_GPS_INTERVAL 60        // Seconds
+#define DOWNLINK_MAX_GPS_INTERVAL 86400
+#define DOWNLINK_MIN_BATTERY_INTERVAL 10
+#define DOWNLINK_MAX_BATTERY_INTERVAL 86400
+
+// Members present in a staged config
+#define DOWNLINK_HAS_CONTACTS 0x01
+#define DOWNLINK_HAS_GPS_INTERVAL 0x02
+#define DOWNLINK_HAS_BATTERY_INTERVAL 0x04
+#define DOWNLINK_HAS_CHILD_DATA 0x08
+#define DOWNLINK_HAS_POLICY 0x10
+#define DOWNLINK_HAS_ENCODING 0x20
+
+// Validated config delta waiting to be applied
+struct DownlinkConfig {
+  uint32_t version;
+  uint8_t fields;
+  uint8_t contactCount;
+  char contacts[EMERGENCY_MAX_CONTACTS][DOWNLINK_PHONE_LENGTH];
+  uint32_t gpsInterval;        // Seconds
+  uint32_t batteryInterval;    // Seconds
+  uint8_t policyChannels;      // Bit per ReportChannel present in policies
+  ReportPolicy policies[REPORT_CHANNEL_COUNT];
+  bool msgpack;                // Server accepts MessagePack request bodies
+};
+
+// Functions
+void downlinkInit();
+bool downlinkReceive(JsonObjectConst cfg);
+void downlinkProcess();
+uint32_t downlinkConfigVersion();
+bool downlinkTakeChildDataRefresh();
+
+#endif // DOWNLINK_H
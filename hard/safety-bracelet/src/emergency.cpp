@@ -3,9 +3,11 @@
 #include "wifi_manager.h"
 #include "display.h"
 #include "sensors.h"
-#include "api.h"
+#include "network_task.h"
+#include "telemetry.h"
 #include "storage.h"
 #include "ble_manager.h"  // Added to get access to BLE functions
+#include "journal.h"
 
 // Emergency state variables
 static bool isEmergencyMode = false;
@@ -36,9 +38,19 @@ static unsigned long buzzerDuration = 0;
 static bool buzzerActive = false;
 
 // Emergency contacts (loaded from storage)
-static String emergencyContacts[5];
+static String emergencyContacts[EMERGENCY_MAX_CONTACTS];
 static int emergencyContactCount = 0;
 
+// Alerts waiting for the network task, kept for the SMS fallback
+#define PENDING_ALERT_SLOTS 4
+struct PendingAlert {
+  bool inUse;
+  char title[NETWORK_NOTIFICATION_TITLE_LENGTH];
+  char message[NETWORK_NOTIFICATION_MESSAGE_LENGTH];
+  int priority;
+};
+static PendingAlert pendingAlerts[PENDING_ALERT_SLOTS];
+
 // Initialize emergency system
 void emergencyInit() {
   logInfo("EMERGENCY", "Initializing emergency system");
@@ -49,7 +61,7 @@ void emergencyInit() {
   
   // Load emergency contacts from storage
   emergencyContactCount = 0;
-  for (int i = 0; i < 5; i++) {
+  for (int i = 0; i < EMERGENCY_MAX_CONTACTS; i++) {
     String contactKeyStr = "contact_" + String(i);
     String contact = loadString(contactKeyStr.c_str(), "");
     if (contact.length() > 0) {
@@ -67,27 +79,76 @@ void emergencyInit() {
   logInfo("EMERGENCY", "Emergency system initialized with " + String(emergencyContactCount) + " contacts");
 }
 
+// Fall back to SMS (and a call for high priority) when the API could not deliver an alert
+static bool sendEmergencyFallback(const char* title, const char* message, int priority) {
+  if (!isSimModuleReady()) {
+    return false;
+  }
+  
+  String fullMessage = String(title) + ": " + String(message);
+  if (isGpsValid()) {
+    fullMessage += " Location: " + String(getLatitude(), 6) + "," + String(getLongitude(), 6);
+  }
+  
+  bool success = sendSMS(fullMessage.c_str());
+  
+  // For high priority, make emergency call too
+  if (priority >= 3) {
+    makeEmergencyCall();
+  }
+  
+  return success;
+}
+
+// Called from the main loop once the network task has tried to deliver an alert
+static void emergencyAlertCompleted(NetworkRequestType type, bool success, void* context) {
+  PendingAlert* alert = (PendingAlert*)context;
+  
+  if (!success) {
+    logWarning("EMERGENCY", "API delivery failed, falling back to SMS");
+    success = sendEmergencyFallback(alert->title, alert->message, alert->priority);
+  }
+  
+  // Log the result
+  if (success) {
+    logInfo("EMERGENCY", "Emergency alert sent successfully");
+  } else {
+    logError("EMERGENCY", "Failed to send emergency alert");
+  }
+  
+  alert->inUse = false;
+}
+
 // Send emergency alert through API
+// The API request runs on the network task; the SMS fallback runs when it completes
 bool sendEmergencyAlert(const char* title, const char* message, int priority) {
-  // First try to send notification via API
-  bool success = sendNotification(title, message, priority);
-  
-  // If API fails and we have SIM module, try SMS
-  if (!success && isSimModuleReady()) {
-    String fullMessage = String(title) + ": " + String(message);
-    if (isGpsValid()) {
-      fullMessage += " Location: " + String(getLatitude(), 6) + "," + String(getLongitude(), 6);
+  PendingAlert* alert = NULL;
+  for (int i = 0; i < PENDING_ALERT_SLOTS; i++) {
+    if (!pendingAlerts[i].inUse) {
+      alert = &pendingAlerts[i];
+      break;
     }
+  }
+  
+  if (alert != NULL) {
+    alert->inUse = true;
+    strncpy(alert->title, title, NETWORK_NOTIFICATION_TITLE_LENGTH - 1);
+    alert->title[NETWORK_NOTIFICATION_TITLE_LENGTH - 1] = '\0';
+    strncpy(alert->message, message, NETWORK_NOTIFICATION_MESSAGE_LENGTH - 1);
+    alert->message[NETWORK_NOTIFICATION_MESSAGE_LENGTH - 1] = '\0';
+    alert->priority = priority;
     
-    success = sendSMS(fullMessage.c_str());
-    
-    // For high priority, make emergency call too
-    if (priority >= 3) {
-      makeEmergencyCall();
+    if (networkSendNotification(title, message, priority, NET_CLASS_EMERGENCY, emergencyAlertCompleted, alert)) {
+      logInfo("EMERGENCY", "Emergency alert queued");
+      return true;
     }
+    alert->inUse = false;
   }
   
-  // Log the result
+  // Could not queue the alert, go straight to SMS
+  logWarning("EMERGENCY", "Could not queue emergency alert, falling back to SMS");
+  bool success = sendEmergencyFallback(title, message, priority);
+  
   if (success) {
     logInfo("EMERGENCY", "Emergency alert sent successfully");
   } else {
@@ -207,8 +268,9 @@ void handleSOSTouch() {
           // Start alert sequence - non-blocking
           activateBuzzer(2000);
           
-          // Save emergency event
-          saveEmergencyEvent("SOS", millis());
+          // Record the event in the journal
+          journalAppend(JOURNAL_SOS, JOURNAL_SEVERITY_MAX, "Emergency button");
+          telemetryAddEvent("SOS", "Emergency button activated by user", TELEMETRY_PRIORITY_EMERGENCY);
         }
       }
       break;
@@ -322,7 +384,7 @@ void updateBuzzer() {
 
 // Set emergency contacts
 void setEmergencyContacts(String* contacts, int count) {
-  emergencyContactCount = min(count, 5);  // Maximum 5 contacts
+  emergencyContactCount = min(count, EMERGENCY_MAX_CONTACTS);
   
   for (int i = 0; i < emergencyContactCount; i++) {
     emergencyContacts[i] = contacts[i];
@@ -332,5 +394,12 @@ void setEmergencyContacts(String* contacts, int count) {
     saveString(contactKeyStr.c_str(), contacts[i]);
   }
   
+  // Drop stored contacts beyond the new list so they do not come back on reboot
+  for (int i = emergencyContactCount; i < EMERGENCY_MAX_CONTACTS; i++) {
+    String contactKeyStr = "contact_" + String(i);
+    emergencyContacts[i] = "";
+    removeKey(contactKeyStr.c_str());
+  }
+  
   logInfo("EMERGENCY", "Saved " + String(emergencyContactCount) + " emergency contacts");
 }
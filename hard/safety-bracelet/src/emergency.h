@@ -12,6 +12,9 @@
 // Buzzer pin
 #define BUZZER_PIN 13
 
+// Emergency contacts
+#define EMERGENCY_MAX_CONTACTS 5
+
 // Emergency functions
 void emergencyInit();
 bool sendEmergencyAlert(const char* title, const char* message, int priority);
@@ -22,5 +25,6 @@ void handleBLETouch();
 bool isInEmergencyMode();
 void activateBuzzer(int duration);
 void updateBuzzer();
+void setEmergencyContacts(String* contacts, int count);
 
 #endif // EMERGENCY_H
@@ -0,0 +1,187 @@
+#include "flash_ring.h"
+#include "utils.h"
+#include <esp32/rom/crc.h>
+
+#define FLASH_RING_MAX_RECORD_SIZE 256
+
+// Wrap-safe "a comes after b" for 32-bit sequence numbers
+static bool seqAfter(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) > 0;
+}
+
+// Flash offset of the slot holding a sequence number
+static uint32_t slotOffset(const FlashRing* ring, uint32_t seq) {
+  uint32_t slot = seq % ring->slotCount;
+  uint32_t sector = slot / ring->recordsPerSector;
+  uint32_t index = slot % ring->recordsPerSector;
+  return sector * FLASH_RING_SECTOR_SIZE + index * ring->recordSize;
+}
+
+// Read a slot header by slot number
+static bool readHeader(const FlashRing* ring, uint32_t slot, FlashRingHeader* header) {
+  uint32_t offset = (slot / ring->recordsPerSector) * FLASH_RING_SECTOR_SIZE +
+                    (slot % ring->recordsPerSector) * ring->recordSize;
+  return esp_partition_read(ring->partition, offset, header, sizeof(FlashRingHeader)) == ESP_OK;
+}
+
+// Check whether a slot is still erased (never written since the last sector erase)
+static bool slotErased(const FlashRing* ring, uint32_t slot) {
+  FlashRingHeader header;
+  if (!readHeader(ring, slot, &header)) {
+    return false;
+  }
+  return header.magic == 0xFFFF && header.crc == 0xFFFF && header.seq == 0xFFFFFFFF;
+}
+
+// Read and verify a full record; payload may be NULL to only verify
+// At most length bytes are copied, so a payload struct smaller than the slot is never overrun
+static bool readRecord(const FlashRing* ring, uint32_t seq, void* payload, size_t length) {
+  uint8_t buffer[FLASH_RING_MAX_RECORD_SIZE];
+  if (esp_partition_read(ring->partition, slotOffset(ring, seq), buffer, ring->recordSize) != ESP_OK) {
+    return false;
+  }
+
+  FlashRingHeader* header = (FlashRingHeader*)buffer;
+  uint32_t payloadSize = flashRingPayloadSize(ring);
+  if (header->magic != FLASH_RING_MAGIC || header->seq != seq ||
+      header->crc != crc16_le(0, buffer + sizeof(FlashRingHeader), payloadSize)) {
+    return false;
+  }
+
+  if (payload != NULL) {
+    memcpy(payload, buffer + sizeof(FlashRingHeader), min((size_t)payloadSize, length));
+  }
+  return true;
+}
+
+// Open the ring on a partition and recover head and tail from flash
+bool flashRingInit(FlashRing* ring, const char* partitionLabel, uint16_t recordSize) {
+  memset(ring, 0, sizeof(FlashRing));
+
+  if (recordSize <= sizeof(FlashRingHeader) || recordSize > FLASH_RING_MAX_RECORD_SIZE ||
+      FLASH_RING_SECTOR_SIZE % recordSize != 0) {
+    logError("FLASH", "Invalid record size " + String(recordSize) + " for " + String(partitionLabel));
+    return false;
+  }
+
+  ring->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partitionLabel);
+  if (ring->partition == NULL) {
+    logError("FLASH", "Partition not found: " + String(partitionLabel));
+    return false;
+  }
+
+  ring->recordSize = recordSize;
+  ring->recordsPerSector = FLASH_RING_SECTOR_SIZE / recordSize;
+  ring->sectorCount = ring->partition->size / FLASH_RING_SECTOR_SIZE;
+  ring->slotCount = ring->sectorCount * ring->recordsPerSector;
+
+  // Sectors fill in order, so the first record of each sector tells us which
+  // sector holds the head and which one holds the oldest data
+  bool found = false;
+  uint32_t newestFirstSeq = 0;
+  uint32_t newestSector = 0;
+  uint32_t oldestFirstSeq = 0;
+
+  for (uint32_t sector = 0; sector < ring->sectorCount; sector++) {
+    FlashRingHeader header;
+    uint32_t slot = sector * ring->recordsPerSector;
+    if (!readHeader(ring, slot, &header) || header.magic != FLASH_RING_MAGIC ||
+        header.seq % ring->slotCount != slot) {
+      continue;
+    }
+
+    if (!found || seqAfter(header.seq, newestFirstSeq)) {
+      newestFirstSeq = header.seq;
+      newestSector = sector;
+    }
+    if (!found || seqAfter(oldestFirstSeq, header.seq)) {
+      oldestFirstSeq = header.seq;
+    }
+    found = true;
+  }
+
+  if (!found) {
+    ring->headSeq = 0;
+    ring->oldestSeq = 0;
+    logInfo("FLASH", String(partitionLabel) + " is empty, " + String(ring->slotCount) + " slots");
+    return true;
+  }
+
+  // Walk the head sector to the first slot that is still erased
+  uint32_t seq = newestFirstSeq;
+  uint32_t sectorEnd = newestFirstSeq + ring->recordsPerSector;
+  while (seq != sectorEnd && !slotErased(ring, newestSector * ring->recordsPerSector + (seq - newestFirstSeq))) {
+    seq++;
+  }
+
+  ring->headSeq = seq;
+  ring->oldestSeq = oldestFirstSeq;
+
+  logInfo("FLASH", String(partitionLabel) + " recovered: records " + String(ring->oldestSeq) + ".." +
+          String(ring->headSeq) + " of " + String(ring->slotCount) + " slots");
+  return true;
+}
+
+// Size of the payload part of a record
+uint32_t flashRingPayloadSize(const FlashRing* ring) {
+  return ring->recordSize - sizeof(FlashRingHeader);
+}
+
+// Check whether a sequence number is still stored
+bool flashRingContains(const FlashRing* ring, uint32_t seq) {
+  return !seqAfter(ring->oldestSeq, seq) && seqAfter(ring->headSeq, seq);
+}
+
+// Append one record of length bytes; the rest of the payload is zero-filled
+bool flashRingAppend(FlashRing* ring, const void* payload, size_t length, uint32_t* seq) {
+  if (ring->partition == NULL) {
+    return false;
+  }
+
+  uint32_t writeSeq = ring->headSeq;
+  uint32_t offset = slotOffset(ring, writeSeq);
+
+  // Entering a sector: erase it, dropping the oldest records it held
+  if (offset % FLASH_RING_SECTOR_SIZE == 0) {
+    if (esp_partition_erase_range(ring->partition, offset, FLASH_RING_SECTOR_SIZE) != ESP_OK) {
+      logError("FLASH", "Sector erase failed at offset " + String(offset));
+      return false;
+    }
+
+    uint32_t firstKept = writeSeq - ring->slotCount + ring->recordsPerSector;
+    if (seqAfter(firstKept, ring->oldestSeq)) {
+      ring->oldestSeq = firstKept;
+    }
+  }
+
+  uint8_t buffer[FLASH_RING_MAX_RECORD_SIZE];
+  FlashRingHeader* header = (FlashRingHeader*)buffer;
+  uint32_t payloadSize = flashRingPayloadSize(ring);
+  length = min((size_t)payloadSize, length);
+  memcpy(buffer + sizeof(FlashRingHeader), payload, length);
+  memset(buffer + sizeof(FlashRingHeader) + length, 0, payloadSize - length);
+  header->magic = FLASH_RING_MAGIC;
+  header->seq = writeSeq;
+  header->crc = crc16_le(0, buffer + sizeof(FlashRingHeader), payloadSize);
+
+  // Consume the slot even if the write fails so the seq/slot mapping holds
+  ring->headSeq = writeSeq + 1;
+
+  if (esp_partition_write(ring->partition, offset, buffer, ring->recordSize) != ESP_OK) {
+    logError("FLASH", "Record write failed at offset " + String(offset));
+    return false;
+  }
+
+  if (seq != NULL) {
+    *seq = writeSeq;
+  }
+  return true;
+}
+
+// Read a record by sequence number; fails if it was overwritten or is corrupt
+bool flashRingRead(FlashRing* ring, uint32_t seq, void* payload, size_t length) {
+  if (ring->partition == NULL || !flashRingContains(ring, seq)) {
+    return false;
+  }
+  return readRecord(ring, seq, payload, length);
+}
@@ -0,0 +1,41 @@
+#ifndef FLASH_RING_H
+#define FLASH_RING_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+
+// Fixed-size record log over a raw flash data partition.
+// Records are written in order and every slot consumes one sequence number,
+// so the slot of a record is always (seq % slotCount). When the head enters a
+// sector, that sector is erased and the oldest records in it are dropped.
+// Keep slotCount a power of two so the mapping survives 32-bit seq wrap-around.
+
+#define FLASH_RING_SECTOR_SIZE 4096
+#define FLASH_RING_MAGIC 0x5A52  // "RZ"
+
+// Header written in front of every record
+struct FlashRingHeader {
+  uint16_t magic;
+  uint16_t crc;      // CRC16 over the payload
+  uint32_t seq;
+};
+
+// Ring state
+struct FlashRing {
+  const esp_partition_t* partition;
+  uint16_t recordSize;          // Slot size including header
+  uint32_t recordsPerSector;
+  uint32_t sectorCount;
+  uint32_t slotCount;
+  uint32_t headSeq;             // Sequence number of the next record to write
+  uint32_t oldestSeq;           // Oldest record still stored
+};
+
+// Functions
+bool flashRingInit(FlashRing* ring, const char* partitionLabel, uint16_t recordSize);
+bool flashRingAppend(FlashRing* ring, const void* payload, size_t length, uint32_t* seq);
+bool flashRingRead(FlashRing* ring, uint32_t seq, void* payload, size_t length);
+uint32_t flashRingPayloadSize(const FlashRing* ring);
+bool flashRingContains(const FlashRing* ring, uint32_t seq);
+
+#endif // FLASH_RING_H
@@ -0,0 +1,230 @@
+#include "flight_recorder.h"
+#include "clock_service.h"
+#include "telemetry.h"
+#include "utils.h"
+#include <esp_system.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <esp_app_desc.h>
+#else
+#include <esp_ota_ops.h>
+#endif
+
+// Everything that survives the reset
+struct FlightRecorderState {
+  uint32_t magic;                   // FLIGHT_MAGIC plus the layout size
+  uint32_t image;                   // Firmware that wrote the record, see imageId()
+  uint32_t head;                    // Events written since the record was cleared
+  uint8_t loopStage;
+  uint8_t networkStage;
+  uint32_t loopStageSince;          // Uptime the stage was entered (ms)
+  uint32_t networkStageSince;
+  FlightEvent events[FLIGHT_EVENT_COUNT];
+};
+
+static_assert(sizeof(FlightEvent) == 96, "FlightEvent layout changed, check FLIGHT_EVENT_COUNT");
+static_assert(FLIGHT_REPORT_EVENTS < TELEMETRY_BATCH_CAPACITY, "Crash report must fit in one telemetry batch");
+
+#define FLIGHT_STATE_MAGIC (FLIGHT_MAGIC ^ sizeof(FlightRecorderState))
+
+RTC_NOINIT_ATTR static FlightRecorderState recorder;
+
+// Crash report from the previous boot, kept for BLE
+static bool crashed = false;
+static char summary[TELEMETRY_EVENT_MESSAGE_LENGTH];
+static FlightEvent reportEvents[FLIGHT_REPORT_EVENTS];
+static int reportCount = 0;
+static bool reportSameImage = false;     // The format pointers of the report can be followed
+
+static const char* const stageNames[FLIGHT_STAGE_COUNT] = {
+  "none", "setup",
+  "loop", "completions", "downlink", "config", "ble", "gps", "mpu", "battery", "touch", "connection",
+  "clock", "display", "telemetry", "child_data", "stats", "activity", "ota", "sleep", "yield",
+  "idle", "poll", "replay", "gps", "battery", "notification", "telemetry", "child_data"
+};
+static const char levelLetters[] = "DIWE";
+
+static const char* stageName(uint8_t stage) {
+  return stage < FLIGHT_STAGE_COUNT ? stageNames[stage] : "?";
+}
+
+// Resets that leave a record worth reporting
+static const char* crashReason(esp_reset_reason_t reason) {
+  switch (reason) {
+    case ESP_RST_PANIC: return "panic";
+    case ESP_RST_INT_WDT: return "int_wdt";
+    case ESP_RST_TASK_WDT: return "task_wdt";
+    case ESP_RST_WDT: return "wdt";
+    case ESP_RST_BROWNOUT: return "brownout";
+    default: return NULL;
+  }
+}
+
+// Identifies the running firmware by the start of its ELF hash
+static uint32_t imageId() {
+#if ESP_IDF_VERSION_MAJOR >= 5
+  const esp_app_desc_t* app = esp_app_get_description();
+#else
+  const esp_app_desc_t* app = esp_ota_get_app_description();
+#endif
+  uint32_t id;
+  memcpy(&id, app->app_elf_sha256, sizeof(id));
+  return id;
+}
+
+// Copy an event's tag, which is not terminated when it fills the field
+static void eventTag(const FlightEvent& event, char* tag) {
+  memcpy(tag, event.tag, FLIGHT_TAG_LENGTH);
+  tag[FLIGHT_TAG_LENGTH] = '\0';
+}
+
+// Format the message of one event
+// Format strings are only read when this image wrote the event; otherwise, and in tokenized
+// builds, the message shows the format token and the arguments
+static size_t formatEventMessage(const FlightEvent& event, bool sameImage, char* buffer, size_t size) {
+  LogRecord record;
+  memset(&record, 0, sizeof(record));
+  record.format = sameImage ? event.format : NULL;
+  record.token = event.token;
+  record.kind = event.kind;
+  record.level = event.level;
+  record.argCount = min(event.argCount, (uint8_t)FLIGHT_ARG_COUNT);
+  memcpy(record.argTypes, event.argTypes, record.argCount);
+  memcpy(record.args, event.args, record.argCount * sizeof(LogArgValue));
+  memcpy(record.text, event.text, FLIGHT_TEXT_LENGTH);
+  record.textLength = FLIGHT_TEXT_LENGTH;
+  return logFormatMessage(record, buffer, size);
+}
+
+// Format one event as "[up 812.345s] [W] [API] loop=connection message"
+static size_t formatEvent(const FlightEvent& event, bool sameImage, char* buffer, size_t size) {
+  char tag[FLIGHT_TAG_LENGTH + 1];
+  eventTag(event, tag);
+  int length = snprintf(buffer, size, "[up %lu.%03us] [%c] [%s] %s ", (unsigned long)(event.uptime / 1000),
+                        (unsigned)(event.uptime % 1000), event.level < 4 ? levelLetters[event.level] : '?', tag,
+                        stageName(event.stage));
+  if (length < 0 || length >= (int)size) {
+    return length > 0 ? size - 1 : 0;
+  }
+  return length + formatEventMessage(event, sameImage, buffer + length, size - length);
+}
+
+// Keep a copy of each record as it is logged (logger hook, any task)
+// The slot is claimed atomically, so records still waiting in the log ring at a crash are kept too
+static void recordLog(const LogRecord& record) {
+  uint32_t index = __atomic_fetch_add(&recorder.head, 1, __ATOMIC_RELAXED);
+  FlightEvent& event = recorder.events[index % FLIGHT_EVENT_COUNT];
+  event.uptime = (uint32_t)record.uptime;
+  event.token = record.token;
+  event.format = record.format;
+  event.kind = record.kind;
+  event.level = record.level;
+  event.stage = recorder.loopStage;
+  event.argCount = record.argCount;
+  uint8_t argCount = min(record.argCount, (uint8_t)FLIGHT_ARG_COUNT);
+  memcpy(event.argTypes, record.argTypes, argCount);
+  memcpy(event.args, record.args, argCount * sizeof(LogArgValue));
+  strncpy(event.tag, record.tag, FLIGHT_TAG_LENGTH);
+  size_t textLength = min((size_t)record.textLength, (size_t)FLIGHT_TEXT_LENGTH);
+  memcpy(event.text, record.text, textLength);
+  if (textLength < FLIGHT_TEXT_LENGTH) {
+    event.text[textLength] = '\0';
+  }
+}
+
+// Print the record left by a crash and keep its summary and newest events
+static void takeCrashReport(const char* reason) {
+  crashed = true;
+  reportSameImage = recorder.image == imageId();
+  snprintf(summary, sizeof(summary), "%s loop=%s@%lus net=%s@%lus", reason, stageName(recorder.loopStage),
+           (unsigned long)(recorder.loopStageSince / 1000), stageName(recorder.networkStage),
+           (unsigned long)(recorder.networkStageSince / 1000));
+  logWarning("FLIGHT", "Reset by " + String(summary));
+
+  uint32_t count = min(recorder.head, (uint32_t)FLIGHT_EVENT_COUNT);
+  char line[FLIGHT_LINE_LENGTH];
+  for (uint32_t i = recorder.head - count; i != recorder.head; i++) {
+    const FlightEvent& event = recorder.events[i % FLIGHT_EVENT_COUNT];
+    formatEvent(event, reportSameImage, line, sizeof(line));
+    logInfo("FLIGHT", line);
+    if (recorder.head - i <= FLIGHT_REPORT_EVENTS) {
+      reportEvents[reportCount++] = event;
+    }
+  }
+  logInfo("FLIGHT", "End of flight record, " + String(count) + " events");
+}
+
+// Check the record left by the previous boot and start a new one
+// Call right after Serial.begin, before logInit, so the dump is written straight out
+void flightRecorderInit() {
+  const char* reason = crashReason(esp_reset_reason());
+  bool valid = recorder.magic == FLIGHT_STATE_MAGIC;
+  if (reason != NULL && valid) {
+    takeCrashReport(reason);
+  } else if (reason != NULL) {
+    logWarning("FLIGHT", "Reset by " + String(reason) + ", no flight record");
+  }
+
+  memset(&recorder, 0, sizeof(recorder));
+  recorder.magic = FLIGHT_STATE_MAGIC;
+  recorder.image = imageId();
+  flightStage(FLIGHT_STAGE_SETUP);
+  flightNetworkStage(FLIGHT_STAGE_NONE);
+  logSetRecordHook(recordLog);
+}
+
+// Queue the crash summary and the newest events for upload (call after telemetryInit)
+// Each event goes as a "crash_log" event, "812.345 W API message", cut to the event length
+void flightRecorderQueueReport() {
+  if (!crashed) {
+    return;
+  }
+  telemetryAddEvent("crash", summary, TELEMETRY_PRIORITY_ALERT);
+
+  char line[TELEMETRY_EVENT_MESSAGE_LENGTH];
+  for (int i = 0; i < reportCount; i++) {
+    const FlightEvent& event = reportEvents[i];
+    char tag[FLIGHT_TAG_LENGTH + 1];
+    eventTag(event, tag);
+    int length = snprintf(line, sizeof(line), "%lu.%03u %c %s ", (unsigned long)(event.uptime / 1000),
+                          (unsigned)(event.uptime % 1000), event.level < 4 ? levelLetters[event.level] : '?', tag);
+    if (length > 0 && length < (int)sizeof(line)) {
+      formatEventMessage(event, reportSameImage, line + length, sizeof(line) - length);
+    }
+    telemetryAddEvent("crash_log", line, TELEMETRY_PRIORITY_ALERT);
+  }
+}
+
+// Mark the main loop stage; a plain store, cheap enough for every loop
+void flightStage(FlightStage stage) {
+  recorder.loopStageSince = (uint32_t)clockUptimeMs();
+  recorder.loopStage = stage;
+}
+
+// Mark the network task stage
+void flightNetworkStage(FlightStage stage) {
+  recorder.networkStageSince = (uint32_t)clockUptimeMs();
+  recorder.networkStage = stage;
+}
+
+// Check if this boot followed a panic, watchdog or brownout reset with a record
+bool flightRecorderCrashed() {
+  return crashed;
+}
+
+// One-line summary of the crash, e.g. "task_wdt loop=connection@812s net=gps@790s"
+const char* flightRecorderSummary() {
+  return summary;
+}
+
+// Newest events from before the crash, oldest first
+int flightRecorderReportCount() {
+  return reportCount;
+}
+
+size_t flightRecorderReportLine(int index, char* buffer, size_t size) {
+  if (index < 0 || index >= reportCount) {
+    return 0;
+  }
+  return formatEvent(reportEvents[index], reportSameImage, buffer, size);
+}
@@ -0,0 +1,83 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <Arduino.h>
+#include "logger.h"
+
+// Flight recorder: the last log events and the stage the main loop and the network task
+// were in, kept in RTC slow memory. That memory is not cleared by a panic or a watchdog
+// reset, so after such a reset the record from before it is printed, offered over BLE and
+// queued for upload. A power-on reset starts with an empty record.
+
+// Recorder settings
+#define FLIGHT_EVENT_COUNT 64               // 96 bytes each, 6 KB of the 8 KB RTC slow memory
+#define FLIGHT_TAG_LENGTH 8
+#define FLIGHT_ARG_COUNT 4                  // Arguments kept per event; later ones show as "?"
+#define FLIGHT_TEXT_LENGTH 36               // Message text, or the %s arguments
+#define FLIGHT_REPORT_EVENTS 16             // Newest events kept for BLE and uploaded after a crash
+#define FLIGHT_LINE_LENGTH 80
+#define FLIGHT_MAGIC 0x464C5452UL
+
+// Where the code was; one stage for the main loop and one for the network task is kept
+enum FlightStage : uint8_t {
+  FLIGHT_STAGE_NONE,
+  FLIGHT_STAGE_SETUP,
+  // Main loop, in order
+  FLIGHT_STAGE_LOOP,              // Watchdog feed, buzzer
+  FLIGHT_STAGE_COMPLETIONS,
+  FLIGHT_STAGE_DOWNLINK,
+  FLIGHT_STAGE_CONFIG,            // NVS write-back
+  FLIGHT_STAGE_BLE,
+  FLIGHT_STAGE_GPS,               // UART
+  FLIGHT_STAGE_MPU,               // I2C
+  FLIGHT_STAGE_BATTERY,
+  FLIGHT_STAGE_TOUCH,
+  FLIGHT_STAGE_CONNECTION,        // WiFi and GPRS upkeep, modem AT commands
+  FLIGHT_STAGE_CLOCK,
+  FLIGHT_STAGE_DISPLAY,           // I2C
+  FLIGHT_STAGE_TELEMETRY,
+  FLIGHT_STAGE_CHILD_DATA,
+  FLIGHT_STAGE_STATS,
+  FLIGHT_STAGE_ACTIVITY,
+  FLIGHT_STAGE_OTA,
+  FLIGHT_STAGE_SLEEP,
+  FLIGHT_STAGE_YIELD,
+  // Network task
+  FLIGHT_STAGE_NET_IDLE,
+  FLIGHT_STAGE_NET_POLL,          // MQTT keepalive and downlink
+  FLIGHT_STAGE_NET_REPLAY,
+  FLIGHT_STAGE_NET_GPS,           // Same order as NetworkRequestType from here
+  FLIGHT_STAGE_NET_BATTERY,
+  FLIGHT_STAGE_NET_NOTIFICATION,
+  FLIGHT_STAGE_NET_TELEMETRY,
+  FLIGHT_STAGE_NET_CHILD_DATA,
+  FLIGHT_STAGE_COUNT
+};
+
+// One recorded log event, kept unformatted: copying the captured record is all the logging
+// call pays, and the text is only put together when the record is dumped after a crash
+struct FlightEvent {
+  LogArgValue args[FLIGHT_ARG_COUNT];
+  uint32_t uptime;                  // ms since boot, low 32 bits
+  uint32_t token;
+  const char* format;               // Literal in flash; only followed when the same image dumps it
+  uint8_t kind;                     // LogRecordKind
+  uint8_t level;
+  uint8_t stage;                    // Main loop stage when the event was written
+  uint8_t argCount;
+  uint8_t argTypes[FLIGHT_ARG_COUNT];
+  char tag[FLIGHT_TAG_LENGTH];      // Not terminated when the tag fills it
+  char text[FLIGHT_TEXT_LENGTH];    // Start of the record's text; %s offsets past it read as empty
+};
+
+// Functions
+void flightRecorderInit();
+void flightRecorderQueueReport();
+void flightStage(FlightStage stage);
+void flightNetworkStage(FlightStage stage);
+bool flightRecorderCrashed();
+const char* flightRecorderSummary();
+int flightRecorderReportCount();
+size_t flightRecorderReportLine(int index, char* buffer, size_t size);
+
+#endif // FLIGHT_RECORDER_H
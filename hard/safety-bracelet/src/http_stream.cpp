@@ -0,0 +1,127 @@
+#include "http_stream.h"
+
+// Wrap a source stream, allowing `limit` more bytes to be read
+BoundedStream::BoundedStream(Stream& source, size_t limit) : source(source), left(limit) {
+}
+
+// Bytes that can be read now without blocking
+int BoundedStream::available() {
+  if (left == 0) {
+    return 0;
+  }
+  int ready = source.available();
+  return ready < (int)left ? ready : (int)left;
+}
+
+// Read one byte, waiting up to the source's timeout; -1 at the limit or on timeout
+int BoundedStream::read() {
+  if (left == 0) {
+    return -1;
+  }
+  uint8_t value;
+  if (source.readBytes(&value, 1) != 1) {
+    return -1;
+  }
+  left--;
+  return value;
+}
+
+// Look at the next byte without consuming it
+int BoundedStream::peek() {
+  if (left == 0) {
+    return -1;
+  }
+  return source.peek();
+}
+
+// Read up to length bytes, never past the limit
+size_t BoundedStream::readBytes(char* buffer, size_t length) {
+  if (length > left) {
+    length = left;
+  }
+  size_t count = source.readBytes(buffer, length);
+  left -= count;
+  return count;
+}
+
+// Read-only stream
+size_t BoundedStream::write(uint8_t value) {
+  return 0;
+}
+
+// Bytes of the body not read yet
+size_t BoundedStream::remaining() const {
+  return left;
+}
+
+// Skip the rest of the body; returns false if the source stopped delivering bytes first
+bool BoundedStream::drain() {
+  char scratch[32];
+  while (left > 0) {
+    size_t count = readBytes(scratch, left < sizeof(scratch) ? left : sizeof(scratch));
+    if (count == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Forward writes to sink
+SinkStream::SinkStream(HttpBodySink sink, void* context) : sink(sink), context(context), sinkFailed(false) {
+}
+
+// Write-only stream
+int SinkStream::available() {
+  return 0;
+}
+
+// Write-only stream
+int SinkStream::read() {
+  return -1;
+}
+
+// Write-only stream
+int SinkStream::peek() {
+  return -1;
+}
+
+// Forward one byte
+size_t SinkStream::write(uint8_t value) {
+  return write(&value, 1);
+}
+
+// Forward a block; reporting 0 bytes written makes writeToStream stop
+size_t SinkStream::write(const uint8_t* data, size_t length) {
+  if (sinkFailed || !sink(data, length, context)) {
+    sinkFailed = true;
+    return 0;
+  }
+  return length;
+}
+
+// Check if the sink refused data
+bool SinkStream::failed() const {
+  return sinkFailed;
+}
+
+// Start filling buffer
+void bufferSinkBegin(BufferSink* sink, char* buffer, size_t capacity) {
+  sink->buffer = buffer;
+  sink->capacity = capacity;
+  sink->length = 0;
+  sink->overflowed = false;
+  buffer[0] = '\0';
+}
+
+// HttpBodySink that appends to a BufferSink; stops once the buffer is full
+bool bufferSinkWrite(const uint8_t* data, size_t length, void* context) {
+  BufferSink* sink = (BufferSink*)context;
+  if (sink->length + length > sink->capacity - 1) {
+    sink->overflowed = true;
+    return false;
+  }
+  memcpy(sink->buffer + sink->length, data, length);
+  sink->length += length;
+  sink->buffer[sink->length] = '\0';
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef HTTP_STREAM_H
+#define HTTP_STREAM_H
+
+#include <Arduino.h>
+
+// Stream adapters used to consume HTTP response bodies without buffering them in a String
+
+// Receives a response body piece by piece; return false to stop reading
+typedef bool (*HttpBodySink)(const uint8_t* data, size_t length, void* context);
+
+// Reads at most `limit` bytes from another stream (a body with a known Content-Length),
+// so a parser never runs into the next response on a kept-alive connection
+class BoundedStream : public Stream {
+ public:
+  BoundedStream(Stream& source, size_t limit);
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t readBytes(char* buffer, size_t length);
+  size_t write(uint8_t value) override;
+  size_t remaining() const;
+  bool drain();
+
+ private:
+  Stream& source;
+  size_t left;
+};
+
+// Write-only stream that forwards everything to a body sink (used with HTTPClient::writeToStream
+// for chunked bodies, which the client has to decode itself)
+class SinkStream : public Stream {
+ public:
+  SinkStream(HttpBodySink sink, void* context);
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t* data, size_t length) override;
+  bool failed() const;
+
+ private:
+  HttpBodySink sink;
+  void* context;
+  bool sinkFailed;
+};
+
+// Sink that copies into a fixed buffer, keeping it null terminated
+struct BufferSink {
+  char* buffer;
+  size_t capacity;
+  size_t length;
+  bool overflowed;
+};
+
+void bufferSinkBegin(BufferSink* sink, char* buffer, size_t capacity);
+bool bufferSinkWrite(const uint8_t* data, size_t length, void* context);
+
+#endif // HTTP_STREAM_H
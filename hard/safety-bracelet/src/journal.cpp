@@ -0,0 +1,363 @@
+#include "journal.h"
+#include "utils.h"
+#include "storage.h"
+#include "sensors.h"
+#include "api.h"
+#include "downlink.h"
+#include "sequence.h"
+#include "clock_service.h"
+
+// The ring copies whole slot payloads in and out, so the record must fill one exactly
+static_assert(sizeof(JournalRecord) == JOURNAL_RECORD_SIZE - sizeof(FlashRingHeader),
+              "JournalRecord must match the journal slot payload size");
+
+// Wall time range of the records in one sector; empty when minTime > maxTime
+struct JournalSectorIndex {
+  uint32_t minTime;
+  uint32_t maxTime;
+};
+
+// Journal state; appended from the main loop, read by the BLE and network tasks
+static FlashRing ring;
+static bool journalReady = false;
+static SemaphoreHandle_t journalMutex = NULL;
+static JournalSectorIndex sectorIndex[JOURNAL_MAX_SECTORS];
+static uint32_t uploadSeq = 0;           // First record not yet acknowledged by the server
+static uint32_t appSeq = 0;              // First record not yet acknowledged by the app
+static uint16_t bootCount = 0;
+static unsigned long lastUploadFailureTime = 0;
+static bool lastUploadFailed = false;
+
+// Upload buffers, used only by the network task
+static JournalRecord uploadRecords[JOURNAL_UPLOAD_BATCH];
+static int uploadCount = 0;
+static char uploadKey[SEQUENCE_KEY_LENGTH];
+
+static const char* const typeNames[] = { "SOS", "FALL" };
+
+// Wrap-safe "a comes before b" for ring sequence numbers
+static bool seqBefore(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+// Sector of the ring that holds a sequence number
+static uint32_t sectorOf(uint32_t seq) {
+  return (seq % ring.slotCount) / ring.recordsPerSector;
+}
+
+static void clearSector(uint32_t sector) {
+  sectorIndex[sector].minTime = UINT32_MAX;
+  sectorIndex[sector].maxTime = 0;
+}
+
+// Widen a sector's time range by one record; records without a wall time count as time 0
+static void indexRecord(uint32_t seq, const JournalRecord& record) {
+  JournalSectorIndex& entry = sectorIndex[sectorOf(seq)];
+  entry.minTime = min(entry.minTime, record.wallTime);
+  entry.maxTime = max(entry.maxTime, record.wallTime);
+}
+
+// Keep a cursor inside the stored range (caller holds the mutex)
+static uint32_t clampCursor(uint32_t seq) {
+  if (seqBefore(seq, ring.oldestSeq) || seqBefore(ring.headSeq, seq)) {
+    return ring.oldestSeq;
+  }
+  return seq;
+}
+
+// Append a filled-in record (fills in bookkeeping fields)
+static bool appendRecord(JournalRecord& record) {
+  record.seq = sequenceNext();
+  record.bootCount = bootCount;
+
+  xSemaphoreTake(journalMutex, portMAX_DELAY);
+  uint32_t seq = ring.headSeq;
+  // Entering a sector erases it, so its old index entry goes with it
+  if (seq % ring.recordsPerSector == 0) {
+    clearSector(sectorOf(seq));
+  }
+  bool success = flashRingAppend(&ring, &record, sizeof(record), NULL);
+  if (success) {
+    indexRecord(seq, record);
+  }
+
+  // The ring overwrote records nobody had fetched yet
+  if (seqBefore(uploadSeq, ring.oldestSeq)) {
+    LOGW("JOURNAL", "Journal full, events %lu..%lu were never uploaded", uploadSeq, ring.oldestSeq - 1);
+    uploadSeq = ring.oldestSeq;
+  }
+  if (seqBefore(appSeq, ring.oldestSeq)) {
+    appSeq = ring.oldestSeq;
+  }
+  xSemaphoreGive(journalMutex);
+
+  if (success) {
+    LOGI("JOURNAL", "Recorded %s event %lu, severity %u", journalTypeName(record.type), seq,
+         (unsigned)record.severity);
+  } else {
+    LOGE("JOURNAL", "Failed to record %s event", journalTypeName(record.type));
+  }
+  return success;
+}
+
+// Move the single event older firmware kept in preferences into an empty journal
+static void migrateLastEvent() {
+  char type[STORAGE_EMERGENCY_TYPE_LENGTH];
+  unsigned long timestamp;
+  if (ring.headSeq != ring.oldestSeq || !getLastEmergencyEvent(type, &timestamp)) {
+    return;
+  }
+
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.wallTime = timestamp;
+  record.type = strncmp(type, "SOS", 3) == 0 ? JOURNAL_SOS : JOURNAL_FALL;
+  record.severity = record.type == JOURNAL_SOS ? JOURNAL_SEVERITY_MAX : 0;
+  record.latitude = NAN;
+  record.longitude = NAN;
+  strncpy(record.detail, type, JOURNAL_DETAIL_LENGTH - 1);
+  if (appendRecord(record)) {
+    removeKey("emg_event");
+    removeKey("emg_type");
+    removeKey("emg_time");
+  }
+}
+
+// Open the journal and rebuild the time index (call after outboxInit)
+void journalInit() {
+  journalMutex = xSemaphoreCreateMutex();
+
+  if (!flashRingInit(&ring, JOURNAL_PARTITION_LABEL, JOURNAL_RECORD_SIZE)) {
+    logError("JOURNAL", "Journal partition unavailable, events will not be kept");
+    return;
+  }
+  if (ring.sectorCount > JOURNAL_MAX_SECTORS) {
+    LOGE("JOURNAL", "Journal partition has %lu sectors, at most %d are indexed", ring.sectorCount,
+         JOURNAL_MAX_SECTORS);
+    return;
+  }
+
+  // Counted up by outboxInit
+  bootCount = loadInt("boot_count", 0);
+
+  // One pass over the stored records; appends keep the index current after this
+  for (uint32_t sector = 0; sector < ring.sectorCount; sector++) {
+    clearSector(sector);
+  }
+  JournalRecord record;
+  for (uint32_t seq = ring.oldestSeq; seq != ring.headSeq; seq++) {
+    if (flashRingRead(&ring, seq, &record, sizeof(record))) {
+      indexRecord(seq, record);
+    }
+  }
+
+  uploadSeq = clampCursor(loadULong("jrn_upload", ring.oldestSeq));
+  appSeq = clampCursor(loadULong("jrn_app", ring.oldestSeq));
+
+  journalReady = true;
+  migrateLastEvent();
+  LOGI("JOURNAL", "Journal holds %lu events, %lu not uploaded", ring.headSeq - ring.oldestSeq,
+       journalPendingCount());
+}
+
+// Append an event with the current time and GPS position; severity is in tenths
+bool journalAppend(JournalEventType type, uint8_t severity, const char* detail) {
+  if (!journalReady) {
+    return false;
+  }
+
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.wallTime = clockUnixTime();
+  record.uptime = millis();
+  record.type = type;
+  record.severity = min(severity, (uint8_t)JOURNAL_SEVERITY_MAX);
+  record.latitude = isGpsValid() ? getLatitude() : NAN;
+  record.longitude = isGpsValid() ? getLongitude() : NAN;
+  strncpy(record.detail, detail, JOURNAL_DETAIL_LENGTH - 1);
+  return appendRecord(record);
+}
+
+// Call back for each readable record from startId on with a wall time in
+// [fromTime, toTime], oldest first, at most limit records (0 for no limit).
+// Returns the id to pass as startId to continue, or journalHeadId() when done.
+uint32_t journalQuery(uint32_t fromTime, uint32_t toTime, uint32_t startId, int limit,
+                      JournalCallback callback, void* context) {
+  if (!journalReady) {
+    return startId;
+  }
+
+  xSemaphoreTake(journalMutex, portMAX_DELAY);
+  uint32_t seq = clampCursor(startId);
+  xSemaphoreGive(journalMutex);
+
+  int found = 0;
+  JournalRecord record;
+  for (;;) {
+    xSemaphoreTake(journalMutex, portMAX_DELAY);
+    if (seqBefore(seq, ring.oldestSeq)) {
+      seq = ring.oldestSeq;
+    }
+    if (seq == ring.headSeq || (limit > 0 && found >= limit)) {
+      xSemaphoreGive(journalMutex);
+      break;
+    }
+
+    // Skip the rest of a sector whose records all lie outside the range
+    const JournalSectorIndex& entry = sectorIndex[sectorOf(seq)];
+    if (entry.minTime > toTime || entry.maxTime < fromTime) {
+      uint32_t nextSector = seq - seq % ring.recordsPerSector + ring.recordsPerSector;
+      seq = seqBefore(ring.headSeq, nextSector) ? ring.headSeq : nextSector;
+      xSemaphoreGive(journalMutex);
+      continue;
+    }
+
+    bool readable = flashRingRead(&ring, seq, &record, sizeof(record));
+    uint8_t delivery = (seqBefore(seq, uploadSeq) ? JOURNAL_DELIVERED_SERVER : 0) |
+                       (seqBefore(seq, appSeq) ? JOURNAL_DELIVERED_APP : 0);
+    xSemaphoreGive(journalMutex);
+
+    uint32_t id = seq++;
+    if (!readable || record.wallTime < fromTime || record.wallTime > toTime) {
+      continue;
+    }
+    found++;
+    if (!callback(id, record, delivery, context)) {
+      break;
+    }
+  }
+  return seq;
+}
+
+// Id of the oldest stored event
+uint32_t journalOldestId() {
+  return ring.oldestSeq;
+}
+
+// Id the next event will get
+uint32_t journalHeadId() {
+  return ring.headSeq;
+}
+
+// The app has stored every record before id
+void journalAcknowledgeApp(uint32_t id) {
+  if (!journalReady) {
+    return;
+  }
+  xSemaphoreTake(journalMutex, portMAX_DELAY);
+  id = seqBefore(ring.headSeq, id) ? ring.headSeq : id;
+  if (seqBefore(appSeq, id)) {
+    appSeq = id;
+    saveULong("jrn_app", appSeq);
+  }
+  xSemaphoreGive(journalMutex);
+}
+
+// Number of records the server has not acknowledged
+uint32_t journalPendingCount() {
+  if (!journalReady) {
+    return 0;
+  }
+  return ring.headSeq - uploadSeq;
+}
+
+const char* journalTypeName(uint8_t type) {
+  return type < sizeof(typeNames) / sizeof(typeNames[0]) ? typeNames[type] : "?";
+}
+
+// Write the collected records as one telemetry batch body
+static bool encodeUploadBatch(PayloadWriter* writer, const void* context) {
+  payloadBeginMap(writer, 3);
+  payloadKey(writer, "dev");
+  payloadString(writer, sequenceDeviceId());
+  payloadKey(writer, "cfg_v");
+  payloadUInt(writer, downlinkConfigVersion());
+  payloadKey(writer, "samples");
+  payloadBeginArray(writer, uploadCount);
+  for (int i = 0; i < uploadCount; i++) {
+    const JournalRecord& record = uploadRecords[i];
+    bool hasWallTime = record.wallTime > 0;
+    bool hasAge = !hasWallTime && record.bootCount == bootCount;
+    bool hasLocation = !isnan(record.latitude);
+
+    payloadBeginMap(writer, 5 + (hasWallTime || hasAge ? 1 : 0) + (hasLocation ? 2 : 0));
+    payloadKey(writer, "seq");
+    payloadUInt(writer, record.seq);
+    if (hasWallTime) {
+      payloadKey(writer, "ts");
+      payloadUInt(writer, record.wallTime);
+    } else if (hasAge) {
+      payloadKey(writer, "age");
+      payloadUInt(writer, millis() - record.uptime);
+    }
+    payloadKey(writer, "t");
+    payloadString(writer, "jrn");
+    payloadKey(writer, "type");
+    payloadString(writer, journalTypeName(record.type));
+    payloadKey(writer, "sev");
+    payloadUInt(writer, record.severity);
+    payloadKey(writer, "msg");
+    payloadString(writer, record.detail);
+    if (hasLocation) {
+      payloadKey(writer, "lat");
+      payloadFloat(writer, record.latitude, 6);
+      payloadKey(writer, "lon");
+      payloadFloat(writer, record.longitude, 6);
+    }
+    payloadEndMap(writer);
+  }
+  payloadEndArray(writer);
+  payloadEndMap(writer);
+  return true;
+}
+
+// Send the oldest records the server has not acknowledged and advance the cursor
+// Runs on the network task, after the outbox replay; an aborted upload starts no holdoff
+bool journalUpload() {
+  if (!journalReady || journalPendingCount() == 0) {
+    return true;
+  }
+
+  if (lastUploadFailed && millis() - lastUploadFailureTime < JOURNAL_RETRY_INTERVAL) {
+    return false;
+  }
+
+  int count = 0;
+  xSemaphoreTake(journalMutex, portMAX_DELAY);
+  uint32_t seq = uploadSeq;
+  while (seq != ring.headSeq && count < JOURNAL_UPLOAD_BATCH) {
+    if (flashRingRead(&ring, seq, &uploadRecords[count], sizeof(uploadRecords[count]))) {
+      count++;
+    } else {
+      LOGW("JOURNAL", "Skipping unreadable event %lu", seq);
+    }
+    seq++;
+  }
+  xSemaphoreGive(journalMutex);
+
+  bool success = true;
+  if (count > 0) {
+    uploadCount = count;
+    LOGI("JOURNAL", "Uploading %d events", count);
+    sequenceFormatKey(uploadKey, sizeof(uploadKey), uploadRecords[0].seq, uploadRecords[count - 1].seq);
+    success = sendTelemetryBatch(encodeUploadBatch, NULL, uploadKey, true);
+  }
+
+  if (!success && apiLastRequestAborted()) {
+    return false;
+  }
+  if (!success) {
+    lastUploadFailed = true;
+    lastUploadFailureTime = millis();
+    return false;
+  }
+
+  lastUploadFailed = false;
+  xSemaphoreTake(journalMutex, portMAX_DELAY);
+  if (seqBefore(uploadSeq, seq)) {
+    uploadSeq = seq;
+    saveULong("jrn_upload", uploadSeq);
+  }
+  xSemaphoreGive(journalMutex);
+  return true;
+}
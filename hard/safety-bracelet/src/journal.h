@@ -0,0 +1,64 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <Arduino.h>
+#include "flash_ring.h"
+
+// Emergency event journal: every SOS and fall is appended to its own flash partition
+// and kept until the ring wraps, so the history survives reboots and is not limited to
+// the last event. Records are never rewritten; appending costs one slot write, plus a
+// sector erase every 64 records, and wear is spread over all sectors of the partition.
+// A small per-sector time index lets range queries skip sectors outside the range.
+// Delivery to the server and to the app is tracked with one cursor each, since the
+// records are uploaded and acknowledged in order.
+
+// Journal settings
+#define JOURNAL_PARTITION_LABEL "journal"
+#define JOURNAL_RECORD_SIZE 64              // Flash slot size, 64 records per sector
+#define JOURNAL_MAX_SECTORS 64              // Time index entries; the partition may not be larger
+#define JOURNAL_DETAIL_LENGTH 32
+#define JOURNAL_UPLOAD_BATCH 16             // Records sent per upload request
+#define JOURNAL_SYNC_BATCH 20               // Records sent per BLE EVENTS request
+#define JOURNAL_LINE_LENGTH 112
+#define JOURNAL_RETRY_INTERVAL 60000        // Wait after a failed upload
+#define JOURNAL_SEVERITY_MAX 100            // Tenths; an SOS is always the maximum
+
+// Event types
+enum JournalEventType : uint8_t {
+  JOURNAL_SOS,
+  JOURNAL_FALL
+};
+
+// Delivery state of a record, as passed to query callbacks
+#define JOURNAL_DELIVERED_SERVER 0x01
+#define JOURNAL_DELIVERED_APP 0x02
+
+// Payload of one journal slot
+struct JournalRecord {
+  uint32_t wallTime;      // Unix time in seconds, 0 if the clock was not set
+  uint32_t uptime;        // millis() when the event happened
+  uint32_t seq;           // Upload sequence number (sequence.h)
+  uint16_t bootCount;
+  uint8_t type;           // JournalEventType
+  uint8_t severity;       // 0-JOURNAL_SEVERITY_MAX
+  float latitude;         // NAN without a GPS fix
+  float longitude;
+  char detail[JOURNAL_DETAIL_LENGTH];
+};
+
+// Called for each record a query finds; return false to stop the query
+typedef bool (*JournalCallback)(uint32_t id, const JournalRecord& record, uint8_t delivery, void* context);
+
+// Functions
+void journalInit();
+bool journalAppend(JournalEventType type, uint8_t severity, const char* detail);
+uint32_t journalQuery(uint32_t fromTime, uint32_t toTime, uint32_t startId, int limit,
+                      JournalCallback callback, void* context);
+uint32_t journalOldestId();
+uint32_t journalHeadId();
+void journalAcknowledgeApp(uint32_t id);
+uint32_t journalPendingCount();
+bool journalUpload();
+const char* journalTypeName(uint8_t type);
+
+#endif // JOURNAL_H
@@ -0,0 +1,146 @@
+#include "link_client.h"
+#include "utils.h"
+
+LinkClient::LinkClient(uint8_t gsmSocketId)
+    : gsmSocketId(gsmSocketId), activeLink(NO_CONNECTION), abortCheck(NULL) {
+}
+
+// Check that the connection still runs over the link that is up now
+bool LinkClient::onCurrentLink() const {
+  return activeLink != NO_CONNECTION && isNetworkConnected() && getCurrentConnectionMode() == activeLink;
+}
+
+int LinkClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip, port, LINK_CONNECT_TIMEOUT);
+}
+
+int LinkClient::connect(IPAddress ip, uint16_t port, int32_t timeoutMs) {
+  return connect(ip.toString().c_str(), port, timeoutMs);
+}
+
+int LinkClient::connect(const char* host, uint16_t port) {
+  return connect(host, port, LINK_CONNECT_TIMEOUT);
+}
+
+// Open a connection over the current link
+int LinkClient::connect(const char* host, uint16_t port, int32_t timeoutMs) {
+  stop();
+  if (!isNetworkConnected() || aborted()) {
+    return 0;
+  }
+
+  ConnectionMode link = getCurrentConnectionMode();
+  bool success = false;
+  if (link == WIFI_MODE) {
+    success = wifi.connect(host, port, timeoutMs);
+  } else if (link == GPRS_MODE) {
+    if (!modemLock(MODEM_LOCK_TIMEOUT)) {
+      logWarning("LINK", "Modem busy, cannot open GPRS socket");
+      return 0;
+    }
+    success = gsmConnect(gsmSocketId, host, port, timeoutMs);
+    modemUnlock();
+  }
+
+  if (!success) {
+    logError("LINK", "Connect to " + String(host) + ":" + String(port) + " over " +
+             String(link == GPRS_MODE ? "GPRS" : "WiFi") + " failed");
+    return 0;
+  }
+  activeLink = link;
+  return 1;
+}
+
+size_t LinkClient::write(uint8_t data) {
+  return write(&data, 1);
+}
+
+size_t LinkClient::write(const uint8_t* buffer, size_t size) {
+  if (activeLink == WIFI_MODE) {
+    return wifi.write(buffer, size);
+  }
+  if (activeLink != GPRS_MODE || !modemLock(MODEM_LOCK_TIMEOUT)) {
+    return 0;
+  }
+  size_t written = gsmSocket(gsmSocketId).write(buffer, size);
+  modemUnlock();
+  return written;
+}
+
+int LinkClient::available() {
+  if (activeLink == WIFI_MODE) {
+    return wifi.available();
+  }
+  if (activeLink != GPRS_MODE || !modemLock(MODEM_LOCK_TIMEOUT)) {
+    return 0;
+  }
+  int count = gsmSocket(gsmSocketId).available();
+  modemUnlock();
+  return count;
+}
+
+int LinkClient::read() {
+  uint8_t data;
+  return read(&data, 1) == 1 ? data : -1;
+}
+
+int LinkClient::read(uint8_t* buffer, size_t size) {
+  if (activeLink == WIFI_MODE) {
+    return wifi.read(buffer, size);
+  }
+  if (activeLink != GPRS_MODE || !modemLock(MODEM_LOCK_TIMEOUT)) {
+    return -1;
+  }
+  int count = gsmSocket(gsmSocketId).read(buffer, size);
+  modemUnlock();
+  return count;
+}
+
+int LinkClient::peek() {
+  if (activeLink == WIFI_MODE) {
+    return wifi.peek();
+  }
+  if (activeLink != GPRS_MODE || !modemLock(MODEM_LOCK_TIMEOUT)) {
+    return -1;
+  }
+  int data = gsmSocket(gsmSocketId).peek();
+  modemUnlock();
+  return data;
+}
+
+void LinkClient::flush() {
+  if (activeLink == WIFI_MODE) {
+    wifi.flush();
+  } else if (activeLink == GPRS_MODE && modemLock(MODEM_LOCK_TIMEOUT)) {
+    gsmSocket(gsmSocketId).flush();
+    modemUnlock();
+  }
+}
+
+// Close the connection; a GPRS socket left open here is closed by the next connect
+void LinkClient::stop() {
+  if (activeLink == WIFI_MODE) {
+    wifi.stop();
+  } else if (activeLink == GPRS_MODE && modemLock(MODEM_LOCK_TIMEOUT)) {
+    gsmSocket(gsmSocketId).stop();
+    modemUnlock();
+  }
+  activeLink = NO_CONNECTION;
+}
+
+// A connection on a link that has since gone down or been replaced counts as closed,
+// and so does one whose transfer was aborted
+uint8_t LinkClient::connected() {
+  if (!onCurrentLink() || aborted()) {
+    return 0;
+  }
+  if (activeLink == WIFI_MODE) {
+    return wifi.connected();
+  }
+  if (!modemLock(MODEM_LOCK_TIMEOUT)) {
+    return 0;
+  }
+  uint8_t open = gsmSocket(gsmSocketId).connected();
+  modemUnlock();
+  return open;
+}
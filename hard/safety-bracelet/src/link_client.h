@@ -0,0 +1,55 @@
+#ifndef LINK_CLIENT_H
+#define LINK_CLIENT_H
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include "wifi_manager.h"
+
+// Link client settings
+#define LINK_CONNECT_TIMEOUT 15000          // TCP connect over either link
+
+// TCP socket over whichever link is up: the WiFi stack, or a SIM800 socket over GPRS.
+// The link is picked on connect and the socket stays on it; once the connection mode
+// changes, connected() reports false so the caller reconnects over the new link.
+// GPRS operations hold the modem lock, so they never interleave with SMS or link checks.
+// Derives from WiFiClient so HTTPClient, TlsClient and the MQTT client can use it.
+// An abort check, when set, is polled on connect and whenever the caller asks connected();
+// once it fires the connection reads as closed, so a transfer in progress gives up.
+typedef bool (*LinkAbortCheck)();
+
+class LinkClient : public WiFiClient {
+ public:
+  explicit LinkClient(uint8_t gsmSocketId);
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port, int32_t timeoutMs) override;
+  int connect(const char* host, uint16_t port) override;
+  int connect(const char* host, uint16_t port, int32_t timeoutMs) override;
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t* buffer, size_t size) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+
+  // Link the current connection runs over (NO_CONNECTION when closed)
+  ConnectionMode link() const { return activeLink; }
+
+  // Abort check for the transfer in progress (NULL for none)
+  void setAbortCheck(LinkAbortCheck check) { abortCheck = check; }
+
+ private:
+  bool onCurrentLink() const;
+  bool aborted() const { return abortCheck != NULL && abortCheck(); }
+
+  WiFiClient wifi;
+  uint8_t gsmSocketId;
+  ConnectionMode activeLink;
+  LinkAbortCheck abortCheck;
+};
+
+#endif // LINK_CLIENT_H
@@ -0,0 +1,553 @@
+#include "logger.h"
+#include "clock_service.h"
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+
+// Ring slot; sequence tells producers and the consumer whose turn the slot is
+struct LogSlot {
+  uint32_t sequence;
+  LogRecord record;
+};
+
+// Per-tag level override
+struct TagLevel {
+  char tag[LOG_TAG_LENGTH];
+  LogLevel level;
+};
+
+// Lock-free ring: any task reserves a slot with a compare-and-swap, the drain task empties it
+static LogSlot ring[LOG_RING_SIZE];
+static uint32_t enqueuePos = 0;
+static uint32_t dequeuePos = 0;             // Drain side only, under drainMutex
+static SemaphoreHandle_t drainMutex = NULL;
+static bool loggerReady = false;
+
+// Runtime filtering
+static LogLevel minimumLevel = LOG_MIN_LEVEL;
+static TagLevel tagLevels[LOG_MAX_TAG_LEVELS];
+static int tagLevelCount = 0;
+
+// Records lost because the ring was full, per level
+static uint32_t droppedCounts[LOG_NONE] = { 0 };
+static uint32_t reportedDropped = 0;
+
+static LogRecordHook recordHook = NULL;
+
+static const char* const levelNames[LOG_NONE] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+// Check whether a level is enabled for a tag at runtime
+bool logEnabled(LogLevel level, const char* tag) {
+  LogLevel threshold = minimumLevel;
+  for (int i = 0; i < tagLevelCount; i++) {
+    if (strcmp(tagLevels[i].tag, tag) == 0) {
+      threshold = tagLevels[i].level;
+      break;
+    }
+  }
+  return level >= threshold;
+}
+
+// Set the runtime level for tags without an override
+void logSetLevel(LogLevel level) {
+  minimumLevel = level;
+}
+
+// Override the runtime level for one tag (call from main loop)
+// Levels below LOG_MIN_LEVEL stay compiled out
+bool logSetTagLevel(const char* tag, LogLevel level) {
+  for (int i = 0; i < tagLevelCount; i++) {
+    if (strcmp(tagLevels[i].tag, tag) == 0) {
+      tagLevels[i].level = level;
+      return true;
+    }
+  }
+  if (tagLevelCount >= LOG_MAX_TAG_LEVELS) {
+    return false;
+  }
+
+  // Fill the entry before publishing it to other tasks
+  TagLevel& entry = tagLevels[tagLevelCount];
+  strncpy(entry.tag, tag, LOG_TAG_LENGTH - 1);
+  entry.tag[LOG_TAG_LENGTH - 1] = '\0';
+  entry.level = level;
+  __atomic_store_n(&tagLevelCount, tagLevelCount + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Records dropped at a level since boot
+uint32_t logDroppedCount(LogLevel level) {
+  return level < LOG_NONE ? __atomic_load_n(&droppedCounts[level], __ATOMIC_RELAXED) : 0;
+}
+
+// Set the function that sees every record written (call from setup)
+void logSetRecordHook(LogRecordHook hook) {
+  recordHook = hook;
+}
+
+// Start a record
+void logBegin(LogRecord* record, LogLevel level, const char* tag, uint32_t token, const char* format) {
+  record->uptime = clockUptimeMs();
+  record->tag = tag;
+  record->format = format;
+  record->token = token;
+  record->kind = LOG_RECORD_FORMAT;
+  record->level = level;
+  record->argCount = 0;
+  record->textLength = 0;
+}
+
+// Append an argument slot, or NULL if the record is full
+static LogArgValue* addArg(LogRecord* record, LogArgType type) {
+  if (record->argCount >= LOG_MAX_ARGS) {
+    return NULL;
+  }
+  record->argTypes[record->argCount] = type;
+  return &record->args[record->argCount++];
+}
+
+// Copy text into the record, truncating when the text area runs out
+// Returns the offset of the copy
+static uint16_t copyText(LogRecord* record, const char* text) {
+  uint16_t offset = record->textLength;
+  size_t room = LOG_TEXT_LENGTH - offset;
+  if (room == 0) {
+    return LOG_TEXT_LENGTH - 1;
+  }
+  size_t length = strnlen(text != NULL ? text : "", room - 1);
+  memcpy(record->text + offset, text != NULL ? text : "", length);
+  record->text[offset + length] = '\0';
+  record->textLength = offset + length + 1;
+  return offset;
+}
+
+void logAddArg(LogRecord* record, int value) {
+  LogArgValue* arg = addArg(record, LOG_ARG_INT);
+  if (arg != NULL) arg->i = value;
+}
+
+void logAddArg(LogRecord* record, unsigned int value) {
+  LogArgValue* arg = addArg(record, LOG_ARG_UINT);
+  if (arg != NULL) arg->u = value;
+}
+
+void logAddArg(LogRecord* record, long value) {
+  logAddArg(record, (long long)value);
+}
+
+void logAddArg(LogRecord* record, unsigned long value) {
+  logAddArg(record, (unsigned long long)value);
+}
+
+void logAddArg(LogRecord* record, long long value) {
+  LogArgValue* arg = addArg(record, LOG_ARG_INT64);
+  if (arg != NULL) arg->i64 = value;
+}
+
+void logAddArg(LogRecord* record, unsigned long long value) {
+  LogArgValue* arg = addArg(record, LOG_ARG_UINT64);
+  if (arg != NULL) arg->u64 = value;
+}
+
+void logAddArg(LogRecord* record, double value) {
+  LogArgValue* arg = addArg(record, LOG_ARG_DOUBLE);
+  if (arg != NULL) arg->d = value;
+}
+
+void logAddArg(LogRecord* record, const char* value) {
+  LogArgValue* arg = addArg(record, LOG_ARG_TEXT);
+  if (arg != NULL) arg->text = copyText(record, value);
+}
+
+void logAddArg(LogRecord* record, const String& value) {
+  logAddArg(record, value.c_str());
+}
+
+void logAddArg(LogRecord* record, const void* value) {
+  LogArgValue* arg = addArg(record, LOG_ARG_POINTER);
+  if (arg != NULL) arg->p = value;
+}
+
+// Format one conversion; spec is the conversion without length modifiers, e.g. "%-8.2f"
+static int formatArg(char* out, size_t size, char* spec, size_t specLength, char conversion,
+                     const LogRecord& record, int index) {
+  if (index >= record.argCount) {
+    return snprintf(out, size, "?");
+  }
+
+  const LogArgValue& arg = record.args[index];
+  LogArgType type = (LogArgType)record.argTypes[index];
+  bool integer = strchr("dicuxXo", conversion) != NULL;
+  bool floating = strchr("fFeEgG", conversion) != NULL;
+
+  // Pick a conversion that fits what was captured
+  switch (type) {
+    case LOG_ARG_INT:
+    case LOG_ARG_UINT:
+      spec[specLength++] = integer ? conversion : (type == LOG_ARG_INT ? 'd' : 'u');
+      spec[specLength] = '\0';
+      return type == LOG_ARG_INT ? snprintf(out, size, spec, arg.i) : snprintf(out, size, spec, arg.u);
+    case LOG_ARG_INT64:
+    case LOG_ARG_UINT64:
+      spec[specLength++] = 'l';
+      spec[specLength++] = 'l';
+      spec[specLength++] = integer && conversion != 'c' ? conversion : (type == LOG_ARG_INT64 ? 'd' : 'u');
+      spec[specLength] = '\0';
+      return type == LOG_ARG_INT64 ? snprintf(out, size, spec, arg.i64) : snprintf(out, size, spec, arg.u64);
+    case LOG_ARG_DOUBLE:
+      spec[specLength++] = floating ? conversion : 'f';
+      spec[specLength] = '\0';
+      return snprintf(out, size, spec, arg.d);
+    case LOG_ARG_TEXT:
+      spec[specLength++] = 's';
+      spec[specLength] = '\0';
+      return snprintf(out, size, spec, record.text + arg.text);
+    case LOG_ARG_POINTER:
+      return snprintf(out, size, "%p", arg.p);
+  }
+  return 0;
+}
+
+// Expand a record's format with its captured arguments
+// Without the format (tokenized builds) the token and the arguments are written instead,
+// e.g. "#1a2b3c4d 42 ok"; tools/log_decode.py's token database finds the format
+size_t logFormatMessage(const LogRecord& record, char* out, size_t size) {
+  if (record.kind == LOG_RECORD_TEXT) {
+    return snprintf(out, size, "%s", record.text);
+  }
+  if (record.format == NULL) {
+    int written = snprintf(out, size, "#%08lx", (unsigned long)record.token);
+    size_t length = written > 0 ? min((size_t)written, size - 1) : 0;
+    for (int i = 0; i < record.argCount && length + 1 < size; i++) {
+      out[length++] = ' ';
+      char spec[16] = "%";
+      written = formatArg(out + length, size - length, spec, 1, 'v', record, i);
+      if (written > 0) {
+        length += min((size_t)written, size - length - 1);
+      }
+    }
+    out[length] = '\0';
+    return length;
+  }
+
+  size_t length = 0;
+  int argIndex = 0;
+  const char* p = record.format;
+  while (*p != '\0' && length + 1 < size) {
+    if (*p != '%') {
+      out[length++] = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      out[length++] = '%';
+      p += 2;
+      continue;
+    }
+
+    // Flags, width and precision are kept; length modifiers are replaced by the captured type
+    char spec[16];
+    size_t specLength = 0;
+    spec[specLength++] = *p++;
+    while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && specLength < sizeof(spec) - 4) {
+      spec[specLength++] = *p++;
+    }
+    while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    char conversion = *p++;
+
+    int written = formatArg(out + length, size - length, spec, specLength, conversion, record, argIndex++);
+    if (written > 0) {
+      length += min((size_t)written, size - length - 1);
+    }
+  }
+  out[length] = '\0';
+  return length;
+}
+
+#if !LOG_TOKENIZED
+// Write one record as a line: [time] [LEVEL] [TAG] message
+static void writeRecord(const LogRecord& record) {
+  char line[LOG_LINE_LENGTH];
+  char timestamp[CLOCK_TIMESTAMP_LENGTH];
+  clockFormatLog(record.uptime, timestamp, sizeof(timestamp));
+
+  int length = snprintf(line, sizeof(line), "[%s] [%s] [%s] ", timestamp, levelNames[record.level], record.tag);
+  if (length < 0 || length >= (int)sizeof(line)) {
+    length = sizeof(line) - 1;
+  }
+  logFormatMessage(record, line + length, sizeof(line) - length);
+  Serial.println(line);
+}
+#else
+// Frame payload kinds, in the top two bits of the first payload byte
+#define LOG_FRAME_FORMAT 0
+#define LOG_FRAME_TEXT 1
+#define LOG_FRAME_CLOCK 2
+
+// Argument type nibbles are LogArgType, except doubles: they go out whole as this type.
+// LOG_ARG_DOUBLE on the wire is a 32-bit float, as sent by older firmware.
+#define LOG_WIRE_DOUBLE 7
+
+// Frame being built; only the drain side (or a single early caller) writes frames
+static uint8_t frame[LOG_FRAME_MAX_PAYLOAD + 3];
+static size_t frameLength = 0;
+static int64_t sentClockOffset = 0;
+static bool clockOffsetSent = false;
+
+static bool framePut(uint8_t value) {
+  if (frameLength >= LOG_FRAME_MAX_PAYLOAD + 2) {
+    return false;
+  }
+  frame[frameLength++] = value;
+  return true;
+}
+
+static bool framePutVarint(uint64_t value) {
+  while (value >= 0x80) {
+    if (!framePut((uint8_t)(value | 0x80))) {
+      return false;
+    }
+    value >>= 7;
+  }
+  return framePut((uint8_t)value);
+}
+
+// Signed values are zigzag coded so small negatives stay short
+static bool framePutSigned(int64_t value) {
+  return framePutVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static bool framePutWord(uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    if (!framePut((uint8_t)(value >> (8 * i)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Type nibble sent for a captured argument type
+static uint8_t wireType(uint8_t type) {
+  return type == LOG_ARG_DOUBLE ? LOG_WIRE_DOUBLE : type;
+}
+
+// Start a frame: sync byte, length placeholder, then the header byte
+static void frameBegin(uint8_t kind, uint8_t level, uint8_t count) {
+  frameLength = 0;
+  frame[frameLength++] = LOG_FRAME_SYNC;
+  frame[frameLength++] = 0;
+  frame[frameLength++] = (kind << 6) | ((level & 0x03) << 4) | (count & 0x0F);
+}
+
+// Fill in the length, append the checksum and write the frame
+static void frameSend() {
+  size_t payloadLength = frameLength - 2;
+  uint8_t checksum = 0;
+  for (size_t i = 2; i < frameLength; i++) {
+    checksum += frame[i];
+  }
+  frame[1] = (uint8_t)payloadLength;
+  frame[frameLength++] = checksum;
+  Serial.write(frame, frameLength);
+}
+
+// Tell the decoder how to turn uptime into wall time whenever the offset moves
+static void sendClockOffset() {
+  if (!clockIsSet()) {
+    return;
+  }
+  int64_t offset = (int64_t)(clockUnixTimeMs() - clockUptimeMs());
+  int64_t drift = offset - sentClockOffset;
+  if (clockOffsetSent && drift < LOG_CLOCK_RESEND_DRIFT && drift > -LOG_CLOCK_RESEND_DRIFT) {
+    return;
+  }
+  frameBegin(LOG_FRAME_CLOCK, 0, 0);
+  framePutSigned(offset);
+  frameSend();
+  sentClockOffset = offset;
+  clockOffsetSent = true;
+}
+
+// Write one record as a frame:
+//   header (kind, level, argument count), token, uptime,
+//   FORMAT: argument type nibbles, then each argument in its compact form
+//   TEXT:   the message bytes to the end of the payload
+static void writeRecord(const LogRecord& record) {
+  sendClockOffset();
+
+  if (record.kind == LOG_RECORD_TEXT) {
+    frameBegin(LOG_FRAME_TEXT, record.level, 0);
+    framePutWord(record.token);
+    framePutVarint(record.uptime);
+    for (const char* p = record.text; *p != '\0' && framePut((uint8_t)*p); p++) {
+    }
+    frameSend();
+    return;
+  }
+
+  frameBegin(LOG_FRAME_FORMAT, record.level, record.argCount);
+  framePutWord(record.token);
+  framePutVarint(record.uptime);
+  for (int i = 0; i < record.argCount; i += 2) {
+    uint8_t types = wireType(record.argTypes[i]);
+    if (i + 1 < record.argCount) {
+      types |= wireType(record.argTypes[i + 1]) << 4;
+    }
+    framePut(types);
+  }
+
+  bool fits = true;
+  for (int i = 0; i < record.argCount && fits; i++) {
+    const LogArgValue& arg = record.args[i];
+    switch ((LogArgType)record.argTypes[i]) {
+      case LOG_ARG_INT:
+        fits = framePutSigned(arg.i);
+        break;
+      case LOG_ARG_UINT:
+        fits = framePutVarint(arg.u);
+        break;
+      case LOG_ARG_INT64:
+        fits = framePutSigned(arg.i64);
+        break;
+      case LOG_ARG_UINT64:
+        fits = framePutVarint(arg.u64);
+        break;
+      case LOG_ARG_DOUBLE: {
+        // Full precision: a float would cut %.6f coordinates to about a metre
+        uint64_t bits;
+        memcpy(&bits, &arg.d, sizeof(bits));
+        fits = framePutWord((uint32_t)bits) && framePutWord((uint32_t)(bits >> 32));
+        break;
+      }
+      case LOG_ARG_TEXT: {
+        const char* text = record.text + arg.text;
+        size_t length = strlen(text);
+        fits = framePutVarint(length);
+        for (size_t j = 0; j < length && fits; j++) {
+          fits = framePut((uint8_t)text[j]);
+        }
+        break;
+      }
+      case LOG_ARG_POINTER:
+        fits = framePutWord((uint32_t)(uintptr_t)arg.p);
+        break;
+    }
+  }
+  // Arguments cut off by the frame size decode as "?"; the decoder stops at the payload end
+  frameSend();
+}
+#endif
+
+// Queue a finished record; drops it when the ring is full
+// The hook sees the record first, on the caller's task, so it has it even if the device
+// resets before the drain task gets to it
+void logCommit(LogRecord* record) {
+  if (recordHook != NULL) {
+    recordHook(*record);
+  }
+  if (!loggerReady) {
+    writeRecord(*record);
+    return;
+  }
+
+  uint32_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+  LogSlot* slot;
+  for (;;) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    int32_t lag = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+    if (lag == 0) {
+      if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (lag < 0) {
+      __atomic_fetch_add(&droppedCounts[record->level], 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Only the text actually used is copied
+  memcpy(&slot->record, record, offsetof(LogRecord, text) + record->textLength);
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Log a finished message
+void logText(LogLevel level, const char* tag, uint32_t tagToken, const char* message) {
+  LogRecord record;
+  logBegin(&record, level, tag, tagToken, NULL);
+  record.kind = LOG_RECORD_TEXT;
+  copyText(&record, message);
+  logCommit(&record);
+}
+
+void logText(LogLevel level, const char* tag, uint32_t tagToken, const String& message) {
+  logText(level, tag, tagToken, message.c_str());
+}
+
+// Take the oldest record off the ring (caller holds drainMutex)
+static bool takeRecord(LogRecord* record) {
+  LogSlot* slot = &ring[dequeuePos & (LOG_RING_SIZE - 1)];
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != dequeuePos + 1) {
+    return false;
+  }
+  memcpy(record, &slot->record, sizeof(LogRecord));
+  __atomic_store_n(&slot->sequence, dequeuePos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+  dequeuePos++;
+  return true;
+}
+
+// Format and write everything queued, then report new drops
+static void drainRing() {
+  static LogRecord record;
+  xSemaphoreTake(drainMutex, portMAX_DELAY);
+  while (takeRecord(&record)) {
+    writeRecord(record);
+  }
+
+  uint32_t dropped = 0;
+  for (int level = 0; level < LOG_NONE; level++) {
+    dropped += logDroppedCount((LogLevel)level);
+  }
+  if (dropped != reportedDropped) {
+    logBegin(&record, LOG_WARNING, "LOG", LOG_TOKEN("LOG", "%u messages dropped, ring full (%u since boot)"),
+             LOG_FORMAT_TEXT("%u messages dropped, ring full (%u since boot)"));
+    logAddArg(&record, (unsigned int)(dropped - reportedDropped));
+    logAddArg(&record, (unsigned int)dropped);
+    writeRecord(record);
+    reportedDropped = dropped;
+  }
+  xSemaphoreGive(drainMutex);
+}
+
+// Drain task: formatting and the slow UART writes happen here, off the callers' paths
+static void logTask(void* parameter) {
+  for (;;) {
+    drainRing();
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL));
+  }
+}
+
+// Set up the ring and start the drain task (call right after Serial.begin)
+// Until then records are written straight away
+void logInit() {
+  for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+    ring[i].sequence = i;
+  }
+  drainMutex = xSemaphoreCreateMutex();
+  loggerReady = true;
+
+  xTaskCreatePinnedToCore(logTask, "log", LOG_TASK_STACK_SIZE, NULL, LOG_TASK_PRIORITY, NULL, 1);
+}
+
+// Write out everything queued now, e.g. before a restart or light sleep
+void logFlush() {
+  if (!loggerReady) {
+    return;
+  }
+  drainRing();
+  Serial.flush();
+}
@@ -0,0 +1,169 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <Arduino.h>
+
+// Log levels
+enum LogLevel {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARNING,
+  LOG_ERROR,
+  LOG_NONE
+};
+
+// Logger settings
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO            // Calls below this level compile to nothing
+#endif
+#define LOG_RING_SIZE 64                  // Records; a power of two
+#define LOG_MAX_ARGS 6                    // Arguments kept per formatted record
+#define LOG_TEXT_LENGTH 96                // Copied text: a whole message, or the %s arguments
+#define LOG_TAG_LENGTH 12
+#define LOG_MAX_TAG_LEVELS 8
+#define LOG_LINE_LENGTH 192
+#define LOG_DRAIN_INTERVAL 20             // ms between drain passes when the ring is empty
+#define LOG_TASK_STACK_SIZE 4096
+#define LOG_TASK_PRIORITY 1               // Same as the Arduino loop, below the network task
+
+// Tokenized output: instead of text lines the serial port carries binary frames with a
+// 32-bit token per format string and the raw arguments; tools/log_decode.py turns them
+// back into lines using the token database built from the sources. The format strings
+// themselves are then left out of the firmware.
+#ifndef LOG_TOKENIZED
+#define LOG_TOKENIZED 0
+#endif
+#define LOG_FRAME_SYNC 0xA5
+#define LOG_FRAME_MAX_PAYLOAD 255
+#define LOG_TOKEN_FNV_OFFSET 2166136261UL
+#define LOG_TOKEN_FNV_PRIME 16777619UL
+#define LOG_CLOCK_RESEND_DRIFT 1000         // Send the clock offset again when it moves this far (ms)
+
+// Record kinds
+enum LogRecordKind : uint8_t {
+  LOG_RECORD_FORMAT,    // token (and format unless tokenized) plus captured arguments
+  LOG_RECORD_TEXT       // finished message in text; token is the tag's token
+};
+
+// Argument kinds captured for deferred formatting
+enum LogArgType : uint8_t {
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_INT64,
+  LOG_ARG_UINT64,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_TEXT,       // Copied into the record's text; value is the offset
+  LOG_ARG_POINTER
+};
+
+union LogArgValue {
+  int32_t i;
+  uint32_t u;
+  int64_t i64;
+  uint64_t u64;
+  double d;
+  uint16_t text;
+  const void* p;
+};
+
+// One captured log call; formatting happens later on the drain task.
+// tag and format must be string literals, everything else is copied.
+struct LogRecord {
+  uint64_t uptime;            // clockUptimeMs() at the call
+  const char* tag;
+  const char* format;         // NULL for text records and in tokenized builds
+  uint32_t token;
+  uint8_t kind;
+  uint8_t level;
+  uint8_t argCount;
+  uint8_t textLength;
+  uint8_t argTypes[LOG_MAX_ARGS];
+  LogArgValue args[LOG_MAX_ARGS];
+  char text[LOG_TEXT_LENGTH];
+};
+
+// Called with every record as it is committed, on the caller's task and before the record
+// is queued; keep it short and lock-free. The record is not formatted yet; the hook keeps
+// what it needs and formats later with logFormatMessage().
+typedef void (*LogRecordHook)(const LogRecord& record);
+
+// Functions
+void logInit();
+void logFlush();
+void logSetLevel(LogLevel level);
+bool logSetTagLevel(const char* tag, LogLevel level);
+bool logEnabled(LogLevel level, const char* tag);
+uint32_t logDroppedCount(LogLevel level);
+void logSetRecordHook(LogRecordHook hook);
+size_t logFormatMessage(const LogRecord& record, char* out, size_t size);
+void logText(LogLevel level, const char* tag, uint32_t tagToken, const char* message);
+void logText(LogLevel level, const char* tag, uint32_t tagToken, const String& message);
+
+// FNV-1a, evaluated by the compiler for literals; tools/log_tokens.py computes the same hash
+constexpr uint32_t logTokenHash(const char* text, uint32_t hash = LOG_TOKEN_FNV_OFFSET) {
+  return *text == '\0' ? hash : logTokenHash(text + 1, (hash ^ (uint8_t)*text) * LOG_TOKEN_FNV_PRIME);
+}
+
+// Forces the hash to be a compile-time constant, so the literal is not kept in flash
+template <uint32_t Token>
+struct LogToken {
+  static constexpr uint32_t value = Token;
+};
+#define LOG_TOKEN(tag, format) (LogToken<logTokenHash(tag "\x1f" format)>::value)
+#define LOG_TAG_TOKEN(tag) (LogToken<logTokenHash(tag)>::value)
+#if LOG_TOKENIZED
+#define LOG_FORMAT_TEXT(format) NULL
+#else
+#define LOG_FORMAT_TEXT(format) format
+#endif
+
+// Record building, used by the macros below
+void logBegin(LogRecord* record, LogLevel level, const char* tag, uint32_t token, const char* format);
+void logAddArg(LogRecord* record, int value);
+void logAddArg(LogRecord* record, unsigned int value);
+void logAddArg(LogRecord* record, long value);
+void logAddArg(LogRecord* record, unsigned long value);
+void logAddArg(LogRecord* record, long long value);
+void logAddArg(LogRecord* record, unsigned long long value);
+void logAddArg(LogRecord* record, double value);
+void logAddArg(LogRecord* record, const char* value);
+void logAddArg(LogRecord* record, const String& value);
+void logAddArg(LogRecord* record, const void* value);
+void logCommit(LogRecord* record);
+
+// Capture a printf-style call without formatting it
+template <typename... Args>
+void logFormat(LogLevel level, const char* tag, uint32_t token, const char* format, Args... args) {
+  LogRecord record;
+  logBegin(&record, level, tag, token, format);
+  int expand[] = { 0, (logAddArg(&record, args), 0)... };
+  (void)expand;
+  logCommit(&record);
+}
+
+// printf-style logging: LOGI("API", "Sent %u bytes to %s", length, url)
+// Tag and format must be literals. Arguments are only evaluated when the level is
+// compiled in and enabled for the tag.
+#define LOG_AT(level, tag, format, ...)                                                     \
+  do {                                                                                      \
+    if (LOG_MIN_LEVEL <= (level) && logEnabled((level), (tag)))                             \
+      logFormat((level), (tag), LOG_TOKEN(tag, format), LOG_FORMAT_TEXT(format), ##__VA_ARGS__); \
+  } while (0)
+#define LOGD(tag, format, ...) LOG_AT(LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define LOGI(tag, format, ...) LOG_AT(LOG_INFO, tag, format, ##__VA_ARGS__)
+#define LOGW(tag, format, ...) LOG_AT(LOG_WARNING, tag, format, ##__VA_ARGS__)
+#define LOGE(tag, format, ...) LOG_AT(LOG_ERROR, tag, format, ##__VA_ARGS__)
+
+// Message logging: the caller builds the text, which is copied into the ring
+// (and sent as text in tokenized builds too)
+#define LOG_TEXT_AT(level, tag, message)                                                    \
+  do {                                                                                      \
+    if (LOG_MIN_LEVEL <= (level) && logEnabled((level), (tag)))                             \
+      logText((level), (tag), LOG_TAG_TOKEN(tag), (message));                               \
+  } while (0)
+#define logDebug(tag, message) LOG_TEXT_AT(LOG_DEBUG, tag, message)
+#define logInfo(tag, message) LOG_TEXT_AT(LOG_INFO, tag, message)
+#define logWarning(tag, message) LOG_TEXT_AT(LOG_WARNING, tag, message)
+#define logError(tag, message) LOG_TEXT_AT(LOG_ERROR, tag, message)
+
+#endif // LOGGER_H
@@ -7,19 +7,58 @@
 #include "power.h"
 #include "storage.h"
 #include "api.h"
+#include "telemetry.h"
+#include "network_task.h"
+#include "outbox.h"
+#include "journal.h"
+#include "assets.h"
+#include "downlink.h"
+#include "tls_client.h"
+#include "sequence.h"
+#include "report_policy.h"
+#include "clock_service.h"
+#include "flight_recorder.h"
+#include "config.h"
 #include "utils.h"
 
+// Retry a failed child data check after this long
+#define CHILD_DATA_RETRY_INTERVAL 300000
+
 // Global state variables
 bool apiInitialized = false;
 
+// Child data for the QR page, shown from flash at boot and revalidated once online
+static char childData[API_CHILD_DATA_MAX_SIZE];
+static bool childDataChecked = false;
+static bool childDataPending = false;
+static unsigned long lastChildDataAttempt = 0;
+
+// Show fresh child data once the network task has fetched or revalidated it
+static void childDataFetched(NetworkRequestType type, bool success, void* context) {
+  childDataPending = false;
+  if (success) {
+    setChildData(childData);
+    childDataChecked = true;
+  }
+}
+
 // Main setup function
 void mainSetup() {
   // Initialize serial communication
   Serial.begin(115200);
+  flightRecorderInit();
+  logInit();
   logInfo("MAIN", "Safety bracelet initializing...");
   
   // Initialize modules in sequence
+  clockInit();
   storageInit();
+  configInit();
+  sequenceInit();
+  outboxInit();
+  journalInit();
+  downlinkInit();
+  assetsInit();
   displayInit();
   displayLogo();
   
@@ -34,6 +73,11 @@ void mainSetup() {
     bleInit();
   }
   
+  // Initialize telemetry batching
+  telemetryInit();
+  reportPolicyInit();
+  flightRecorderQueueReport();
+  
   // Initialize sensors
   sensorsInit();
   
@@ -49,20 +93,17 @@ void mainSetup() {
   // Initialize remaining modules
   emergencyInit();
   powerInit();
+  // WiFi and GPRS come up in the background, advanced by checkConnection()
   wifiInit();
   
-  // If WiFi fails, try GPRS
-  if (getCurrentConnectionMode() == NO_CONNECTION && isSimModuleReady()) {
-    logInfo("MAIN", "WiFi connection failed, trying GPRS");
-    connectToGPRS();
+  // Show the stored child data right away; it is revalidated from the main loop once online
+  if (loadCachedChildData(childData, sizeof(childData))) {
+    logInfo("MAIN", "Using stored child data for QR code");
+    setChildData(childData);
   }
   
-  // Fetch child data for QR code if network is connected
-  if (isNetworkConnected() && apiInitialized) {
-    logInfo("MAIN", "Fetching child data for QR code");
-    String childData;
-    fetchChildData(&childData);
-  }
+  // From here on all API traffic goes through the network task
+  networkTaskInit();
   
   // Setup OTA updates
   setupOTA();
@@ -76,12 +117,30 @@ void mainSetup() {
 // Main loop function
 void mainLoop() {
   // Feed watchdog
+  flightStage(FLIGHT_STAGE_LOOP);
   feedWatchdog();
   
   // Update non-blocking components
   updateBuzzer();
   
+  // Run callbacks for finished network requests
+  flightStage(FLIGHT_STAGE_COMPLETIONS);
+  networkProcessCompletions();
+  
+  // Apply config pushed by the server
+  flightStage(FLIGHT_STAGE_DOWNLINK);
+  downlinkProcess();
+  if (downlinkTakeChildDataRefresh()) {
+    childDataChecked = false;
+    lastChildDataAttempt = 0;
+  }
+  
+  // Write back settings changed since the last pass
+  flightStage(FLIGHT_STAGE_CONFIG);
+  configProcess();
+  
   // Process BLE if active
+  flightStage(FLIGHT_STAGE_BLE);
   if (isBLEEnabled()) {
     bleHandleEvents();
     
@@ -95,50 +154,86 @@ void mainLoop() {
   }
   
   // Check sensors
+  flightStage(FLIGHT_STAGE_GPS);
   checkGps();
+  flightStage(FLIGHT_STAGE_MPU);
   checkMPU();
+  flightStage(FLIGHT_STAGE_BATTERY);
   updateBatteryLevel();
   
   // Handle touch input for SOS and BLE toggle
+  flightStage(FLIGHT_STAGE_TOUCH);
   handleSOSTouch();
   handleBLETouch();
   
   // Check and maintain network connection
+  flightStage(FLIGHT_STAGE_CONNECTION);
   checkConnection();
+  flightStage(FLIGHT_STAGE_CLOCK);
+  clockProcess();
   
   // Update display
+  flightStage(FLIGHT_STAGE_DISPLAY);
   updateDisplay();
   
   // Periodic tasks using non-blocking timing
   unsigned long currentTime = millis();
   
-  // Send GPS data every 15 minutes
-  static unsigned long lastGpsSendTime = 0;
-  if (currentTime - lastGpsSendTime > GPS_SEND_INTERVAL && isGpsValid()) {
-    if (sendGpsData(getLatitude(), getLongitude())) {
-      lastGpsSendTime = currentTime;
+  // Queue readings the report policy lets through: changed enough, or due as a heartbeat
+  // A location sample flushes the batch; battery and signal ride along with the next one
+  flightStage(FLIGHT_STAGE_TELEMETRY);
+  if (isGpsValid() && reportLocationDue(getLatitude(), getLongitude())) {
+    telemetryAddLocation(getLatitude(), getLongitude());
+  }
+  int batteryLevel = getBatteryPercentage();
+  if (reportBatteryDue(batteryLevel)) {
+    telemetryAddBattery(batteryLevel);
+  }
+  if (isNetworkConnected()) {
+    uint8_t mode = getCurrentConnectionMode();
+    int strength = getSignalStrength();
+    if (reportSignalDue(mode, strength)) {
+      telemetryAddSignal(mode, strength);
     }
   }
   
-  // Send battery status
-  static unsigned long lastBatterySendTime = 0;
-  if (currentTime - lastBatterySendTime > BATTERY_SEND_INTERVAL) {
-    if (sendBatteryStatus(getBatteryPercentage())) {
-      lastBatterySendTime = currentTime;
-    }
+  // Upload queued telemetry when the flush policy says so
+  telemetryProcess();
+  
+  // Check the child data for changes once per boot; a 304 costs no download
+  flightStage(FLIGHT_STAGE_CHILD_DATA);
+  if (!childDataChecked && !childDataPending && apiInitialized && isNetworkConnected() &&
+      (lastChildDataAttempt == 0 || currentTime - lastChildDataAttempt > CHILD_DATA_RETRY_INTERVAL)) {
+    lastChildDataAttempt = currentTime;
+    childDataPending = networkFetchChildData(childData, sizeof(childData), childDataFetched);
+  }
+  
+  // Report transmit latency per priority class
+  flightStage(FLIGHT_STAGE_STATS);
+  static unsigned long lastNetworkStatsTime = 0;
+  if (currentTime - lastNetworkStatsTime > NETWORK_STATS_LOG_INTERVAL) {
+    networkLogStats();
+    connectivityLogStats();
+    tlsLogStats();
+    reportPolicyLogStats();
+    lastNetworkStatsTime = currentTime;
   }
   
   // Update activity status
+  flightStage(FLIGHT_STAGE_ACTIVITY);
   updateActivity();
   
   // Handle OTA updates
+  flightStage(FLIGHT_STAGE_OTA);
   handleOTA();
   
   // Enter light sleep if conditions are met
   if (shouldEnterSleep()) {
+    flightStage(FLIGHT_STAGE_SLEEP);
     enterLightSleep();
   }
   
   // Allow background tasks to run
+  flightStage(FLIGHT_STAGE_YIELD);
   yield();
 }
@@ -0,0 +1,132 @@
+#include "mqtt_transport.h"
+#include "utils.h"
+#include "api.h"
+#include "downlink.h"
+#include "wifi_manager.h"
+
+#if MQTT_ENABLED
+
+#include <MQTT.h>
+#include "link_client.h"
+#include <ArduinoJson.h>
+
+// Broker session, used only from the network task
+static LinkClient mqttNet(GSM_SOCKET_MQTT);
+static MQTTClient mqttClient(MQTT_BUFFER_SIZE);
+static String clientId;
+static String username;
+static char topicPrefix[MQTT_TOPIC_LENGTH];
+static char commandTopic[MQTT_TOPIC_LENGTH];
+static bool mqttInitialized = false;
+static unsigned long lastConnectAttempt = 0;
+
+// Commands arrive as a downlink config block, JSON or MessagePack
+static void commandReceived(MQTTClient* client, char topic[], char bytes[], int length) {
+  logInfo("MQTT", "Command received on " + String(topic) + " (" + String(length) + " bytes)");
+
+  StaticJsonDocument<API_ACK_DOCUMENT_SIZE> doc;
+  bool msgpack = length > 0 && (((uint8_t)bytes[0] & 0xf0) == 0x80 || (uint8_t)bytes[0] == 0xde);
+  DeserializationError error = msgpack ? deserializeMsgPack(doc, bytes, length)
+                                       : deserializeJson(doc, bytes, length);
+  if (error) {
+    logWarning("MQTT", "Ignoring unreadable command: " + String(error.c_str()));
+    return;
+  }
+
+  downlinkReceive(doc.as<JsonObjectConst>());
+}
+
+// Set up the session for userId; connecting happens in mqttMaintain()
+void mqttInit(const String& userId) {
+  clientId = "bracelet-" + userId;
+  username = userId;
+  snprintf(topicPrefix, sizeof(topicPrefix), "bracelet/%s/", userId.c_str());
+  snprintf(commandTopic, sizeof(commandTopic), "bracelet/%s/cmd", userId.c_str());
+
+  mqttClient.begin(MQTT_BROKER_HOST, MQTT_BROKER_PORT, mqttNet);
+  mqttClient.onMessageAdvanced(commandReceived);
+  mqttClient.setOptions(MQTT_DEFAULT_KEEPALIVE, MQTT_CLEAN_SESSION, MQTT_ACK_TIMEOUT);
+  mqttInitialized = true;
+
+  logInfo("MQTT", "MQTT transport configured for " + String(MQTT_BROKER_HOST) + ":" + String(MQTT_BROKER_PORT));
+}
+
+// Open the session if needed and service it (call often from the network task)
+// Returns true while the session is up
+bool mqttMaintain() {
+  if (!mqttInitialized || !isNetworkConnected()) {
+    return false;
+  }
+
+  if (mqttClient.connected()) {
+    mqttClient.loop();
+    return mqttClient.connected();
+  }
+
+  if (lastConnectAttempt != 0 && millis() - lastConnectAttempt < MQTT_RECONNECT_INTERVAL) {
+    return false;
+  }
+  lastConnectAttempt = millis();
+
+  logInfo("MQTT", "Connecting to broker as " + clientId);
+  if (!mqttClient.connect(clientId.c_str(), username.c_str(), API_KEY)) {
+    logError("MQTT", "Broker connect failed, error " + String(mqttClient.lastError()) +
+             ", return code " + String(mqttClient.returnCode()));
+    return false;
+  }
+
+  // With a persistent session the broker still has our subscription and queued commands
+  if (mqttClient.sessionPresent()) {
+    logInfo("MQTT", "Resumed persistent session");
+  } else if (!mqttClient.subscribe(commandTopic, MQTT_QOS_RELIABLE)) {
+    logError("MQTT", "Failed to subscribe to " + String(commandTopic));
+    mqttClient.disconnect();
+    return false;
+  }
+
+  logInfo("MQTT", "Connected to broker");
+  return true;
+}
+
+// Check if the broker session is up
+bool mqttIsConnected() {
+  return mqttInitialized && mqttClient.connected();
+}
+
+// Publish to bracelet/<userId>/<subtopic>; with QoS 1 this waits for the broker's PUBACK
+bool mqttPublish(const char* subtopic, const uint8_t* payload, size_t length, int qos) {
+  if (!mqttIsConnected()) {
+    return false;
+  }
+
+  char topic[MQTT_TOPIC_LENGTH];
+  snprintf(topic, sizeof(topic), "%s%s", topicPrefix, subtopic);
+
+  bool success = mqttClient.publish(topic, (const char*)payload, length, false, qos);
+  if (success) {
+    logInfo("MQTT", "Published " + String(length) + " bytes to " + String(topic) + " (QoS " + String(qos) + ")");
+  } else {
+    logError("MQTT", "Publish to " + String(topic) + " failed, error " + String(mqttClient.lastError()));
+  }
+  return success;
+}
+
+#else
+
+// MQTT disabled at build time: the API always uses HTTP
+void mqttInit(const String& userId) {
+}
+
+bool mqttMaintain() {
+  return false;
+}
+
+bool mqttIsConnected() {
+  return false;
+}
+
+bool mqttPublish(const char* subtopic, const uint8_t* payload, size_t length, int qos) {
+  return false;
+}
+
+#endif // MQTT_ENABLED
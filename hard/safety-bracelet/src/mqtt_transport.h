@@ -0,0 +1,40 @@
+#ifndef MQTT_TRANSPORT_H
+#define MQTT_TRANSPORT_H
+
+#include <Arduino.h>
+
+// MQTT transport for the API: one long-lived broker session instead of a
+// connect/POST cycle per request. Topics are bracelet/<userId>/<subtopic>;
+// the device publishes gps, battery, notification and telemetry, and
+// receives config commands on bracelet/<userId>/cmd.
+// Build with -DMQTT_ENABLED=1 (and install 256dpi/MQTT) to use it; while the
+// session is down the API falls back to HTTP.
+
+// MQTT settings
+#ifndef MQTT_ENABLED
+#define MQTT_ENABLED 0
+#endif
+#ifndef MQTT_BROKER_HOST
+#define MQTT_BROKER_HOST "16.170.159.206"
+#endif
+#ifndef MQTT_BROKER_PORT
+#define MQTT_BROKER_PORT 1883
+#endif
+#ifndef MQTT_DEFAULT_KEEPALIVE
+#define MQTT_DEFAULT_KEEPALIVE 60         // Seconds; the broker drops the session after 1.5x this
+#endif
+#define MQTT_CLEAN_SESSION false          // Keep subscriptions and queued QoS 1 commands across reconnects
+#define MQTT_ACK_TIMEOUT 5000             // Wait for PUBACK/CONNACK/SUBACK
+#define MQTT_RECONNECT_INTERVAL 30000
+#define MQTT_BUFFER_SIZE 3200             // Largest packet, room for a full telemetry batch
+#define MQTT_TOPIC_LENGTH 64
+#define MQTT_QOS_ROUTINE 0                // Fire and forget
+#define MQTT_QOS_RELIABLE 1               // Broker acknowledges, resent until it does
+
+// Functions
+void mqttInit(const String& userId);
+bool mqttMaintain();
+bool mqttIsConnected();
+bool mqttPublish(const char* subtopic, const uint8_t* payload, size_t length, int qos);
+
+#endif // MQTT_TRANSPORT_H
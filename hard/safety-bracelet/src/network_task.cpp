@@ -0,0 +1,327 @@
+#include "network_task.h"
+#include "utils.h"
+#include "api.h"
+#include "outbox.h"
+#include "journal.h"
+#include "flight_recorder.h"
+
+static_assert(FLIGHT_STAGE_NET_CHILD_DATA - FLIGHT_STAGE_NET_GPS == NET_REQUEST_CHILD_DATA - NET_REQUEST_GPS,
+              "Flight recorder network stages must follow NetworkRequestType");
+
+// Result handed back from the network task to the main loop
+struct NetworkCompletion {
+  NetworkRequestType type;
+  bool success;
+  NetworkCompletionCallback callback;
+  void* context;
+};
+
+// Class names for logging
+static const char* const classNames[NET_CLASS_COUNT] = { "emergency", "alert", "location", "housekeeping" };
+
+// Request timeout for each class
+static const uint16_t classTimeouts[NET_CLASS_COUNT] = {
+  NETWORK_EMERGENCY_TIMEOUT, NETWORK_ALERT_TIMEOUT, NETWORK_LOCATION_TIMEOUT, NETWORK_HOUSEKEEPING_TIMEOUT
+};
+
+// Task and queues, one request queue per class
+static TaskHandle_t networkTaskHandle = NULL;
+static QueueHandle_t classQueues[NET_CLASS_COUNT] = { NULL };
+static QueueHandle_t completionQueue = NULL;
+
+// Class of the request the network task is running, and whether it was told to give up
+static volatile int activeClass = NET_CLASS_COUNT;
+static volatile bool activeAborted = false;
+
+// Per-class statistics, written by the network task and read from the main loop
+static NetworkClassStats classStats[NET_CLASS_COUNT];
+static portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Abort check handed to the API: give up when a higher class has work waiting
+static bool higherClassWaiting() {
+  for (int c = 0; c < activeClass; c++) {
+    if (uxQueueMessagesWaiting(classQueues[c]) > 0) {
+      activeAborted = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Take the next request, highest class first
+static bool takeNextRequest(NetworkRequest* request) {
+  for (int c = 0; c < NET_CLASS_COUNT; c++) {
+    if (xQueueReceive(classQueues[c], request, 0) == pdTRUE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Mark the start of work for a class and apply its timeout
+static void beginClass(NetworkClass requestClass) {
+  activeClass = requestClass;
+  activeAborted = false;
+  apiSetRequestTimeout(classTimeouts[requestClass]);
+  apiSetIgnoreBackoff(requestClass == NET_CLASS_EMERGENCY);
+}
+
+// Record the outcome of one request
+static void recordResult(NetworkClass requestClass, unsigned long queuedFor, bool success) {
+  portENTER_CRITICAL(&statsMux);
+  NetworkClassStats& stats = classStats[requestClass];
+  stats.sent++;
+  if (!success) {
+    stats.failed++;
+  }
+  if (activeAborted) {
+    stats.aborted++;
+  }
+  stats.totalQueueTime += queuedFor;
+  if (queuedFor > stats.maxQueueTime) {
+    stats.maxQueueTime = queuedFor;
+  }
+  portEXIT_CRITICAL(&statsMux);
+}
+
+// Run one request on the network task; this is where HTTP blocks
+static bool executeRequest(const NetworkRequest& request) {
+  switch (request.type) {
+    case NET_REQUEST_GPS:
+      return sendGpsData(request.gps.latitude, request.gps.longitude);
+    case NET_REQUEST_BATTERY:
+      return sendBatteryStatus(request.batteryPercentage);
+    case NET_REQUEST_NOTIFICATION:
+      return sendNotification(request.notification.title, request.notification.message,
+                              request.notification.priority);
+    case NET_REQUEST_TELEMETRY_BATCH:
+      return sendTelemetryBatch(request.batch.encoder, request.batch.encoderContext,
+                                request.batch.idempotencyKey, request.requestClass != NET_CLASS_HOUSEKEEPING);
+    case NET_REQUEST_CHILD_DATA:
+      return fetchChildData(request.childData.buffer, request.childData.capacity);
+  }
+  return false;
+}
+
+// Network task: owns all API traffic so callers never wait on HTTP
+// Requests run in strict class order. When a higher class is queued, a running request gives
+// up wherever it is (connecting, waiting for the answer or reading the body), and the rest of
+// its job is skipped; its data is kept for a later attempt.
+// Failed requests are never retried in place; the endpoint backs off and the data waits
+// in the outbox, so the task is free for other work meanwhile.
+static void networkTask(void* parameter) {
+  NetworkRequest request;
+  unsigned long lastReplayCheck = millis();
+
+  for (;;) {
+    // Keep the broker session alive and pick up commands between requests
+    if (isApiInitialized()) {
+      flightNetworkStage(FLIGHT_STAGE_NET_POLL);
+      apiPoll();
+    }
+
+    flightNetworkStage(FLIGHT_STAGE_NET_IDLE);
+    if (!takeNextRequest(&request)) {
+      // Sleep until a request is queued; replay stored records once idle long enough
+      if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NETWORK_POLL_INTERVAL)) == 0 &&
+          millis() - lastReplayCheck >= NETWORK_IDLE_POLL_INTERVAL) {
+        lastReplayCheck = millis();
+        if (isNetworkConnected() && isApiInitialized() && (outboxPendingCount() > 0 || journalPendingCount() > 0)) {
+          beginClass(NET_CLASS_HOUSEKEEPING);
+          flightNetworkStage(FLIGHT_STAGE_NET_REPLAY);
+          // Journal history goes after the outbox, which holds the live data that was missed
+          if (outboxReplay() == OUTBOX_REPLAY_DONE) {
+            journalUpload();
+          }
+          activeClass = NET_CLASS_COUNT;
+        }
+      }
+      continue;
+    }
+
+    unsigned long queuedFor = millis() - request.enqueuedAt;
+    if (queuedFor > 1000) {
+      LOGI("NETWORK", "%s request type %d waited %lums in queue", classNames[request.requestClass],
+           (int)request.type, queuedFor);
+    }
+
+    beginClass(request.requestClass);
+    flightNetworkStage((FlightStage)(FLIGHT_STAGE_NET_GPS + (request.type - NET_REQUEST_GPS)));
+    bool success = executeRequest(request);
+    recordResult(request.requestClass, queuedFor, success);
+    activeClass = NET_CLASS_COUNT;
+
+    // Hand the result back to the main loop
+    NetworkCompletion completion = { request.type, success, request.callback, request.context };
+    if (xQueueSend(completionQueue, &completion, 0) != pdTRUE) {
+      LOGE("NETWORK", "Completion queue full, dropping result for request type %d", (int)request.type);
+    }
+  }
+}
+
+// Initialize the network task and its queues
+void networkTaskInit() {
+  if (networkTaskHandle != NULL) {
+    return;
+  }
+
+  for (int c = 0; c < NET_CLASS_COUNT; c++) {
+    classQueues[c] = xQueueCreate(NETWORK_QUEUE_LENGTH, sizeof(NetworkRequest));
+    if (classQueues[c] == NULL) {
+      logError("NETWORK", "Failed to create " + String(classNames[c]) + " queue");
+      return;
+    }
+  }
+
+  completionQueue = xQueueCreate(NETWORK_QUEUE_LENGTH * NET_CLASS_COUNT, sizeof(NetworkCompletion));
+  if (completionQueue == NULL) {
+    logError("NETWORK", "Failed to create completion queue");
+    return;
+  }
+
+  memset(classStats, 0, sizeof(classStats));
+  apiSetAbortCheck(higherClassWaiting);
+
+  BaseType_t created = xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK_SIZE, NULL,
+                                               NETWORK_TASK_PRIORITY, &networkTaskHandle, NETWORK_TASK_CORE);
+  if (created != pdPASS) {
+    logError("NETWORK", "Failed to start network task");
+    networkTaskHandle = NULL;
+    return;
+  }
+
+  logInfo("NETWORK", "Network task started");
+}
+
+// Check if the network task is running
+bool isNetworkTaskRunning() {
+  return networkTaskHandle != NULL;
+}
+
+// Put a request on its class queue without blocking the caller
+static bool enqueueRequest(NetworkRequest& request) {
+  if (networkTaskHandle == NULL) {
+    LOGE("NETWORK", "Network task not running, dropping request type %d", (int)request.type);
+    return false;
+  }
+
+  request.enqueuedAt = millis();
+  if (xQueueSend(classQueues[request.requestClass], &request, 0) != pdTRUE) {
+    LOGE("NETWORK", "%s queue full, dropping request type %d", classNames[request.requestClass], (int)request.type);
+    return false;
+  }
+
+  xTaskNotifyGive(networkTaskHandle);
+  return true;
+}
+
+// Queue GPS data upload
+bool networkSendGps(float latitude, float longitude, NetworkCompletionCallback callback, void* context) {
+  NetworkRequest request;
+  request.type = NET_REQUEST_GPS;
+  request.requestClass = NET_CLASS_LOCATION;
+  request.callback = callback;
+  request.context = context;
+  request.gps.latitude = latitude;
+  request.gps.longitude = longitude;
+  return enqueueRequest(request);
+}
+
+// Queue battery status upload
+bool networkSendBattery(int percentage, NetworkCompletionCallback callback, void* context) {
+  NetworkRequest request;
+  request.type = NET_REQUEST_BATTERY;
+  request.requestClass = NET_CLASS_HOUSEKEEPING;
+  request.callback = callback;
+  request.context = context;
+  request.batteryPercentage = percentage;
+  return enqueueRequest(request);
+}
+
+// Queue a notification
+bool networkSendNotification(const char* title, const char* message, int priority, NetworkClass requestClass,
+                             NetworkCompletionCallback callback, void* context) {
+  NetworkRequest request;
+  request.type = NET_REQUEST_NOTIFICATION;
+  request.requestClass = requestClass;
+  request.callback = callback;
+  request.context = context;
+  strncpy(request.notification.title, title, NETWORK_NOTIFICATION_TITLE_LENGTH - 1);
+  request.notification.title[NETWORK_NOTIFICATION_TITLE_LENGTH - 1] = '\0';
+  strncpy(request.notification.message, message, NETWORK_NOTIFICATION_MESSAGE_LENGTH - 1);
+  request.notification.message[NETWORK_NOTIFICATION_MESSAGE_LENGTH - 1] = '\0';
+  request.notification.priority = priority;
+  return enqueueRequest(request);
+}
+
+// Queue a telemetry batch; the encoder reads the caller's data on the network task,
+// so that data must stay unchanged until the callback runs
+bool networkSendTelemetryBatch(PayloadEncoder encoder, const void* encoderContext, const char* idempotencyKey,
+                               NetworkClass requestClass, NetworkCompletionCallback callback, void* context) {
+  NetworkRequest request;
+  request.type = NET_REQUEST_TELEMETRY_BATCH;
+  request.requestClass = requestClass;
+  request.callback = callback;
+  request.context = context;
+  request.batch.encoder = encoder;
+  request.batch.encoderContext = encoderContext;
+  request.batch.idempotencyKey = idempotencyKey;
+  return enqueueRequest(request);
+}
+
+// Queue a child data fetch; buffer must not be touched until the callback runs
+bool networkFetchChildData(char* buffer, size_t capacity, NetworkCompletionCallback callback, void* context) {
+  NetworkRequest request;
+  request.type = NET_REQUEST_CHILD_DATA;
+  request.requestClass = NET_CLASS_HOUSEKEEPING;
+  request.callback = callback;
+  request.context = context;
+  request.childData.buffer = buffer;
+  request.childData.capacity = capacity;
+  return enqueueRequest(request);
+}
+
+// Run completion callbacks for finished requests (call from main loop)
+void networkProcessCompletions() {
+  if (completionQueue == NULL) {
+    return;
+  }
+
+  NetworkCompletion completion;
+  while (xQueueReceive(completionQueue, &completion, 0) == pdTRUE) {
+    if (completion.callback != NULL) {
+      completion.callback(completion.type, completion.success, completion.context);
+    }
+  }
+}
+
+// Number of requests waiting for the network task, all classes
+int networkPendingCount() {
+  int pending = 0;
+  for (int c = 0; c < NET_CLASS_COUNT; c++) {
+    if (classQueues[c] != NULL) {
+      pending += uxQueueMessagesWaiting(classQueues[c]);
+    }
+  }
+  return pending;
+}
+
+// Copy the statistics of one class
+void networkGetClassStats(NetworkClass requestClass, NetworkClassStats* stats) {
+  portENTER_CRITICAL(&statsMux);
+  *stats = classStats[requestClass];
+  portEXIT_CRITICAL(&statsMux);
+}
+
+// Log queue latency and outcome counters for every class
+void networkLogStats() {
+  for (int c = 0; c < NET_CLASS_COUNT; c++) {
+    NetworkClassStats stats;
+    networkGetClassStats((NetworkClass)c, &stats);
+    if (stats.sent == 0) {
+      continue;
+    }
+    LOGI("NETWORK", "%s: %lu sent, %lu failed, %lu aborted, queue time avg %lums max %lums", classNames[c],
+         stats.sent, stats.failed, stats.aborted, stats.totalQueueTime / stats.sent, stats.maxQueueTime);
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef NETWORK_TASK_H
+#define NETWORK_TASK_H
+
+#include <Arduino.h>
+#include "payload_writer.h"
+
+// Network task settings
+#define NETWORK_TASK_STACK_SIZE 8192
+#define NETWORK_TASK_PRIORITY 1
+#define NETWORK_TASK_CORE 0            // Arduino loop() runs on core 1
+#define NETWORK_QUEUE_LENGTH 8            // Per priority class
+#define NETWORK_POLL_INTERVAL 1000        // Service the MQTT session at least this often
+#define NETWORK_IDLE_POLL_INTERVAL 5000   // Check the outbox when idle this long
+#define NETWORK_STATS_LOG_INTERVAL 600000 // Log per-class queue latency every 10 minutes
+#define NETWORK_NOTIFICATION_TITLE_LENGTH 32
+#define NETWORK_NOTIFICATION_MESSAGE_LENGTH 128
+
+// Request timeouts per class; low classes give up sooner so they hold the radio for less time
+#define NETWORK_EMERGENCY_TIMEOUT 10000
+#define NETWORK_ALERT_TIMEOUT 10000
+#define NETWORK_LOCATION_TIMEOUT 6000
+#define NETWORK_HOUSEKEEPING_TIMEOUT 4000
+
+// Priority classes, highest first; a waiting request always runs before any lower class
+enum NetworkClass {
+  NET_CLASS_EMERGENCY,
+  NET_CLASS_ALERT,
+  NET_CLASS_LOCATION,
+  NET_CLASS_HOUSEKEEPING,
+  NET_CLASS_COUNT
+};
+
+// Request types handled by the network task
+enum NetworkRequestType {
+  NET_REQUEST_GPS,
+  NET_REQUEST_BATTERY,
+  NET_REQUEST_NOTIFICATION,
+  NET_REQUEST_TELEMETRY_BATCH,
+  NET_REQUEST_CHILD_DATA
+};
+
+// Completion callback, always invoked from the main loop via networkProcessCompletions()
+typedef void (*NetworkCompletionCallback)(NetworkRequestType type, bool success, void* context);
+
+// Request queued for the network task
+struct NetworkRequest {
+  NetworkRequestType type;
+  NetworkClass requestClass;
+  NetworkCompletionCallback callback;
+  void* context;
+  unsigned long enqueuedAt;
+  union {
+    struct {
+      float latitude;
+      float longitude;
+    } gps;
+    int batteryPercentage;
+    struct {
+      char title[NETWORK_NOTIFICATION_TITLE_LENGTH];
+      char message[NETWORK_NOTIFICATION_MESSAGE_LENGTH];
+      int priority;
+    } notification;
+    struct {
+      PayloadEncoder encoder;       // Runs on the network task to write the body
+      const void* encoderContext;   // Owned by the caller until completion
+      const char* idempotencyKey;   // Owned by the caller until completion
+    } batch;
+    struct {
+      char* buffer;                 // Written by the network task until completion
+      size_t capacity;
+    } childData;
+  };
+};
+
+// Per-class counters; queue time is from enqueue until the network task picks the request up
+struct NetworkClassStats {
+  uint32_t sent;
+  uint32_t failed;
+  uint32_t aborted;           // Gave up because a higher class was waiting
+  uint32_t totalQueueTime;
+  uint32_t maxQueueTime;
+};
+
+// Functions
+void networkTaskInit();
+bool isNetworkTaskRunning();
+bool networkSendGps(float latitude, float longitude, NetworkCompletionCallback callback = NULL, void* context = NULL);
+bool networkSendBattery(int percentage, NetworkCompletionCallback callback = NULL, void* context = NULL);
+bool networkSendNotification(const char* title, const char* message, int priority, NetworkClass requestClass,
+                             NetworkCompletionCallback callback = NULL, void* context = NULL);
+bool networkSendTelemetryBatch(PayloadEncoder encoder, const void* encoderContext, const char* idempotencyKey,
+                               NetworkClass requestClass, NetworkCompletionCallback callback = NULL,
+                               void* context = NULL);
+bool networkFetchChildData(char* buffer, size_t capacity,
+                           NetworkCompletionCallback callback = NULL, void* context = NULL);
+void networkProcessCompletions();
+int networkPendingCount();
+void networkGetClassStats(NetworkClass requestClass, NetworkClassStats* stats);
+void networkLogStats();
+
+#endif // NETWORK_TASK_H
@@ -0,0 +1,335 @@
+#include "outbox.h"
+#include "utils.h"
+#include "storage.h"
+#include "api.h"
+#include "downlink.h"
+#include "wifi_manager.h"
+#include "sequence.h"
+#include "clock_service.h"
+
+// Copies are bounded by sizeof(OutboxRecord); keeping it the size of a slot payload wastes no flash
+static_assert(sizeof(OutboxRecord) == OUTBOX_RECORD_SIZE - sizeof(FlashRingHeader),
+              "OutboxRecord must match the outbox slot payload size");
+
+// Outbox state; the ring is shared by the main loop (store) and network task (replay)
+static FlashRing ring;
+static bool outboxReady = false;
+static SemaphoreHandle_t outboxMutex = NULL;
+static uint32_t ackSeq = 0;              // First record not yet acknowledged by the server
+static uint16_t bootCount = 0;
+static unsigned long lastReplayFailureTime = 0;
+static bool lastReplayFailed = false;
+
+// Replay buffers, used only by the network task
+static OutboxRecord replayRecords[OUTBOX_REPLAY_BATCH];
+static uint32_t replaySeqs[OUTBOX_REPLAY_BATCH];
+static int replayCount = 0;
+static char replayKey[SEQUENCE_KEY_LENGTH];
+
+// Advance and persist the acknowledged cursor (caller holds the mutex)
+static void acknowledgeUpTo(uint32_t seq) {
+  // Never move backwards; an overflow may already have pushed the cursor past seq
+  if ((int32_t)(seq - ackSeq) <= 0) {
+    return;
+  }
+  ackSeq = seq;
+  saveULong("outbox_ack", ackSeq);
+}
+
+// Initialize the outbox and recover its state from flash
+void outboxInit() {
+  outboxMutex = xSemaphoreCreateMutex();
+
+  if (!flashRingInit(&ring, OUTBOX_PARTITION_LABEL, OUTBOX_RECORD_SIZE)) {
+    logError("OUTBOX", "Outbox partition unavailable, offline data will be dropped");
+    return;
+  }
+
+  bootCount = loadInt("boot_count", 0) + 1;
+  saveInt("boot_count", bootCount);
+
+  // Clamp the cursor to what is actually stored
+  ackSeq = loadULong("outbox_ack", ring.oldestSeq);
+  if (!flashRingContains(&ring, ackSeq) && ackSeq != ring.headSeq) {
+    logWarning("OUTBOX", "Acknowledged cursor " + String(ackSeq) + " outside stored range, resetting");
+    ackSeq = ring.oldestSeq;
+    saveULong("outbox_ack", ackSeq);
+  }
+
+  outboxReady = true;
+  logInfo("OUTBOX", "Outbox ready with " + String(outboxPendingCount()) + " pending records");
+}
+
+// Append a record (fills in bookkeeping fields)
+static bool appendRecord(OutboxRecord& record) {
+  if (!outboxReady) {
+    return false;
+  }
+
+  record.bootCount = bootCount;
+
+  xSemaphoreTake(outboxMutex, portMAX_DELAY);
+  uint32_t seq;
+  bool success = flashRingAppend(&ring, &record, sizeof(record), &seq);
+
+  // The ring overwrote records that were never acknowledged
+  if (!flashRingContains(&ring, ackSeq) && ackSeq != ring.headSeq) {
+    LOGW("OUTBOX", "Outbox full, dropped records %lu..%lu", ackSeq, ring.oldestSeq - 1);
+    acknowledgeUpTo(ring.oldestSeq);
+  }
+  xSemaphoreGive(outboxMutex);
+
+  if (!success) {
+    logError("OUTBOX", "Failed to store record type " + String(record.type));
+  }
+  return success;
+}
+
+// Store a telemetry sample that could not be uploaded
+bool outboxStoreSample(const TelemetrySample& sample) {
+  OutboxRecord record;
+  memset(&record, 0, sizeof(record));
+  record.priority = sample.priority;
+  record.uptime = sample.timestamp;
+  record.seq = sample.seq;
+
+  // Back-date the wall time by the sample's age
+  uint32_t wallTime = clockUnixTime();
+  if (wallTime > 0) {
+    record.wallTime = wallTime - (clockUptimeMs() - sample.timestamp) / 1000;
+  }
+
+  switch (sample.type) {
+    case SAMPLE_LOCATION:
+      record.type = OUTBOX_LOCATION;
+      record.location.latitude = sample.location.latitude;
+      record.location.longitude = sample.location.longitude;
+      break;
+    case SAMPLE_BATTERY:
+      record.type = OUTBOX_BATTERY;
+      record.batteryPercentage = sample.batteryPercentage;
+      break;
+    case SAMPLE_SIGNAL:
+      record.type = OUTBOX_SIGNAL;
+      record.signal.mode = sample.signal.mode;
+      record.signal.strength = sample.signal.strength;
+      break;
+    case SAMPLE_EVENT:
+      record.type = OUTBOX_EVENT;
+      memcpy(record.event.type, sample.eventType, TELEMETRY_EVENT_TYPE_LENGTH);
+      memcpy(record.event.message, sample.eventMessage, TELEMETRY_EVENT_MESSAGE_LENGTH);
+      break;
+  }
+
+  return appendRecord(record);
+}
+
+// Store a GPS location
+bool outboxStoreLocation(float latitude, float longitude, uint32_t seq) {
+  OutboxRecord record;
+  memset(&record, 0, sizeof(record));
+  record.seq = seq;
+  record.type = OUTBOX_LOCATION;
+  record.priority = TELEMETRY_PRIORITY_LOCATION;
+  record.wallTime = clockUnixTime();
+  record.uptime = millis();
+  record.location.latitude = latitude;
+  record.location.longitude = longitude;
+  return appendRecord(record);
+}
+
+// Store a battery reading
+bool outboxStoreBattery(int percentage, uint32_t seq) {
+  OutboxRecord record;
+  memset(&record, 0, sizeof(record));
+  record.seq = seq;
+  record.type = OUTBOX_BATTERY;
+  record.priority = TELEMETRY_PRIORITY_ROUTINE;
+  record.wallTime = clockUnixTime();
+  record.uptime = millis();
+  record.batteryPercentage = percentage;
+  return appendRecord(record);
+}
+
+// Store a notification for later delivery
+bool outboxStoreNotification(const char* title, const char* message, int priority, uint32_t seq) {
+  OutboxRecord record;
+  memset(&record, 0, sizeof(record));
+  record.seq = seq;
+  record.type = OUTBOX_NOTIFICATION;
+  record.priority = priority;
+  record.wallTime = clockUnixTime();
+  record.uptime = millis();
+  strncpy(record.notification.title, title, OUTBOX_NOTIFICATION_TITLE_LENGTH - 1);
+  strncpy(record.notification.message, message, OUTBOX_NOTIFICATION_MESSAGE_LENGTH - 1);
+
+  bool success = appendRecord(record);
+  if (success) {
+    logInfo("OUTBOX", "Notification stored for later delivery: " + String(title));
+  }
+  return success;
+}
+
+// Number of records not yet acknowledged
+uint32_t outboxPendingCount() {
+  if (!outboxReady) {
+    return 0;
+  }
+  return ring.headSeq - ackSeq;
+}
+
+// Write one telemetry record of the replay batch
+static void encodeReplayEntry(PayloadWriter* writer, const OutboxRecord& record) {
+  // Wall time when known; otherwise an age, which is only meaningful within the same boot
+  bool hasWallTime = record.wallTime > 0;
+  bool hasAge = !hasWallTime && record.bootCount == bootCount;
+
+  uint16_t members = 2 + (hasWallTime || hasAge ? 1 : 0);
+  switch (record.type) {
+    case OUTBOX_LOCATION: members += 2; break;
+    case OUTBOX_BATTERY:  members += 1; break;
+    case OUTBOX_SIGNAL:   members += 2; break;
+    case OUTBOX_EVENT:    members += 3; break;
+  }
+
+  payloadBeginMap(writer, members);
+  payloadKey(writer, "seq");
+  payloadUInt(writer, record.seq);
+  if (hasWallTime) {
+    payloadKey(writer, "ts");
+    payloadUInt(writer, record.wallTime);
+  } else if (hasAge) {
+    payloadKey(writer, "age");
+    payloadUInt(writer, millis() - record.uptime);
+  }
+
+  switch (record.type) {
+    case OUTBOX_LOCATION:
+      payloadKey(writer, "t");
+      payloadString(writer, "loc");
+      payloadKey(writer, "lat");
+      payloadFloat(writer, record.location.latitude, 6);
+      payloadKey(writer, "lon");
+      payloadFloat(writer, record.location.longitude, 6);
+      break;
+    case OUTBOX_BATTERY:
+      payloadKey(writer, "t");
+      payloadString(writer, "bat");
+      payloadKey(writer, "v");
+      payloadInt(writer, record.batteryPercentage);
+      break;
+    case OUTBOX_SIGNAL:
+      payloadKey(writer, "t");
+      payloadString(writer, "sig");
+      payloadKey(writer, "m");
+      payloadString(writer, record.signal.mode == GPRS_MODE ? "gprs" : "wifi");
+      payloadKey(writer, "v");
+      payloadInt(writer, record.signal.strength);
+      break;
+    case OUTBOX_EVENT:
+      payloadKey(writer, "t");
+      payloadString(writer, "evt");
+      payloadKey(writer, "p");
+      payloadInt(writer, record.priority);
+      payloadKey(writer, "type");
+      payloadString(writer, record.event.type);
+      payloadKey(writer, "msg");
+      payloadString(writer, record.event.message);
+      break;
+  }
+  payloadEndMap(writer);
+}
+
+// Write the collected telemetry records as one batch body
+static bool encodeReplayBatch(PayloadWriter* writer, const void* context) {
+  payloadBeginMap(writer, 3);
+  payloadKey(writer, "dev");
+  payloadString(writer, sequenceDeviceId());
+  payloadKey(writer, "cfg_v");
+  payloadUInt(writer, downlinkConfigVersion());
+  payloadKey(writer, "samples");
+  payloadBeginArray(writer, replayCount);
+  for (int i = 0; i < replayCount; i++) {
+    encodeReplayEntry(writer, replayRecords[i]);
+  }
+  payloadEndArray(writer);
+  payloadEndMap(writer);
+  return true;
+}
+
+// Send the oldest pending records, in order, and advance the cursor on success
+// Runs on the network task; notifications are delivered one by one, consecutive
+// telemetry records are sent together as one batch
+// A replay aborted for higher priority traffic does not count as a failure
+OutboxReplayResult outboxReplay() {
+  if (!outboxReady || outboxPendingCount() == 0) {
+    return OUTBOX_REPLAY_DONE;
+  }
+
+  if (lastReplayFailed && millis() - lastReplayFailureTime < OUTBOX_RETRY_INTERVAL) {
+    return OUTBOX_REPLAY_FAILED;
+  }
+
+  // Collect the oldest readable records
+  int count = 0;
+  xSemaphoreTake(outboxMutex, portMAX_DELAY);
+  uint32_t seq = ackSeq;
+  while (seq != ring.headSeq && count < OUTBOX_REPLAY_BATCH) {
+    OutboxRecord& record = replayRecords[count];
+    if (!flashRingRead(&ring, seq, &record, sizeof(record))) {
+      LOGW("OUTBOX", "Skipping unreadable record %lu", seq);
+      seq++;
+      continue;
+    }
+    
+    // A notification goes to its own endpoint, so it ends the batch
+    bool isNotification = record.type == OUTBOX_NOTIFICATION;
+    if (isNotification && count > 0) {
+      break;
+    }
+    replaySeqs[count++] = seq;
+    seq++;
+    if (isNotification) {
+      break;
+    }
+  }
+  xSemaphoreGive(outboxMutex);
+
+  // Only unreadable records in range; skip past them
+  if (count == 0) {
+    xSemaphoreTake(outboxMutex, portMAX_DELAY);
+    acknowledgeUpTo(seq);
+    xSemaphoreGive(outboxMutex);
+    return OUTBOX_REPLAY_DONE;
+  }
+
+  bool success;
+  if (replayRecords[0].type == OUTBOX_NOTIFICATION) {
+    const OutboxRecord& record = replayRecords[0];
+    LOGI("OUTBOX", "Replaying notification %lu", replaySeqs[0]);
+    success = sendStoredNotification(record.notification.title, record.notification.message,
+                                     record.priority, record.wallTime, record.seq);
+  } else {
+    replayCount = count;
+    LOGI("OUTBOX", "Replaying records %lu..%lu", replaySeqs[0], replaySeqs[count - 1]);
+    sequenceFormatKey(replayKey, sizeof(replayKey), replayRecords[0].seq, replayRecords[count - 1].seq);
+    success = sendTelemetryBatch(encodeReplayBatch, NULL, replayKey, true);
+  }
+
+  if (!success && apiLastRequestAborted()) {
+    return OUTBOX_REPLAY_ABORTED;
+  }
+  if (!success) {
+    lastReplayFailed = true;
+    lastReplayFailureTime = millis();
+    return OUTBOX_REPLAY_FAILED;
+  }
+
+  lastReplayFailed = false;
+  xSemaphoreTake(outboxMutex, portMAX_DELAY);
+  acknowledgeUpTo(seq);
+  xSemaphoreGive(outboxMutex);
+
+  LOGI("OUTBOX", "%lu records left in outbox", outboxPendingCount());
+  return OUTBOX_REPLAY_DONE;
+}
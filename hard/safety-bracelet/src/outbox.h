@@ -0,0 +1,70 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <Arduino.h>
+#include "flash_ring.h"
+#include "telemetry.h"
+
+// Outbox settings
+#define OUTBOX_PARTITION_LABEL "outbox"
+#define OUTBOX_RECORD_SIZE 128           // Flash slot size, 32 records per sector
+#define OUTBOX_REPLAY_BATCH 16           // Records sent per replay request
+#define OUTBOX_RETRY_INTERVAL 30000      // Wait after a failed replay
+#define OUTBOX_NOTIFICATION_TITLE_LENGTH 32
+#define OUTBOX_NOTIFICATION_MESSAGE_LENGTH 72
+
+// Record types stored in the outbox
+enum OutboxRecordType {
+  OUTBOX_LOCATION,
+  OUTBOX_BATTERY,
+  OUTBOX_SIGNAL,
+  OUTBOX_EVENT,
+  OUTBOX_NOTIFICATION
+};
+
+// Payload of one outbox slot
+struct OutboxRecord {
+  uint8_t type;
+  uint8_t priority;
+  uint16_t bootCount;     // Boot the record was captured in
+  uint32_t wallTime;      // Unix time in seconds, 0 if the clock was not set
+  uint32_t uptime;        // millis() when the data was captured
+  union {
+    struct {
+      float latitude;
+      float longitude;
+    } location;
+    int32_t batteryPercentage;
+    struct {
+      int32_t strength;
+      uint8_t mode;
+    } signal;
+    struct {
+      char type[TELEMETRY_EVENT_TYPE_LENGTH];
+      char message[TELEMETRY_EVENT_MESSAGE_LENGTH];
+    } event;
+    struct {
+      char title[OUTBOX_NOTIFICATION_TITLE_LENGTH];
+      char message[OUTBOX_NOTIFICATION_MESSAGE_LENGTH];
+    } notification;
+  };
+  uint32_t seq;           // Upload sequence number (sequence.h), not the ring position
+};
+
+// Outcome of a replay attempt
+enum OutboxReplayResult {
+  OUTBOX_REPLAY_DONE,         // Records sent, or nothing to send
+  OUTBOX_REPLAY_FAILED,       // Not sent; the next attempt waits OUTBOX_RETRY_INTERVAL
+  OUTBOX_REPLAY_ABORTED       // Gave up for higher priority traffic; may run again straight away
+};
+
+// Functions
+void outboxInit();
+bool outboxStoreSample(const TelemetrySample& sample);
+bool outboxStoreLocation(float latitude, float longitude, uint32_t seq);
+bool outboxStoreBattery(int percentage, uint32_t seq);
+bool outboxStoreNotification(const char* title, const char* message, int priority, uint32_t seq);
+uint32_t outboxPendingCount();
+OutboxReplayResult outboxReplay();
+
+#endif // OUTBOX_H
@@ -0,0 +1,264 @@
+#include "payload_writer.h"
+
+// Append raw bytes, or mark the writer as overflowed
+static void writeBytes(PayloadWriter* writer, const void* data, size_t length) {
+  if (writer->overflowed || writer->length + length > writer->capacity) {
+    writer->overflowed = true;
+    return;
+  }
+  memcpy(writer->buffer + writer->length, data, length);
+  writer->length += length;
+}
+
+// Append one byte
+static void writeByte(PayloadWriter* writer, uint8_t value) {
+  writeBytes(writer, &value, 1);
+}
+
+// Append a type marker followed by a big-endian value of the given width
+static void writeMarked(PayloadWriter* writer, uint8_t marker, uint32_t value, uint8_t width) {
+  uint8_t bytes[5];
+  bytes[0] = marker;
+  for (uint8_t i = 0; i < width; i++) {
+    bytes[1 + i] = (uint8_t)(value >> (8 * (width - 1 - i)));
+  }
+  writeBytes(writer, bytes, 1 + width);
+}
+
+// JSON: emit the separator owed before a new element
+static void jsonSeparator(PayloadWriter* writer) {
+  if (writer->afterKey) {
+    writer->afterKey = false;
+    return;
+  }
+  if (writer->depth == 0) {
+    return;
+  }
+  if (writer->firstInContainer[writer->depth - 1]) {
+    writer->firstInContainer[writer->depth - 1] = false;
+  } else {
+    writeByte(writer, ',');
+  }
+}
+
+// JSON: open a map or array
+static void jsonOpen(PayloadWriter* writer, char bracket) {
+  jsonSeparator(writer);
+  writeByte(writer, bracket);
+  if (writer->depth >= PAYLOAD_MAX_DEPTH) {
+    writer->overflowed = true;
+    return;
+  }
+  writer->firstInContainer[writer->depth++] = true;
+}
+
+// JSON: close a map or array
+static void jsonClose(PayloadWriter* writer, char bracket) {
+  writeByte(writer, bracket);
+  if (writer->depth > 0) {
+    writer->depth--;
+  }
+}
+
+// JSON: write a quoted, escaped string
+static void jsonQuoted(PayloadWriter* writer, const char* value) {
+  writeByte(writer, '"');
+  for (const char* c = value; *c != '\0'; c++) {
+    switch (*c) {
+      case '"':  writeBytes(writer, "\\\"", 2); break;
+      case '\\': writeBytes(writer, "\\\\", 2); break;
+      case '\n': writeBytes(writer, "\\n", 2); break;
+      case '\r': writeBytes(writer, "\\r", 2); break;
+      case '\t': writeBytes(writer, "\\t", 2); break;
+      default:
+        if ((uint8_t)*c < 0x20) {
+          char escaped[7];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", (uint8_t)*c);
+          writeBytes(writer, escaped, 6);
+        } else {
+          writeByte(writer, (uint8_t)*c);
+        }
+    }
+  }
+  writeByte(writer, '"');
+}
+
+// MessagePack: write a string header and bytes
+static void msgpackString(PayloadWriter* writer, const char* value) {
+  size_t length = strlen(value);
+  if (length < 32) {
+    writeByte(writer, 0xa0 | length);
+  } else if (length < 256) {
+    writeMarked(writer, 0xd9, length, 1);
+  } else {
+    writeMarked(writer, 0xda, length, 2);
+  }
+  writeBytes(writer, value, length);
+}
+
+// Start a new payload in buffer
+void payloadBegin(PayloadWriter* writer, uint8_t* buffer, size_t capacity, PayloadFormat format) {
+  writer->buffer = buffer;
+  writer->capacity = capacity;
+  writer->length = 0;
+  writer->format = format;
+  writer->overflowed = false;
+  writer->depth = 0;
+  writer->afterKey = false;
+}
+
+// Open a map with count key/value pairs
+void payloadBeginMap(PayloadWriter* writer, uint16_t count) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonOpen(writer, '{');
+  } else if (count < 16) {
+    writeByte(writer, 0x80 | count);
+  } else {
+    writeMarked(writer, 0xde, count, 2);
+  }
+}
+
+// Close the current map
+void payloadEndMap(PayloadWriter* writer) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonClose(writer, '}');
+  }
+}
+
+// Open an array with count elements
+void payloadBeginArray(PayloadWriter* writer, uint16_t count) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonOpen(writer, '[');
+  } else if (count < 16) {
+    writeByte(writer, 0x90 | count);
+  } else {
+    writeMarked(writer, 0xdc, count, 2);
+  }
+}
+
+// Close the current array
+void payloadEndArray(PayloadWriter* writer) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonClose(writer, ']');
+  }
+}
+
+// Write a map key; the next call writes its value
+void payloadKey(PayloadWriter* writer, const char* key) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonSeparator(writer);
+    jsonQuoted(writer, key);
+    writeByte(writer, ':');
+    writer->afterKey = true;
+  } else {
+    msgpackString(writer, key);
+  }
+}
+
+// Write a string value
+void payloadString(PayloadWriter* writer, const char* value) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonSeparator(writer);
+    jsonQuoted(writer, value);
+  } else {
+    msgpackString(writer, value);
+  }
+}
+
+// Write a signed integer in its shortest form
+void payloadInt(PayloadWriter* writer, int32_t value) {
+  if (value >= 0) {
+    payloadUInt(writer, (uint32_t)value);
+    return;
+  }
+
+  if (writer->format == PAYLOAD_JSON) {
+    char text[12];
+    int length = snprintf(text, sizeof(text), "%ld", (long)value);
+    jsonSeparator(writer);
+    writeBytes(writer, text, length);
+  } else if (value >= -32) {
+    writeByte(writer, (uint8_t)(int8_t)value);
+  } else if (value >= -128) {
+    writeMarked(writer, 0xd0, (uint8_t)value, 1);
+  } else if (value >= -32768) {
+    writeMarked(writer, 0xd1, (uint16_t)value, 2);
+  } else {
+    writeMarked(writer, 0xd2, (uint32_t)value, 4);
+  }
+}
+
+// Write an unsigned integer in its shortest form
+void payloadUInt(PayloadWriter* writer, uint32_t value) {
+  if (writer->format == PAYLOAD_JSON) {
+    char text[11];
+    int length = snprintf(text, sizeof(text), "%lu", (unsigned long)value);
+    jsonSeparator(writer);
+    writeBytes(writer, text, length);
+  } else if (value < 128) {
+    writeByte(writer, (uint8_t)value);
+  } else if (value < 256) {
+    writeMarked(writer, 0xcc, value, 1);
+  } else if (value < 65536) {
+    writeMarked(writer, 0xcd, value, 2);
+  } else {
+    writeMarked(writer, 0xce, value, 4);
+  }
+}
+
+// Write a float; JSON uses the given number of decimals, MessagePack a 32-bit float
+// JSON has no NaN or infinity, so those are written as null; a value too wide for the
+// fixed decimals falls back to exponent notation
+void payloadFloat(PayloadWriter* writer, float value, uint8_t decimals) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonSeparator(writer);
+    if (!isfinite(value)) {
+      writeBytes(writer, "null", 4);
+      return;
+    }
+    char text[24];
+    int length = snprintf(text, sizeof(text), "%.*f", decimals, value);
+    if (length >= (int)sizeof(text)) {
+      length = snprintf(text, sizeof(text), "%g", value);
+    }
+    if (length < 0) {
+      length = 0;
+    } else if (length >= (int)sizeof(text)) {
+      length = sizeof(text) - 1;
+    }
+    writeBytes(writer, text, length);
+  } else {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeMarked(writer, 0xca, bits, 4);
+  }
+}
+
+// Write a boolean
+void payloadBool(PayloadWriter* writer, bool value) {
+  if (writer->format == PAYLOAD_JSON) {
+    jsonSeparator(writer);
+    if (value) {
+      writeBytes(writer, "true", 4);
+    } else {
+      writeBytes(writer, "false", 5);
+    }
+  } else {
+    writeByte(writer, value ? 0xc3 : 0xc2);
+  }
+}
+
+// Check if the buffer ran out of room
+bool payloadOverflowed(const PayloadWriter* writer) {
+  return writer->overflowed;
+}
+
+// Number of bytes written
+size_t payloadLength(const PayloadWriter* writer) {
+  return writer->length;
+}
+
+// HTTP content type for a format
+const char* payloadContentType(PayloadFormat format) {
+  return format == PAYLOAD_MSGPACK ? "application/msgpack" : "application/json";
+}
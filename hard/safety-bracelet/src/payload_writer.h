@@ -0,0 +1,51 @@
+#ifndef PAYLOAD_WRITER_H
+#define PAYLOAD_WRITER_H
+
+#include <Arduino.h>
+
+// Streaming encoder that writes JSON or MessagePack straight into a caller-owned
+// buffer, without building a document or any String temporaries.
+// Maps and arrays take their element count up front because MessagePack
+// stores it in the header; JSON ignores it. Once the buffer is full the writer
+// stops writing and reports an overflow.
+
+#define PAYLOAD_MAX_DEPTH 4
+
+// Wire formats
+enum PayloadFormat {
+  PAYLOAD_JSON,
+  PAYLOAD_MSGPACK
+};
+
+// Writer state
+struct PayloadWriter {
+  uint8_t* buffer;
+  size_t capacity;
+  size_t length;
+  PayloadFormat format;
+  bool overflowed;
+  uint8_t depth;
+  bool firstInContainer[PAYLOAD_MAX_DEPTH];  // JSON: no comma before the next element
+  bool afterKey;                             // JSON: next value follows a key
+};
+
+// Fills a writer with a complete payload; returns false if it cannot
+typedef bool (*PayloadEncoder)(PayloadWriter* writer, const void* context);
+
+// Functions
+void payloadBegin(PayloadWriter* writer, uint8_t* buffer, size_t capacity, PayloadFormat format);
+void payloadBeginMap(PayloadWriter* writer, uint16_t count);
+void payloadEndMap(PayloadWriter* writer);
+void payloadBeginArray(PayloadWriter* writer, uint16_t count);
+void payloadEndArray(PayloadWriter* writer);
+void payloadKey(PayloadWriter* writer, const char* key);
+void payloadString(PayloadWriter* writer, const char* value);
+void payloadInt(PayloadWriter* writer, int32_t value);
+void payloadUInt(PayloadWriter* writer, uint32_t value);
+void payloadFloat(PayloadWriter* writer, float value, uint8_t decimals);
+void payloadBool(PayloadWriter* writer, bool value);
+bool payloadOverflowed(const PayloadWriter* writer);
+size_t payloadLength(const PayloadWriter* writer);
+const char* payloadContentType(PayloadFormat format);
+
+#endif // PAYLOAD_WRITER_H
@@ -56,6 +56,7 @@ void enterLightSleep() {
   // TODO: Consider turning off display or showing a sleep message
   
   // Make sure all pending operations are complete
+  logFlush();
   yield();
   delay(10);
   
@@ -0,0 +1,181 @@
+#include "report_policy.h"
+#include "utils.h"
+#include "storage.h"
+#include "emergency.h"
+
+// NVS key of each channel's policy blob
+static const char* policyKeys[REPORT_CHANNEL_COUNT] = { "pol_loc", "pol_bat", "pol_sig" };
+static const char* channelNames[REPORT_CHANNEL_COUNT] = { "loc", "bat", "sig" };
+
+static ReportPolicy policies[REPORT_CHANNEL_COUNT] = {
+  REPORT_LOCATION_DEFAULT, REPORT_BATTERY_DEFAULT, REPORT_SIGNAL_DEFAULT
+};
+
+// Why a reading went out
+enum ReportReason {
+  REASON_FIRST,
+  REASON_CHANGE,
+  REASON_HEARTBEAT,
+  REASON_EMERGENCY,
+  REASON_COUNT
+};
+
+// Last reported value of each channel
+struct ChannelState {
+  bool reported;
+  unsigned long lastReportTime;
+  float lastValue[2];
+  uint32_t reports[REASON_COUNT];
+};
+static ChannelState channels[REPORT_CHANNEL_COUNT];
+
+// Load the stored policies; older firmware kept only gps_int and bat_int, which become heartbeats
+void reportPolicyInit() {
+  memset(channels, 0, sizeof(channels));
+
+  for (int c = 0; c < REPORT_CHANNEL_COUNT; c++) {
+    ReportPolicy stored;
+    if (loadBytes(policyKeys[c], &stored, sizeof(stored)) == sizeof(stored) && reportPolicyValid(stored)) {
+      policies[c] = stored;
+    } else if (c == REPORT_LOCATION) {
+      policies[c].maxInterval = loadULong("gps_int", policies[c].maxInterval * 1000UL) / 1000;
+    } else if (c == REPORT_BATTERY) {
+      policies[c].maxInterval = loadULong("bat_int", policies[c].maxInterval * 1000UL) / 1000;
+    }
+    policies[c].minInterval = min(policies[c].minInterval, policies[c].maxInterval);
+
+    logInfo("REPORT", String(channelNames[c]) + ": min " + String(policies[c].minInterval) + "s, max " +
+            String(policies[c].maxInterval) + "s, threshold " + String(policies[c].threshold, 1) +
+            ", emergency " + String(policies[c].emergencyInterval) + "s");
+  }
+}
+
+// Check a policy against the limits accepted from the server
+bool reportPolicyValid(const ReportPolicy& policy) {
+  return policy.minInterval >= REPORT_MIN_INTERVAL_FLOOR && policy.maxInterval <= REPORT_MAX_INTERVAL_CEILING &&
+         policy.minInterval <= policy.maxInterval && policy.threshold >= 0 &&
+         policy.threshold <= REPORT_MAX_THRESHOLD &&
+         (policy.emergencyInterval == 0 || policy.emergencyInterval >= REPORT_MIN_INTERVAL_FLOOR);
+}
+
+// Replace and store the policy of a channel
+bool reportPolicySet(ReportChannel channel, const ReportPolicy& policy) {
+  if (!reportPolicyValid(policy)) {
+    logWarning("REPORT", "Rejected invalid policy for " + String(channelNames[channel]));
+    return false;
+  }
+  policies[channel] = policy;
+  logInfo("REPORT", String(channelNames[channel]) + " policy: min " + String(policy.minInterval) + "s, max " +
+          String(policy.maxInterval) + "s, threshold " + String(policy.threshold, 1));
+  return saveBytes(policyKeys[channel], &policy, sizeof(policy));
+}
+
+// Current policy of a channel
+ReportPolicy reportPolicyGet(ReportChannel channel) {
+  return policies[channel];
+}
+
+// Short channel name, as used in the downlink "policy" block
+const char* reportChannelName(ReportChannel channel) {
+  return channelNames[channel];
+}
+
+// Great-circle distance in metres
+static float distanceMetres(float lat1, float lon1, float lat2, float lon2) {
+  const float earthRadius = 6371000.0f;
+  float dLat = radians(lat2 - lat1);
+  float dLon = radians(lon2 - lon1);
+  float a = sin(dLat / 2) * sin(dLat / 2) +
+            cos(radians(lat1)) * cos(radians(lat2)) * sin(dLon / 2) * sin(dLon / 2);
+  return earthRadius * 2 * atan2(sqrt(a), sqrt(1 - a));
+}
+
+// Decide from the timing alone whether a reading of the channel may go out. Returns false
+// while the channel is held back; otherwise sets the reason, which is REASON_CHANGE when the
+// reading still has to have moved by the threshold
+static bool reportAllowed(ReportChannel channel, ReportReason* reason) {
+  const ReportPolicy& policy = policies[channel];
+  const ChannelState& state = channels[channel];
+  unsigned long elapsed = millis() - state.lastReportTime;
+
+  if (isInEmergencyMode() && policy.emergencyInterval > 0) {
+    if (state.reported && elapsed < policy.emergencyInterval * 1000UL) {
+      return false;
+    }
+    *reason = REASON_EMERGENCY;
+  } else if (!state.reported) {
+    *reason = REASON_FIRST;
+  } else if (elapsed < policy.minInterval * 1000UL) {
+    return false;
+  } else if (elapsed >= policy.maxInterval * 1000UL) {
+    *reason = REASON_HEARTBEAT;
+  } else {
+    *reason = REASON_CHANGE;
+  }
+  return true;
+}
+
+// Remember a reading that goes out
+static void recordReport(ReportChannel channel, ReportReason reason, float value0, float value1) {
+  ChannelState& state = channels[channel];
+  state.reported = true;
+  state.lastReportTime = millis();
+  state.lastValue[0] = value0;
+  state.lastValue[1] = value1;
+  state.reports[reason]++;
+}
+
+// Decide whether a reading should go out given how far it moved since the last report
+// changed forces a report once the minimum interval has passed (e.g. a different radio)
+static bool evaluate(ReportChannel channel, float change, bool changed, float value0, float value1) {
+  ReportReason reason;
+  if (!reportAllowed(channel, &reason)) {
+    return false;
+  }
+  if (reason == REASON_CHANGE && !changed && change < policies[channel].threshold) {
+    return false;
+  }
+  recordReport(channel, reason, value0, value1);
+  return true;
+}
+
+// Check whether a GPS fix should be reported
+// The distance is only worked out once nothing but the movement decides
+bool reportLocationDue(float latitude, float longitude) {
+  ReportReason reason;
+  if (!reportAllowed(REPORT_LOCATION, &reason)) {
+    return false;
+  }
+  if (reason == REASON_CHANGE) {
+    const ChannelState& state = channels[REPORT_LOCATION];
+    if (distanceMetres(state.lastValue[0], state.lastValue[1], latitude, longitude) <
+        policies[REPORT_LOCATION].threshold) {
+      return false;
+    }
+  }
+  recordReport(REPORT_LOCATION, reason, latitude, longitude);
+  return true;
+}
+
+// Check whether a battery reading should be reported
+bool reportBatteryDue(int percentage) {
+  const ChannelState& state = channels[REPORT_BATTERY];
+  return evaluate(REPORT_BATTERY, fabs(percentage - state.lastValue[0]), false, percentage, 0);
+}
+
+// Check whether a signal reading should be reported; a switch between WiFi and GPRS always counts
+bool reportSignalDue(uint8_t mode, int strength) {
+  const ChannelState& state = channels[REPORT_SIGNAL];
+  bool modeChanged = state.reported && state.lastValue[1] != mode;
+  return evaluate(REPORT_SIGNAL, fabs(strength - state.lastValue[0]), modeChanged, strength, mode);
+}
+
+// Log how many reports each channel sent and why
+void reportPolicyLogStats() {
+  for (int c = 0; c < REPORT_CHANNEL_COUNT; c++) {
+    const ChannelState& state = channels[c];
+    logInfo("REPORT", String(channelNames[c]) + ": " + String(state.reports[REASON_CHANGE]) + " on change, " +
+            String(state.reports[REASON_HEARTBEAT]) + " heartbeat, " + String(state.reports[REASON_EMERGENCY]) +
+            " emergency");
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef REPORT_POLICY_H
+#define REPORT_POLICY_H
+
+#include <Arduino.h>
+
+// Decides which periodic readings are worth uploading. Each channel reports when its
+// value moved by at least `threshold`, but never more often than `minInterval`, and at
+// least every `maxInterval` as a heartbeat so the server knows the device is alive.
+// While an emergency is active `emergencyInterval` (if set) replaces all of that with a
+// fixed cadence. Policies are kept in NVS and can be replaced from the server.
+
+// Report channels
+enum ReportChannel {
+  REPORT_LOCATION,     // threshold in metres
+  REPORT_BATTERY,      // threshold in percentage points
+  REPORT_SIGNAL,       // threshold in RSSI dB (WiFi) or CSQ steps (GPRS)
+  REPORT_CHANNEL_COUNT
+};
+
+// Policy for one channel; intervals in seconds
+struct ReportPolicy {
+  uint32_t minInterval;
+  uint32_t maxInterval;
+  float threshold;
+  uint32_t emergencyInterval;   // 0 = no emergency override
+};
+
+// Defaults
+#define REPORT_LOCATION_DEFAULT { 60, 900, 50.0f, 30 }
+#define REPORT_BATTERY_DEFAULT { 60, 3600, 5.0f, 0 }
+#define REPORT_SIGNAL_DEFAULT { 60, 3600, 6.0f, 0 }
+
+// Limits accepted from the server
+#define REPORT_MIN_INTERVAL_FLOOR 10        // Seconds
+#define REPORT_MAX_INTERVAL_CEILING 86400
+#define REPORT_MAX_THRESHOLD 100000.0f
+
+// Functions
+void reportPolicyInit();
+bool reportPolicyValid(const ReportPolicy& policy);
+bool reportPolicySet(ReportChannel channel, const ReportPolicy& policy);
+ReportPolicy reportPolicyGet(ReportChannel channel);
+const char* reportChannelName(ReportChannel channel);
+bool reportLocationDue(float latitude, float longitude);
+bool reportBatteryDue(int percentage);
+bool reportSignalDue(uint8_t mode, int strength);
+void reportPolicyLogStats();
+
+#endif // REPORT_POLICY_H
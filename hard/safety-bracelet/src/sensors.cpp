@@ -1,7 +1,10 @@
 #include "sensors.h"
 #include "utils.h"
 #include "storage.h"
-#include "api.h"  // Added to get access to sendNotification function
+#include "network_task.h"  // Notifications are queued for the network task
+#include "telemetry.h"
+#include "journal.h"
+#include "assets.h"
 
 // Hardware instances
 static Adafruit_MPU6050 mpu;
@@ -18,6 +21,7 @@ static bool calibrationComplete = false;
 static float baselineAccel[3] = {0, 0, 0};
 static float baselineVariance[3] = {0, 0, 0};
 static float dynamicFallThreshold = 2.0;
+static FallCalibration storedCalibration;
 static sensors_event_t accel, gyro, temp;
 
 // GPS data
@@ -28,6 +32,71 @@ static bool gpsValid = false;
 // Battery data
 static int batteryPercentage = 100;
 static bool batteryAlertSent = false;
+static BatteryCalibration batteryCalibration = BATTERY_CALIBRATION_DEFAULT;
+
+// Load the fall calibration record, upgrading older layouts
+// Version 0 is the per-key layout used before records; it is moved into the record once
+static bool loadFallCalibration(FallCalibration* calibration) {
+  switch (loadRecord(FALL_CALIBRATION_KEY, calibration, sizeof(*calibration))) {
+    case FALL_CALIBRATION_VERSION:
+      return true;
+    case 0:
+      if (!loadBool("cal_complete", false)) {
+        return false;
+      }
+      calibration->threshold = loadFloat("fall_thresh", 2.0);
+      calibration->baseline[0] = loadFloat("base_x", 0);
+      calibration->baseline[1] = loadFloat("base_y", 0);
+      calibration->baseline[2] = loadFloat("base_z", 0);
+      calibration->variance[0] = loadFloat("var_x", 0);
+      calibration->variance[1] = loadFloat("var_y", 0);
+      calibration->variance[2] = loadFloat("var_z", 0);
+      if (saveRecord(FALL_CALIBRATION_KEY, FALL_CALIBRATION_VERSION, calibration, sizeof(*calibration))) {
+        static const char* const legacyKeys[] = {
+          "fall_thresh", "base_x", "base_y", "base_z", "var_x", "var_y", "var_z", "cal_complete"
+        };
+        for (const char* key : legacyKeys) {
+          removeKey(key);
+        }
+        logInfo("SENSORS", "Fall calibration moved to a single record");
+      }
+      return true;
+    default:
+      logWarning("SENSORS", "Unknown fall calibration version, calibrating again");
+      return false;
+  }
+}
+
+// Load the battery calibration record, upgrading older layouts
+static void loadBatteryCalibration() {
+  switch (loadRecord(BATTERY_CALIBRATION_KEY, &batteryCalibration, sizeof(batteryCalibration))) {
+    case BATTERY_CALIBRATION_VERSION:
+      return;
+    case 0: {
+      // Per-key layout, or nothing stored yet: the defaults apply to missing keys
+      BatteryCalibration defaults = BATTERY_CALIBRATION_DEFAULT;
+      batteryCalibration.adcFactor = loadFloat("batt_cal", defaults.adcFactor);
+      batteryCalibration.minVoltage = loadFloat("batt_min", defaults.minVoltage);
+      batteryCalibration.maxVoltage = loadFloat("batt_max", defaults.maxVoltage);
+      batteryCalibration.dividerRatio = loadFloat("volt_div", defaults.dividerRatio);
+      batteryCalibration.offset = loadFloat("volt_offset", defaults.offset);
+      if (saveRecord(BATTERY_CALIBRATION_KEY, BATTERY_CALIBRATION_VERSION, &batteryCalibration,
+                     sizeof(batteryCalibration))) {
+        static const char* const legacyKeys[] = { "batt_cal", "batt_min", "batt_max", "volt_div", "volt_offset" };
+        for (const char* key : legacyKeys) {
+          removeKey(key);
+        }
+      }
+      return;
+    }
+    default: {
+      logWarning("SENSORS", "Unknown battery calibration version, using defaults");
+      BatteryCalibration defaults = BATTERY_CALIBRATION_DEFAULT;
+      batteryCalibration = defaults;
+      return;
+    }
+  }
+}
 
 // Initialize all sensors
 void sensorsInit() {
@@ -50,7 +119,8 @@ void sensorsInit() {
   logInfo("SENSORS", "GPS initialized");
   
   // Get calibration status
-  calibrationComplete = loadBool("cal_complete", false);
+  calibrationComplete = loadFallCalibration(&storedCalibration);
+  loadBatteryCalibration();
 }
 
 // Run calibration for fall detection
@@ -114,26 +184,18 @@ void calibrateFallDetection() {
   logInfo("SENSORS", "Calibration complete. Dynamic threshold: " + String(dynamicFallThreshold));
   calibrationComplete = true;
   
-  // Save calibration to storage
-  saveFloat("fall_thresh", dynamicFallThreshold);
-  saveFloat("base_x", baselineAccel[0]);
-  saveFloat("base_y", baselineAccel[1]);
-  saveFloat("base_z", baselineAccel[2]);
-  saveFloat("var_x", baselineVariance[0]);
-  saveFloat("var_y", baselineVariance[1]);
-  saveFloat("var_z", baselineVariance[2]);
-  saveBool("cal_complete", true);
+  // Save calibration to storage in one write
+  storedCalibration.threshold = dynamicFallThreshold;
+  memcpy(storedCalibration.baseline, baselineAccel, sizeof(baselineAccel));
+  memcpy(storedCalibration.variance, baselineVariance, sizeof(baselineVariance));
+  saveRecord(FALL_CALIBRATION_KEY, FALL_CALIBRATION_VERSION, &storedCalibration, sizeof(storedCalibration));
 }
 
-// Load calibration data from storage
+// Apply the calibration read from storage by sensorsInit()
 void loadCalibrationData() {
-  dynamicFallThreshold = loadFloat("fall_thresh", 2.0);
-  baselineAccel[0] = loadFloat("base_x", 0);
-  baselineAccel[1] = loadFloat("base_y", 0);
-  baselineAccel[2] = loadFloat("base_z", 0);
-  baselineVariance[0] = loadFloat("var_x", 0);
-  baselineVariance[1] = loadFloat("var_y", 0);
-  baselineVariance[2] = loadFloat("var_z", 0);
+  dynamicFallThreshold = storedCalibration.threshold;
+  memcpy(baselineAccel, storedCalibration.baseline, sizeof(baselineAccel));
+  memcpy(baselineVariance, storedCalibration.variance, sizeof(baselineVariance));
   
   logInfo("SENSORS", "Loaded fall threshold: " + String(dynamicFallThreshold));
 }
@@ -189,7 +251,7 @@ void checkMPU() {
   if (!freeFallDetected && accelMagnitude < 0.4 * SENSORS_GRAVITY_STANDARD) {
     freeFallDetected = true;
     freeFallTime = millis();
-    logInfo("SENSORS", "Free fall detected: " + String(accelMagnitude));
+    LOGI("SENSORS", "Free fall detected: %.2f", accelMagnitude);
   }
   
   // STEP 2: Detect impact after free fall
@@ -200,7 +262,7 @@ void checkMPU() {
     impactDetected = true;
     impactTime = millis();
     impactPeakMagnitude = accelMagnitude;
-    logInfo("SENSORS", "Impact detected after free fall: " + String(accelMagnitude));
+    LOGI("SENSORS", "Impact detected after free fall: %.2f", accelMagnitude);
   }
   
   // STEP 3: Track peak impact
@@ -217,7 +279,7 @@ void checkMPU() {
     float orientationChange = abs(currentOrientation - previousOrientation);
     if (orientationChange > 30.0) {
       orientationChanged = true;
-      logInfo("SENSORS", "Orientation change detected: " + String(orientationChange));
+      LOGI("SENSORS", "Orientation change detected: %.2f", orientationChange);
     }
   }
   
@@ -229,13 +291,14 @@ void checkMPU() {
       if (freeFallDetected && orientationChanged && 
           impactPeakMagnitude > (dynamicFallThreshold * SENSORS_GRAVITY_STANDARD)) {
         
-        logInfo("SENSORS", "Fall confirmed! Person is likely unconscious or immobile. Impact: " + 
-                String(impactPeakMagnitude) + ", Movement: " + String(currentMovement));
+        LOGI("SENSORS", "Fall confirmed! Person is likely unconscious or immobile. Impact: %.2f, Movement: %.2f",
+             impactPeakMagnitude, currentMovement);
         
-        // Save fall event to storage with severity level
+        // Record the fall in the journal with its severity level
         float severity = min(10.0f, impactPeakMagnitude / SENSORS_GRAVITY_STANDARD);
         String eventData = "FALL:SEV:" + String(severity, 1);
-        saveEmergencyEvent(eventData.c_str(), millis());
+        journalAppend(JOURNAL_FALL, (uint8_t)(severity * 10), eventData.c_str());
+        telemetryAddEvent("FALL", eventData.c_str(), TELEMETRY_PRIORITY_EMERGENCY);
         
         // Set fall detected flag to trigger emergency protocol
         fallDetected = true;
@@ -315,6 +378,29 @@ float getLongitude() {
   return longitude;
 }
 
+// Point of the "soc_curve" table asset; points are sorted by voltage
+struct SocCurvePoint {
+  uint16_t millivolts;
+  uint16_t percentage;
+};
+
+// Interpolate the state of charge between the two curve points around a voltage
+static int socFromCurve(const SocCurvePoint* curve, uint32_t count, float voltage) {
+  float millivolts = voltage * 1000;
+  if (millivolts <= curve[0].millivolts) {
+    return curve[0].percentage;
+  }
+  for (uint32_t i = 1; i < count; i++) {
+    if (millivolts <= curve[i].millivolts) {
+      const SocCurvePoint& low = curve[i - 1];
+      const SocCurvePoint& high = curve[i];
+      float fraction = (millivolts - low.millivolts) / (float)max(1, high.millivolts - low.millivolts);
+      return low.percentage + fraction * (high.percentage - low.percentage);
+    }
+  }
+  return curve[count - 1].percentage;
+}
+
 // Get battery percentage
 int getBatteryPercentage() {
   return batteryPercentage;
@@ -331,10 +417,10 @@ void updateBatteryLevel() {
   
   int rawAverage = rawTotal / BATTERY_SAMPLES;
   
-  // Load calibration constants (allow for calibration adjustment)
-  static float voltageCalibration = loadFloat("batt_cal", 1.0);
-  static float minVoltage = loadFloat("batt_min", 3.3);
-  static float maxVoltage = loadFloat("batt_max", 4.2);
+  // Calibration constants, loaded once by sensorsInit()
+  float voltageCalibration = batteryCalibration.adcFactor;
+  float minVoltage = batteryCalibration.minVoltage;
+  float& maxVoltage = batteryCalibration.maxVoltage;
   
   // Convert to voltage with calibration factor
   float voltage = (rawAverage * 3.3 / 4095.0) * voltageCalibration;
@@ -343,18 +429,24 @@ void updateBatteryLevel() {
   // To calculate the real battery voltage using the resistors:
   // The voltage divider factor is 100k/(100k+150k) = 0.4
   // So the multiplier to convert from measured voltage to actual battery voltage is 1/0.4 = 2.5
-  static float voltageDividerRatio = loadFloat("volt_div", 2.5); // Factor: 1/(100k/(100k+150k)) = 2.5
+  float voltageDividerRatio = batteryCalibration.dividerRatio; // Factor: 1/(100k/(100k+150k)) = 2.5
   float batteryVoltage = voltage * voltageDividerRatio;
   
   // Add TP4056 specific offset if needed - the TP4056 might have voltage drop
-  static float voltageOffset = loadFloat("volt_offset", 0.0);
+  float voltageOffset = batteryCalibration.offset;
   batteryVoltage += voltageOffset;
   
   // Use a non-linear mapping for Li-ion batteries
   // Li-ion discharge is not linear, this curve better approximates real discharge behavior
   int percentage;
   
-  if (batteryVoltage >= maxVoltage) {
+  // A discharge curve measured for the cell, if the asset bundle has one, replaces the mapping below
+  uint32_t curvePoints;
+  const SocCurvePoint* curve = (const SocCurvePoint*)assetTable("soc_curve", sizeof(SocCurvePoint), &curvePoints);
+  
+  if (curve != NULL && curvePoints >= 2) {
+    percentage = socFromCurve(curve, curvePoints, batteryVoltage);
+  } else if (batteryVoltage >= maxVoltage) {
     percentage = 100;
   } else if (batteryVoltage <= minVoltage) {
     percentage = 0;
@@ -404,12 +496,12 @@ void updateBatteryLevel() {
   if (batteryPercentage <= 10 && !batteryAlertSent) {
     logWarning("SENSORS", "CRITICAL battery warning: " + String(batteryPercentage) + "%");
     String criticalMsg = "Battery level critical at " + String(batteryPercentage) + "%, please charge immediately!";
-    sendNotification("Critical Battery", criticalMsg.c_str(), 3);
+    networkSendNotification("Critical Battery", criticalMsg.c_str(), 3, NET_CLASS_ALERT);
     batteryAlertSent = true;
   } else if (batteryPercentage <= BATTERY_LOW_THRESHOLD && !batteryAlertSent) {
     logWarning("SENSORS", "Low battery warning: " + String(batteryPercentage) + "%");
     String lowBattMsg = "Battery level is at " + String(batteryPercentage) + "%";
-    sendNotification("Low Battery", lowBattMsg.c_str(), 2);
+    networkSendNotification("Low Battery", lowBattMsg.c_str(), 2, NET_CLASS_ALERT);
     batteryAlertSent = true;
   } else if (batteryPercentage > BATTERY_LOW_THRESHOLD + 10) {
     // Reset alert flag when battery level improves significantly
@@ -426,7 +518,7 @@ void updateBatteryLevel() {
     // If we just stopped charging and voltage is high, assume we're at max charge
     // Update the calibration
     maxVoltage = batteryVoltage;
-    saveFloat("batt_max", maxVoltage);
+    saveRecord(BATTERY_CALIBRATION_KEY, BATTERY_CALIBRATION_VERSION, &batteryCalibration, sizeof(batteryCalibration));
     logInfo("SENSORS", "Battery calibration updated - new max voltage: " + String(maxVoltage, 3) + "V");
   }
   
@@ -9,19 +9,41 @@
 // GPS settings
 #define GPS_RX 16
 #define GPS_TX 17
-#define GPS_SEND_INTERVAL 900000  // 15 minutes
 
 // Battery monitoring
 #define BATTERY_PIN 34
 #define BATTERY_LOW_THRESHOLD 30
 #define BATTERY_SAMPLES 10
-#define BATTERY_SEND_INTERVAL 60000  // 1 minute
 
 // Fall detection
 #define CALIBRATION_SAMPLES 500
 #define CALIBRATION_THRESHOLD_MULTIPLIER 3.0
 #define FALL_CONFIRMATION_DELAY 2000
 
+// Calibration records (storage.h); bump the version when a layout changes and upgrade
+// the older version in the loader
+#define FALL_CALIBRATION_KEY "fall_cal"
+#define FALL_CALIBRATION_VERSION 1
+#define BATTERY_CALIBRATION_KEY "batt_cal_rec"
+#define BATTERY_CALIBRATION_VERSION 1
+#define BATTERY_CALIBRATION_DEFAULT { 1.0f, 3.3f, 4.2f, 2.5f, 0.0f }
+
+// Fall detection baseline from calibrateFallDetection()
+struct FallCalibration {
+  float threshold;
+  float baseline[3];
+  float variance[3];
+};
+
+// Battery voltage conversion; maxVoltage is learned while charging
+struct BatteryCalibration {
+  float adcFactor;          // Correction of the ADC reading
+  float minVoltage;
+  float maxVoltage;
+  float dividerRatio;       // 1/(100k/(100k+150k)) = 2.5 for the TP4056 divider
+  float offset;             // Added after the divider, for the TP4056 voltage drop
+};
+
 // Functions
 void sensorsInit();
 void calibrateFallDetection();
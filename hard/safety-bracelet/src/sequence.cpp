@@ -0,0 +1,51 @@
+#include "sequence.h"
+#include "utils.h"
+#include "storage.h"
+
+// Next number to hand out and the end of the block reserved in NVS
+static uint32_t nextSeq = 1;
+static uint32_t reservedEnd = 1;
+static SemaphoreHandle_t sequenceMutex = NULL;
+
+static char deviceId[SEQUENCE_DEVICE_ID_LENGTH] = "000000000000";
+
+// Load the sequence and reserve the first block of this boot
+void sequenceInit() {
+  sequenceMutex = xSemaphoreCreateMutex();
+
+  uint64_t mac = ESP.getEfuseMac();
+  snprintf(deviceId, sizeof(deviceId), "%04X%08X", (uint16_t)(mac >> 32), (uint32_t)mac);
+
+  // Everything below the stored mark may have been used before the last reset
+  nextSeq = loadULong("seq_next", 1);
+  reservedEnd = nextSeq + SEQUENCE_BLOCK_SIZE;
+  saveULong("seq_next", reservedEnd);
+
+  logInfo("SEQUENCE", "Device " + String(deviceId) + ", next upload sequence " + String(nextSeq));
+}
+
+// Take the next sequence number (main loop and network task)
+uint32_t sequenceNext() {
+  xSemaphoreTake(sequenceMutex, portMAX_DELAY);
+  if (nextSeq == reservedEnd) {
+    reservedEnd += SEQUENCE_BLOCK_SIZE;
+    saveULong("seq_next", reservedEnd);
+  }
+  uint32_t seq = nextSeq++;
+  xSemaphoreGive(sequenceMutex);
+  return seq;
+}
+
+// Device ID, unique per chip
+const char* sequenceDeviceId() {
+  return deviceId;
+}
+
+// Write the idempotency key for one record, or for a batch running from firstSeq to lastSeq
+void sequenceFormatKey(char* key, size_t capacity, uint32_t firstSeq, uint32_t lastSeq) {
+  if (lastSeq != 0 && lastSeq != firstSeq) {
+    snprintf(key, capacity, "%s-%lu-%lu", deviceId, (unsigned long)firstSeq, (unsigned long)lastSeq);
+  } else {
+    snprintf(key, capacity, "%s-%lu", deviceId, (unsigned long)firstSeq);
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <Arduino.h>
+
+// Upload sequence numbers. Every record the device produces (telemetry sample, location
+// fix, battery reading, notification) takes the next number once, when it is created, and
+// keeps it through failed sends, the outbox and replays. Together with the device ID
+// (from the efuse MAC) it forms an idempotency key, so the server can drop duplicates
+// however often a record is sent.
+// Numbers are reserved in NVS in blocks, so they keep increasing across reboots without
+// a flash write per record; a reset skips the rest of the current block.
+
+// Sequence settings
+#define SEQUENCE_BLOCK_SIZE 64
+#define SEQUENCE_DEVICE_ID_LENGTH 13        // 12 hex digits
+#define SEQUENCE_KEY_LENGTH 40              // "<deviceId>-<seq>[-<lastSeq>]"
+
+// Functions
+void sequenceInit();
+uint32_t sequenceNext();
+const char* sequenceDeviceId();
+void sequenceFormatKey(char* key, size_t capacity, uint32_t firstSeq, uint32_t lastSeq = 0);
+
+#endif // SEQUENCE_H
@@ -1,5 +1,6 @@
 #include "storage.h"
 #include "utils.h"
+#include <esp32/rom/crc.h>
 
 // Preferences instance
 static Preferences preferences;
@@ -52,39 +53,27 @@ String loadUserId() {
   return userId;
 }
 
-// Save emergency event
-bool saveEmergencyEvent(const char* type, unsigned long timestamp) {
-  if (!preferencesInitialized) {
-    logError("STORAGE", "Storage not initialized, cannot save emergency event");
-    return false;
-  }
-  
-  bool success = true;
-  success &= preferences.putString("emg_type", type) > 0;
-  success &= preferences.putULong("emg_time", timestamp) > 0;
-  
-  if (success) {
-    logInfo("STORAGE", "Saved emergency event: " + String(type) + " at " + String(timestamp));
-  } else {
-    logError("STORAGE", "Failed to save emergency event");
-  }
-  
-  return success;
-}
-
-// Get last emergency event
+// Get the last emergency event written by firmware before the event journal
 bool getLastEmergencyEvent(char* type, unsigned long* timestamp) {
   if (!preferencesInitialized) {
     logError("STORAGE", "Storage not initialized, cannot load emergency event");
     return false;
   }
   
-  String emgType = preferences.getString("emg_type", "");
-  *timestamp = preferences.getULong("emg_time", 0);
+  StoredEmergencyEvent event;
+  if (loadRecord("emg_event", &event, sizeof(event)) != STORAGE_EMERGENCY_EVENT_VERSION) {
+    // Written by older firmware as two keys
+    String emgType = preferences.getString("emg_type", "");
+    strncpy(event.type, emgType.c_str(), sizeof(event.type) - 1);
+    event.type[sizeof(event.type) - 1] = '\0';
+    event.timestamp = preferences.getULong("emg_time", 0);
+  }
+  event.type[sizeof(event.type) - 1] = '\0';
+  *timestamp = event.timestamp;
   
-  if (emgType.length() > 0 && *timestamp > 0) {
-    strcpy(type, emgType.c_str());
-    logInfo("STORAGE", "Loaded emergency event: " + emgType + " at " + String(*timestamp));
+  if (event.type[0] != '\0' && *timestamp > 0) {
+    strcpy(type, event.type);
+    logInfo("STORAGE", "Loaded emergency event: " + String(event.type) + " at " + String(*timestamp));
     return true;
   } else {
     logInfo("STORAGE", "No stored emergency event found");
@@ -101,7 +90,7 @@ bool saveBool(const char* key, bool value) {
   
   bool success = preferences.putBool(key, value);
   if (success) {
-    logInfo("STORAGE", "Saved bool " + String(key) + ": " + String(value));
+    LOGD("STORAGE", "Saved bool %s: %d", key, value);
   } else {
     logError("STORAGE", "Failed to save bool " + String(key));
   }
@@ -117,7 +106,7 @@ bool loadBool(const char* key, bool defaultValue) {
   }
   
   bool value = preferences.getBool(key, defaultValue);
-  logInfo("STORAGE", "Loaded bool " + String(key) + ": " + String(value));
+  LOGD("STORAGE", "Loaded bool %s: %d", key, value);
   return value;
 }
 
@@ -130,7 +119,7 @@ bool saveFloat(const char* key, float value) {
   
   bool success = preferences.putFloat(key, value);
   if (success) {
-    logInfo("STORAGE", "Saved float " + String(key) + ": " + String(value));
+    LOGD("STORAGE", "Saved float %s: %.2f", key, value);
   } else {
     logError("STORAGE", "Failed to save float " + String(key));
   }
@@ -146,7 +135,7 @@ float loadFloat(const char* key, float defaultValue) {
   }
   
   float value = preferences.getFloat(key, defaultValue);
-  logInfo("STORAGE", "Loaded float " + String(key) + ": " + String(value));
+  LOGD("STORAGE", "Loaded float %s: %.2f", key, value);
   return value;
 }
 
@@ -159,7 +148,7 @@ bool saveString(const char* key, const String& value) {
   
   size_t written = preferences.putString(key, value);
   if (written > 0) {
-    logInfo("STORAGE", "Saved string " + String(key) + ": " + value);
+    LOGD("STORAGE", "Saved string %s: %s", key, value);
     return true;
   } else {
     logError("STORAGE", "Failed to save string " + String(key));
@@ -175,7 +164,7 @@ String loadString(const char* key, const String& defaultValue) {
   }
   
   String value = preferences.getString(key, defaultValue);
-  logInfo("STORAGE", "Loaded string " + String(key) + ": " + value);
+  LOGD("STORAGE", "Loaded string %s: %s", key, value);
   return value;
 }
 
@@ -188,7 +177,7 @@ bool saveInt(const char* key, int value) {
   
   bool success = preferences.putInt(key, value);
   if (success) {
-    logInfo("STORAGE", "Saved int " + String(key) + ": " + String(value));
+    LOGD("STORAGE", "Saved int %s: %d", key, value);
   } else {
     logError("STORAGE", "Failed to save int " + String(key));
   }
@@ -204,7 +193,7 @@ int loadInt(const char* key, int defaultValue) {
   }
   
   int value = preferences.getInt(key, defaultValue);
-  logInfo("STORAGE", "Loaded int " + String(key) + ": " + String(value));
+  LOGD("STORAGE", "Loaded int %s: %d", key, value);
   return value;
 }
 
@@ -217,7 +206,7 @@ bool saveULong(const char* key, unsigned long value) {
   
   bool success = preferences.putULong(key, value);
   if (success) {
-    logInfo("STORAGE", "Saved ulong " + String(key) + ": " + String(value));
+    LOGD("STORAGE", "Saved ulong %s: %lu", key, value);
   } else {
     logError("STORAGE", "Failed to save ulong " + String(key));
   }
@@ -233,6 +222,122 @@ unsigned long loadULong(const char* key, unsigned long defaultValue) {
   }
   
   unsigned long value = preferences.getULong(key, defaultValue);
-  logInfo("STORAGE", "Loaded ulong " + String(key) + ": " + String(value));
+  LOGD("STORAGE", "Loaded ulong %s: %lu", key, value);
   return value;
 }
+
+// Save a binary blob
+bool saveBytes(const char* key, const void* data, size_t length) {
+  if (!preferencesInitialized) {
+    logError("STORAGE", "Storage not initialized, cannot save bytes");
+    return false;
+  }
+  
+  size_t written = preferences.putBytes(key, data, length);
+  if (written == length) {
+    LOGD("STORAGE", "Saved %u bytes to %s", length, key);
+    return true;
+  } else {
+    logError("STORAGE", "Failed to save bytes " + String(key));
+    return false;
+  }
+}
+
+// Load a binary blob into buffer; returns the stored length, or 0 if missing or too large
+size_t loadBytes(const char* key, void* buffer, size_t capacity) {
+  if (!preferencesInitialized) {
+    logError("STORAGE", "Storage not initialized, cannot load bytes");
+    return 0;
+  }
+  
+  size_t length = preferences.getBytesLength(key);
+  if (length == 0 || length > capacity) {
+    return 0;
+  }
+  
+  length = preferences.getBytes(key, buffer, length);
+  LOGD("STORAGE", "Loaded %u bytes from %s", length, key);
+  return length;
+}
+
+// Remove a stored key
+bool removeKey(const char* key) {
+  if (!preferencesInitialized) {
+    logError("STORAGE", "Storage not initialized, cannot remove key");
+    return false;
+  }
+  
+  bool success = preferences.remove(key);
+  if (success) {
+    LOGD("STORAGE", "Removed %s", key);
+  }
+  return success;
+}
+
+// CRC of a record: header with the crc field cleared, then the payload
+static uint32_t recordCrc(StorageRecordHeader header, const uint8_t* payload) {
+  header.crc = 0;
+  uint32_t crc = crc32_le(0, (const uint8_t*)&header, sizeof(header));
+  return crc32_le(crc, payload, header.length);
+}
+
+// Save a struct as a versioned record with one NVS write
+bool saveRecord(const char* key, uint16_t version, const void* data, size_t length) {
+  if (!preferencesInitialized) {
+    logError("STORAGE", "Storage not initialized, cannot save record");
+    return false;
+  }
+  if (version == 0 || length > STORAGE_RECORD_MAX_SIZE) {
+    logError("STORAGE", "Invalid record " + String(key));
+    return false;
+  }
+  
+  uint8_t blob[sizeof(StorageRecordHeader) + STORAGE_RECORD_MAX_SIZE];
+  StorageRecordHeader header = { STORAGE_RECORD_MAGIC, version, (uint16_t)length, 0, 0 };
+  memcpy(blob + sizeof(header), data, length);
+  header.crc = recordCrc(header, blob + sizeof(header));
+  memcpy(blob, &header, sizeof(header));
+  
+  size_t written = preferences.putBytes(key, blob, sizeof(header) + length);
+  if (written == sizeof(header) + length) {
+    LOGD("STORAGE", "Saved record %s v%u (%u bytes)", key, version, length);
+    return true;
+  } else {
+    logError("STORAGE", "Failed to save record " + String(key));
+    return false;
+  }
+}
+
+// Load a versioned record into buffer with one NVS read
+// Returns the stored version, or 0 if the record is missing or damaged. Payloads longer
+// than capacity are cut off, shorter ones are padded with zeros; length gets the stored size.
+uint16_t loadRecord(const char* key, void* buffer, size_t capacity, size_t* length) {
+  if (!preferencesInitialized) {
+    logError("STORAGE", "Storage not initialized, cannot load record");
+    return 0;
+  }
+  
+  size_t stored = preferences.getBytesLength(key);
+  if (stored < sizeof(StorageRecordHeader) || stored > sizeof(StorageRecordHeader) + STORAGE_RECORD_MAX_SIZE) {
+    return 0;
+  }
+  
+  uint8_t blob[sizeof(StorageRecordHeader) + STORAGE_RECORD_MAX_SIZE];
+  StorageRecordHeader header;
+  stored = preferences.getBytes(key, blob, stored);
+  memcpy(&header, blob, sizeof(header));
+  if (header.magic != STORAGE_RECORD_MAGIC || header.version == 0 ||
+      sizeof(header) + header.length != stored || header.crc != recordCrc(header, blob + sizeof(header))) {
+    logWarning("STORAGE", "Record " + String(key) + " is damaged, ignoring it");
+    return 0;
+  }
+  
+  size_t copied = min((size_t)header.length, capacity);
+  memcpy(buffer, blob + sizeof(header), copied);
+  memset((uint8_t*)buffer + copied, 0, capacity - copied);
+  if (length != NULL) {
+    *length = header.length;
+  }
+  LOGD("STORAGE", "Loaded record %s v%u (%u bytes)", key, header.version, header.length);
+  return header.version;
+}
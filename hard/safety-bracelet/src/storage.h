@@ -4,12 +4,34 @@
 #include <Arduino.h>
 #include <Preferences.h>
 
+// Versioned records: a struct stored as one NVS blob behind a header with its layout
+// version and a CRC32. The struct is read and written in one operation, so a reset in
+// the middle of a save leaves the old record or the new one, never a mix.
+// Callers upgrade older versions themselves; version 0 means nothing usable is stored.
+#define STORAGE_RECORD_MAGIC 0x5242          // "BR"
+#define STORAGE_RECORD_MAX_SIZE 256          // Payload bytes
+#define STORAGE_EMERGENCY_EVENT_VERSION 1
+#define STORAGE_EMERGENCY_TYPE_LENGTH 32
+
+struct StorageRecordHeader {
+  uint16_t magic;
+  uint16_t version;
+  uint16_t length;      // Payload bytes
+  uint16_t reserved;
+  uint32_t crc;         // CRC32 over the header with crc = 0, then the payload
+};
+
+// Last emergency event as older firmware kept it, read once to move it into the journal
+struct StoredEmergencyEvent {
+  uint32_t timestamp;
+  char type[STORAGE_EMERGENCY_TYPE_LENGTH];
+};
+
 // Storage functions
 void storageInit();
 bool saveUserId(const String& userId);
 String loadUserId();
-bool saveEmergencyEvent(const char* type, unsigned long timestamp);
-bool getLastEmergencyEvent(char* type, unsigned long* timestamp);
+bool getLastEmergencyEvent(char* type, unsigned long* timestamp);   // type holds STORAGE_EMERGENCY_TYPE_LENGTH
 bool saveBool(const char* key, bool value);
 bool loadBool(const char* key, bool defaultValue);
 bool saveFloat(const char* key, float value);
@@ -20,5 +42,10 @@ bool saveInt(const char* key, int value);
 int loadInt(const char* key, int defaultValue);
 bool saveULong(const char* key, unsigned long value);
 unsigned long loadULong(const char* key, unsigned long defaultValue);
+bool saveBytes(const char* key, const void* data, size_t length);
+size_t loadBytes(const char* key, void* buffer, size_t capacity);
+bool removeKey(const char* key);
+bool saveRecord(const char* key, uint16_t version, const void* data, size_t length);
+uint16_t loadRecord(const char* key, void* buffer, size_t capacity, size_t* length = NULL);
 
 #endif // STORAGE_H
@@ -0,0 +1,311 @@
+#include "telemetry.h"
+#include "utils.h"
+#include "api.h"
+#include "network_task.h"
+#include "outbox.h"
+#include "downlink.h"
+#include "wifi_manager.h"
+#include "sequence.h"
+#include "clock_service.h"
+
+// Wait this long after a failed upload before trying the same batch again
+#define TELEMETRY_RETRY_INTERVAL 30000
+
+// Queued samples, oldest first; the first inFlightCount are being uploaded
+static TelemetrySample samples[TELEMETRY_BATCH_CAPACITY];
+static int sampleCount = 0;
+static int inFlightCount = 0;
+static char batchKey[SEQUENCE_KEY_LENGTH];   // Idempotency key of the in-flight batch
+
+// Flush policy
+static TelemetryFlushPolicy flushPolicy = {
+  TELEMETRY_DEFAULT_MAX_SAMPLES,
+  TELEMETRY_DEFAULT_MAX_AGE,
+  TELEMETRY_PRIORITY_LOCATION
+};
+
+static unsigned long lastFailedFlushTime = 0;
+static bool lastFlushFailed = false;
+
+// Initialize telemetry batching
+void telemetryInit() {
+  sampleCount = 0;
+  inFlightCount = 0;
+  lastFlushFailed = false;
+  logInfo("TELEMETRY", "Telemetry batching initialized, capacity " + String(TELEMETRY_BATCH_CAPACITY) + " samples");
+}
+
+// Set the flush policy
+void telemetrySetFlushPolicy(const TelemetryFlushPolicy& policy) {
+  flushPolicy = policy;
+  if (flushPolicy.maxSamples == 0 || flushPolicy.maxSamples > TELEMETRY_BATCH_CAPACITY) {
+    flushPolicy.maxSamples = TELEMETRY_BATCH_CAPACITY;
+  }
+  logInfo("TELEMETRY", "Flush policy: " + String(flushPolicy.maxSamples) + " samples, " +
+          String(flushPolicy.maxAgeMs / 1000) + "s max age, priority >= " + String(flushPolicy.flushPriority));
+}
+
+// Get the flush policy
+TelemetryFlushPolicy telemetryGetFlushPolicy() {
+  return flushPolicy;
+}
+
+// Reserve a slot for a new sample, evicting the oldest sample of the lowest priority when full
+// Samples that are part of an in-flight upload are never evicted, and neither is a sample of
+// higher priority than the new one: then the new sample is dropped instead
+static TelemetrySample* allocateSample(TelemetrySampleType type, int priority) {
+  if (sampleCount >= TELEMETRY_BATCH_CAPACITY) {
+    if (inFlightCount >= sampleCount) {
+      LOGW("TELEMETRY", "Batch full while uploading, dropping new sample of type %d", (int)type);
+      return NULL;
+    }
+    
+    int evict = inFlightCount;
+    for (int i = inFlightCount + 1; i < sampleCount; i++) {
+      if (samples[i].priority < samples[evict].priority) {
+        evict = i;
+      }
+    }
+    if (samples[evict].priority > priority) {
+      LOGW("TELEMETRY", "Batch full of higher priority samples, dropping new sample of type %d", (int)type);
+      return NULL;
+    }
+    LOGW("TELEMETRY", "Batch full, dropping oldest sample of type %d", (int)samples[evict].type);
+    memmove(&samples[evict], &samples[evict + 1], (sampleCount - evict - 1) * sizeof(TelemetrySample));
+    sampleCount--;
+  }
+
+  TelemetrySample* sample = &samples[sampleCount++];
+  memset(sample, 0, sizeof(TelemetrySample));
+  sample->type = type;
+  sample->priority = priority;
+  sample->seq = sequenceNext();
+  sample->timestamp = clockUptimeMs();
+  return sample;
+}
+
+// Queue a GPS location
+bool telemetryAddLocation(float latitude, float longitude) {
+  TelemetrySample* sample = allocateSample(SAMPLE_LOCATION, TELEMETRY_PRIORITY_LOCATION);
+  if (sample == NULL) return false;
+  sample->location.latitude = latitude;
+  sample->location.longitude = longitude;
+  return true;
+}
+
+// Queue a battery reading
+bool telemetryAddBattery(int percentage) {
+  TelemetrySample* sample = allocateSample(SAMPLE_BATTERY, TELEMETRY_PRIORITY_ROUTINE);
+  if (sample == NULL) return false;
+  sample->batteryPercentage = percentage;
+  return true;
+}
+
+// Queue a signal strength reading
+bool telemetryAddSignal(uint8_t mode, int strength) {
+  TelemetrySample* sample = allocateSample(SAMPLE_SIGNAL, TELEMETRY_PRIORITY_ROUTINE);
+  if (sample == NULL) return false;
+  sample->signal.mode = mode;
+  sample->signal.strength = strength;
+  return true;
+}
+
+// Queue a device event (SOS, fall, ...)
+bool telemetryAddEvent(const char* type, const char* message, int priority) {
+  TelemetrySample* sample = allocateSample(SAMPLE_EVENT, constrain(priority, 0, TELEMETRY_PRIORITY_EMERGENCY));
+  if (sample == NULL) return false;
+  strncpy(sample->eventType, type, TELEMETRY_EVENT_TYPE_LENGTH - 1);
+  strncpy(sample->eventMessage, message, TELEMETRY_EVENT_MESSAGE_LENGTH - 1);
+  return true;
+}
+
+// Number of samples waiting for upload
+int telemetryPendingCount() {
+  return sampleCount;
+}
+
+// Move the first count samples to the flash outbox for replay once the link is back
+static void spillToOutbox(int count) {
+  int stored = 0;
+  for (int i = 0; i < count; i++) {
+    if (outboxStoreSample(samples[i])) {
+      stored++;
+    }
+  }
+  memmove(&samples[0], &samples[count], (sampleCount - count) * sizeof(TelemetrySample));
+  sampleCount -= count;
+  LOGI("TELEMETRY", "Moved %d of %d samples to outbox", stored, count);
+}
+
+// Called from the main loop when the network task finished uploading a batch
+static void batchUploadCompleted(NetworkRequestType type, bool success, void* context) {
+  if (success) {
+    // Drop the uploaded samples
+    memmove(&samples[0], &samples[inFlightCount], (sampleCount - inFlightCount) * sizeof(TelemetrySample));
+    sampleCount -= inFlightCount;
+    lastFlushFailed = false;
+    LOGI("TELEMETRY", "Batch of %d samples uploaded", inFlightCount);
+  } else {
+    logError("TELEMETRY", "Batch upload failed, moving samples to outbox");
+    lastFlushFailed = true;
+    lastFailedFlushTime = millis();
+    spillToOutbox(inFlightCount);
+  }
+  inFlightCount = 0;
+}
+
+// Network class for a batch, taken from its most urgent sample
+static NetworkClass batchClass(int highestPriority) {
+  switch (highestPriority) {
+    case TELEMETRY_PRIORITY_EMERGENCY:
+      return NET_CLASS_EMERGENCY;
+    case TELEMETRY_PRIORITY_ALERT:
+      return NET_CLASS_ALERT;
+    case TELEMETRY_PRIORITY_LOCATION:
+      return NET_CLASS_LOCATION;
+    default:
+      return NET_CLASS_HOUSEKEEPING;
+  }
+}
+
+// Write the in-flight samples as one batch body; runs on the network task
+// Sample times are sent as age in ms relative to the upload, since wall time may not be set.
+// The main loop leaves samples below inFlightCount alone until the batch completes.
+static bool encodeBatch(PayloadWriter* writer, const void* context) {
+  int count = inFlightCount;
+  uint64_t now = clockUptimeMs();
+
+  payloadBeginMap(writer, 3);
+  payloadKey(writer, "dev");
+  payloadString(writer, sequenceDeviceId());
+  payloadKey(writer, "cfg_v");
+  payloadUInt(writer, downlinkConfigVersion());
+  payloadKey(writer, "samples");
+  payloadBeginArray(writer, count);
+
+  for (int i = 0; i < count; i++) {
+    const TelemetrySample& sample = samples[i];
+
+    switch (sample.type) {
+      case SAMPLE_LOCATION:
+        payloadBeginMap(writer, 5);
+        payloadKey(writer, "seq");
+        payloadUInt(writer, sample.seq);
+        payloadKey(writer, "age");
+        payloadUInt(writer, now - sample.timestamp);
+        payloadKey(writer, "t");
+        payloadString(writer, "loc");
+        payloadKey(writer, "lat");
+        payloadFloat(writer, sample.location.latitude, 6);
+        payloadKey(writer, "lon");
+        payloadFloat(writer, sample.location.longitude, 6);
+        break;
+      case SAMPLE_BATTERY:
+        payloadBeginMap(writer, 4);
+        payloadKey(writer, "seq");
+        payloadUInt(writer, sample.seq);
+        payloadKey(writer, "age");
+        payloadUInt(writer, now - sample.timestamp);
+        payloadKey(writer, "t");
+        payloadString(writer, "bat");
+        payloadKey(writer, "v");
+        payloadInt(writer, sample.batteryPercentage);
+        break;
+      case SAMPLE_SIGNAL:
+        payloadBeginMap(writer, 5);
+        payloadKey(writer, "seq");
+        payloadUInt(writer, sample.seq);
+        payloadKey(writer, "age");
+        payloadUInt(writer, now - sample.timestamp);
+        payloadKey(writer, "t");
+        payloadString(writer, "sig");
+        payloadKey(writer, "m");
+        payloadString(writer, sample.signal.mode == GPRS_MODE ? "gprs" : "wifi");
+        payloadKey(writer, "v");
+        payloadInt(writer, sample.signal.strength);
+        break;
+      case SAMPLE_EVENT:
+        payloadBeginMap(writer, 6);
+        payloadKey(writer, "seq");
+        payloadUInt(writer, sample.seq);
+        payloadKey(writer, "age");
+        payloadUInt(writer, now - sample.timestamp);
+        payloadKey(writer, "t");
+        payloadString(writer, "evt");
+        payloadKey(writer, "p");
+        payloadInt(writer, sample.priority);
+        payloadKey(writer, "type");
+        payloadString(writer, sample.eventType);
+        payloadKey(writer, "msg");
+        payloadString(writer, sample.eventMessage);
+        break;
+    }
+    payloadEndMap(writer);
+  }
+
+  payloadEndArray(writer);
+  payloadEndMap(writer);
+  return true;
+}
+
+// Hand all queued samples to the network task as one batch
+// The body is encoded on the network task straight into the API transmit buffer
+bool telemetryFlush() {
+  if (sampleCount == 0 || inFlightCount > 0) {
+    return true;
+  }
+
+  int highestPriority = TELEMETRY_PRIORITY_ROUTINE;
+  for (int i = 0; i < sampleCount; i++) {
+    if (samples[i].priority > highestPriority) {
+      highestPriority = samples[i].priority;
+    }
+  }
+
+  LOGI("TELEMETRY", "Queueing batch of %d samples", sampleCount);
+
+  // Mark the samples in flight before the network task can start reading them
+  inFlightCount = sampleCount;
+  sequenceFormatKey(batchKey, sizeof(batchKey), samples[0].seq, samples[inFlightCount - 1].seq);
+  if (!networkSendTelemetryBatch(encodeBatch, NULL, batchKey, batchClass(highestPriority), batchUploadCompleted)) {
+    inFlightCount = 0;
+    lastFlushFailed = true;
+    lastFailedFlushTime = millis();
+    return false;
+  }
+
+  return true;
+}
+
+// Check the flush policy and upload when it says so (call from main loop)
+// While offline, a due batch goes to the flash outbox instead of being held in RAM
+void telemetryProcess() {
+  if (sampleCount == 0 || inFlightCount > 0) {
+    return;
+  }
+
+  bool flushNow = sampleCount >= flushPolicy.maxSamples ||
+                  clockUptimeMs() - samples[0].timestamp >= flushPolicy.maxAgeMs;
+
+  for (int i = 0; i < sampleCount && !flushNow; i++) {
+    if (samples[i].priority >= flushPolicy.flushPriority) {
+      flushNow = true;
+    }
+  }
+
+  if (!flushNow) {
+    return;
+  }
+
+  if (!isNetworkConnected() || !isApiInitialized()) {
+    spillToOutbox(sampleCount);
+    return;
+  }
+
+  // Hold off after a failed upload
+  if (lastFlushFailed && millis() - lastFailedFlushTime < TELEMETRY_RETRY_INTERVAL) {
+    return;
+  }
+
+  telemetryFlush();
+}
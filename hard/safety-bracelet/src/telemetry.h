@@ -0,0 +1,67 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+
+// Batch settings
+#define TELEMETRY_BATCH_CAPACITY 32         // Samples held in RAM between uploads
+#define TELEMETRY_DEFAULT_MAX_SAMPLES 24    // Flush when this many samples are queued
+#define TELEMETRY_DEFAULT_MAX_AGE 900000    // Flush when the oldest sample is 15 minutes old
+#define TELEMETRY_EVENT_TYPE_LENGTH 16
+#define TELEMETRY_EVENT_MESSAGE_LENGTH 48
+
+// Sample priorities (same scale as notification priorities)
+#define TELEMETRY_PRIORITY_ROUTINE 0     // Battery, signal
+#define TELEMETRY_PRIORITY_LOCATION 1    // GPS position
+#define TELEMETRY_PRIORITY_ALERT 2       // Low battery and similar warnings
+#define TELEMETRY_PRIORITY_EMERGENCY 3   // SOS, fall
+
+// Sample types carried in a batch
+enum TelemetrySampleType {
+  SAMPLE_LOCATION,
+  SAMPLE_BATTERY,
+  SAMPLE_SIGNAL,
+  SAMPLE_EVENT
+};
+
+// One queued sample
+struct TelemetrySample {
+  TelemetrySampleType type;
+  uint8_t priority;
+  uint32_t seq;             // Upload sequence number, kept through the outbox
+  uint64_t timestamp;       // clockUptimeMs() when the sample was taken
+  union {
+    struct {
+      float latitude;
+      float longitude;
+    } location;
+    int batteryPercentage;
+    struct {
+      uint8_t mode;   // ConnectionMode at sampling time
+      int strength;   // RSSI in dBm on WiFi, CSQ (0-31) on GPRS
+    } signal;
+  };
+  char eventType[TELEMETRY_EVENT_TYPE_LENGTH];
+  char eventMessage[TELEMETRY_EVENT_MESSAGE_LENGTH];
+};
+
+// When a queued batch gets uploaded
+struct TelemetryFlushPolicy {
+  uint8_t maxSamples;        // Flush once this many samples are queued
+  unsigned long maxAgeMs;    // Flush once the oldest sample is this old
+  uint8_t flushPriority;     // Flush as soon as a sample of at least this priority is queued
+};
+
+// Functions
+void telemetryInit();
+void telemetrySetFlushPolicy(const TelemetryFlushPolicy& policy);
+TelemetryFlushPolicy telemetryGetFlushPolicy();
+bool telemetryAddLocation(float latitude, float longitude);
+bool telemetryAddBattery(int percentage);
+bool telemetryAddSignal(uint8_t mode, int strength);
+bool telemetryAddEvent(const char* type, const char* message, int priority);
+int telemetryPendingCount();
+bool telemetryFlush();
+void telemetryProcess();
+
+#endif // TELEMETRY_H
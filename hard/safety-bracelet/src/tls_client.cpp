@@ -0,0 +1,474 @@
+#include "tls_client.h"
+#include "utils.h"
+#include <sdkconfig.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/error.h>
+#include <mbedtls/version.h>
+
+// The Arduino core ships mbedTLS with the ESP32 AES, SHA and MPI accelerators enabled;
+// without them a full handshake costs several times the CPU time
+#if !defined(CONFIG_MBEDTLS_HARDWARE_AES) || !defined(CONFIG_MBEDTLS_HARDWARE_SHA) || !defined(CONFIG_MBEDTLS_HARDWARE_MPI)
+#warning "mbedTLS is built without ESP32 crypto acceleration, TLS handshakes will be slow"
+#endif
+
+// mbedTLS 3 made the session fields private
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define SESSION_MASTER(session) (session).MBEDTLS_PRIVATE(master)
+#else
+#define SESSION_MASTER(session) (session).master
+#endif
+
+// Suites whose bulk cipher, hash and key exchange all map onto the crypto hardware
+static const int preferredCiphersuites[] = {
+  MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+  MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+  0
+};
+
+// Random generator shared by all connections, seeded from the hardware RNG once
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context drbg;
+static bool randomReady = false;
+
+// Resumable sessions, kept in RAM so they survive reconnects and light sleep (not deep sleep)
+struct SessionEntry {
+  char host[TLS_HOST_LENGTH];
+  uint16_t port;
+  bool valid;
+  unsigned long savedAt;
+  mbedtls_ssl_session session;
+};
+static SessionEntry sessionCache[TLS_SESSION_CACHE_SIZE];
+static bool sessionCacheReady = false;
+
+// Handshake counters, written on the network task and read by the main loop
+static TlsStats tlsStats;
+static portMUX_TYPE tlsStatsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Seed the shared random generator
+static bool seedRandom() {
+  if (randomReady) {
+    return true;
+  }
+
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&drbg);
+  const char* personalization = "safety-bracelet";
+  int result = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                     (const unsigned char*)personalization, strlen(personalization));
+  if (result != 0) {
+    logError("TLS", "Failed to seed random generator: " + String(result));
+    return false;
+  }
+
+  randomReady = true;
+  return true;
+}
+
+// Set up the session cache slots
+static void initSessionCache() {
+  if (sessionCacheReady) {
+    return;
+  }
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    sessionCache[i].valid = false;
+    mbedtls_ssl_session_init(&sessionCache[i].session);
+  }
+  sessionCacheReady = true;
+}
+
+// Drop a cached session
+static void forgetSession(SessionEntry* entry) {
+  mbedtls_ssl_session_free(&entry->session);
+  mbedtls_ssl_session_init(&entry->session);
+  entry->valid = false;
+}
+
+// Find a cached session for host:port that is still young enough to offer
+static SessionEntry* findSession(const char* host, uint16_t port) {
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    SessionEntry* entry = &sessionCache[i];
+    if (!entry->valid || entry->port != port || strcmp(entry->host, host) != 0) {
+      continue;
+    }
+    if (millis() - entry->savedAt > TLS_SESSION_MAX_AGE) {
+      forgetSession(entry);
+      return NULL;
+    }
+    return entry;
+  }
+  return NULL;
+}
+
+// Keep a session for host:port, replacing the same host or else the oldest entry
+// Takes over the session's allocations and leaves *session empty
+static void storeSession(const char* host, uint16_t port, mbedtls_ssl_session* session) {
+  SessionEntry* slot = NULL;
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE && slot == NULL; i++) {
+    if (sessionCache[i].valid && sessionCache[i].port == port && strcmp(sessionCache[i].host, host) == 0) {
+      slot = &sessionCache[i];
+    }
+  }
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE && slot == NULL; i++) {
+    if (!sessionCache[i].valid) {
+      slot = &sessionCache[i];
+    }
+  }
+  if (slot == NULL) {
+    slot = &sessionCache[0];
+    for (int i = 1; i < TLS_SESSION_CACHE_SIZE; i++) {
+      if (sessionCache[i].savedAt < slot->savedAt) {
+        slot = &sessionCache[i];
+      }
+    }
+  }
+
+  mbedtls_ssl_session_free(&slot->session);
+  slot->session = *session;
+  mbedtls_ssl_session_init(session);
+  strncpy(slot->host, host, TLS_HOST_LENGTH - 1);
+  slot->host[TLS_HOST_LENGTH - 1] = '\0';
+  slot->port = port;
+  slot->savedAt = millis();
+  slot->valid = true;
+}
+
+// Count a handshake
+static void recordHandshake(bool success, bool resumed, unsigned long elapsed) {
+  portENTER_CRITICAL(&tlsStatsMux);
+  if (!success) {
+    tlsStats.failedHandshakes++;
+  } else if (resumed) {
+    tlsStats.resumedHandshakes++;
+    tlsStats.resumedHandshakeTime += elapsed;
+  } else {
+    tlsStats.fullHandshakes++;
+    tlsStats.fullHandshakeTime += elapsed;
+  }
+  portEXIT_CRITICAL(&tlsStatsMux);
+}
+
+TlsClient::TlsClient(WiFiClient& transport)
+  : transport(transport), configReady(false), sessionOpen(false),
+    handshakeTimeout(TLS_HANDSHAKE_TIMEOUT), peeked(-1) {
+  mbedtls_ssl_config_init(&config);
+  mbedtls_x509_crt_init(&caChain);
+}
+
+TlsClient::~TlsClient() {
+  stop();
+  mbedtls_ssl_config_free(&config);
+  mbedtls_x509_crt_free(&caChain);
+}
+
+// Trust the given root certificate(s) and prepare the client configuration
+bool TlsClient::setCACert(const char* pem) {
+  configReady = false;
+  if (!seedRandom()) {
+    return false;
+  }
+  initSessionCache();
+
+  mbedtls_x509_crt_free(&caChain);
+  mbedtls_x509_crt_init(&caChain);
+  int result = mbedtls_x509_crt_parse(&caChain, (const unsigned char*)pem, strlen(pem) + 1);
+  if (result != 0) {
+    logError("TLS", "Could not parse CA certificate: " + String(result));
+    return false;
+  }
+
+  mbedtls_ssl_config_free(&config);
+  mbedtls_ssl_config_init(&config);
+  result = mbedtls_ssl_config_defaults(&config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                       MBEDTLS_SSL_PRESET_DEFAULT);
+  if (result != 0) {
+    logError("TLS", "Could not set up TLS configuration: " + String(result));
+    return false;
+  }
+
+  mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_REQUIRED);
+  mbedtls_ssl_conf_ca_chain(&config, &caChain, NULL);
+  mbedtls_ssl_conf_rng(&config, mbedtls_ctr_drbg_random, &drbg);
+#if MBEDTLS_VERSION_NUMBER >= 0x03010000
+  mbedtls_ssl_conf_min_tls_version(&config, MBEDTLS_SSL_VERSION_TLS1_2);
+#else
+  mbedtls_ssl_conf_min_version(&config, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+#endif
+  mbedtls_ssl_conf_ciphersuites(&config, preferredCiphersuites);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+  configReady = true;
+  return true;
+}
+
+// Send encrypted records through the transport
+int TlsClient::sendCallback(void* context, const unsigned char* buffer, size_t length) {
+  WiFiClient* transport = (WiFiClient*)context;
+  if (!transport->connected()) {
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  size_t written = transport->write(buffer, length);
+  return written > 0 ? (int)written : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+// Hand received bytes to mbedTLS without blocking
+int TlsClient::receiveCallback(void* context, unsigned char* buffer, size_t length) {
+  WiFiClient* transport = (WiFiClient*)context;
+  int waiting = transport->available();
+  if (waiting <= 0) {
+    return transport->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int count = transport->read(buffer, min(length, (size_t)waiting));
+  return count > 0 ? count : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+// Run the handshake on the open transport, offering a cached session when there is one
+bool TlsClient::handshake(const char* host, uint16_t port, uint32_t timeoutMs) {
+  mbedtls_ssl_init(&ssl);
+  int result = mbedtls_ssl_setup(&ssl, &config);
+  if (result == 0) {
+    result = mbedtls_ssl_set_hostname(&ssl, host);
+  }
+  if (result != 0) {
+    logError("TLS", "Could not set up TLS context: " + String(result));
+    mbedtls_ssl_free(&ssl);
+    return false;
+  }
+  mbedtls_ssl_set_bio(&ssl, &transport, sendCallback, receiveCallback, NULL);
+
+  SessionEntry* cached = findSession(host, port);
+  bool offered = cached != NULL && mbedtls_ssl_set_session(&ssl, &cached->session) == 0;
+
+  unsigned long start = millis();
+  while ((result = mbedtls_ssl_handshake(&ssl)) != 0) {
+    if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      break;
+    }
+    if (millis() - start > timeoutMs) {
+      result = MBEDTLS_ERR_SSL_TIMEOUT;
+      break;
+    }
+    delay(1);
+  }
+  unsigned long elapsed = millis() - start;
+
+  if (result != 0) {
+    char reason[80];
+    mbedtls_strerror(result, reason, sizeof(reason));
+    logError("TLS", "Handshake with " + String(host) + " failed: " + String(reason));
+    mbedtls_ssl_free(&ssl);
+    recordHandshake(false, false, elapsed);
+    return false;
+  }
+
+  // A resumed session keeps the master secret of the session that was offered
+  mbedtls_ssl_session current;
+  mbedtls_ssl_session_init(&current);
+  bool resumed = false;
+  if (mbedtls_ssl_get_session(&ssl, &current) == 0) {
+    resumed = offered &&
+              memcmp(SESSION_MASTER(current), SESSION_MASTER(cached->session), sizeof(SESSION_MASTER(current))) == 0;
+    storeSession(host, port, &current);
+  }
+  mbedtls_ssl_session_free(&current);
+
+  recordHandshake(true, resumed, elapsed);
+  logInfo("TLS", String(resumed ? "Resumed" : "Full") + " handshake with " + String(host) + " in " +
+          String(elapsed) + "ms, " + String(mbedtls_ssl_get_ciphersuite(&ssl)));
+
+  sessionOpen = true;
+  peeked = -1;
+  return true;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeoutMs) {
+  return connect(ip.toString().c_str(), port, timeoutMs);
+}
+
+// Open the transport with its own connect timeout, then allow handshakeTimeout for the handshake
+int TlsClient::connect(const char* host, uint16_t port) {
+  return open(host, port, -1);
+}
+
+// HTTPClient connects with the request's timeout; the TCP connect and the handshake share it,
+// and the handshake never takes longer than handshakeTimeout
+int TlsClient::connect(const char* host, uint16_t port, int32_t timeoutMs) {
+  return open(host, port, timeoutMs);
+}
+
+// Open the transport and secure it, within timeoutMs overall unless it is negative
+int TlsClient::open(const char* host, uint16_t port, int32_t timeoutMs) {
+  stop();
+  if (!configReady) {
+    logError("TLS", "No CA certificate configured, refusing to connect");
+    return 0;
+  }
+
+  unsigned long start = millis();
+  bool opened = timeoutMs < 0 ? transport.connect(host, port) : transport.connect(host, port, timeoutMs);
+  if (!opened) {
+    logError("TLS", "TCP connect to " + String(host) + ":" + String(port) + " failed");
+    return 0;
+  }
+
+  uint32_t budget = handshakeTimeout;
+  if (timeoutMs >= 0) {
+    uint32_t elapsed = millis() - start;
+    if (elapsed >= (uint32_t)timeoutMs) {
+      logError("TLS", "No time left for the handshake with " + String(host));
+      transport.stop();
+      return 0;
+    }
+    budget = min(budget, (uint32_t)timeoutMs - elapsed);
+  }
+  if (!handshake(host, port, budget)) {
+    transport.stop();
+    return 0;
+  }
+  return 1;
+}
+
+size_t TlsClient::write(uint8_t data) {
+  return write(&data, 1);
+}
+
+// Encrypt and send the whole buffer, waiting for the transport if it is busy
+size_t TlsClient::write(const uint8_t* buffer, size_t size) {
+  if (!sessionOpen) {
+    return 0;
+  }
+
+  size_t sent = 0;
+  unsigned long start = millis();
+  while (sent < size) {
+    int result = mbedtls_ssl_write(&ssl, buffer + sent, size - sent);
+    if (result > 0) {
+      sent += result;
+      continue;
+    }
+    if ((result != MBEDTLS_ERR_SSL_WANT_WRITE && result != MBEDTLS_ERR_SSL_WANT_READ) ||
+        millis() - start > TLS_IO_TIMEOUT) {
+      logError("TLS", "Write failed: " + String(result));
+      stop();
+      break;
+    }
+    delay(1);
+  }
+  return sent;
+}
+
+// Decrypted bytes ready to read, processing any records already received
+int TlsClient::available() {
+  if (!sessionOpen) {
+    return 0;
+  }
+
+  int pending = peeked >= 0 ? 1 : 0;
+  int result = mbedtls_ssl_read(&ssl, NULL, 0);
+  if (result < 0 && result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    // Peer closed or the record was bad; whatever is already decrypted is still readable
+    int buffered = pending + (int)mbedtls_ssl_get_bytes_avail(&ssl);
+    if (buffered == 0) {
+      stop();
+    }
+    return buffered;
+  }
+  return pending + (int)mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsClient::read() {
+  uint8_t data;
+  return read(&data, 1) == 1 ? data : -1;
+}
+
+// Read decrypted bytes; returns -1 when none are available
+int TlsClient::read(uint8_t* buffer, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+
+  int count = 0;
+  if (peeked >= 0) {
+    buffer[count++] = (uint8_t)peeked;
+    peeked = -1;
+    if (size == 1) {
+      return 1;
+    }
+  }
+  if (!sessionOpen) {
+    return count > 0 ? count : -1;
+  }
+
+  int result = mbedtls_ssl_read(&ssl, buffer + count, size - count);
+  if (result > 0) {
+    return count + result;
+  }
+  if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    // Close notify (0 or PEER_CLOSE_NOTIFY) or a fatal error
+    stop();
+  }
+  return count > 0 ? count : -1;
+}
+
+int TlsClient::peek() {
+  if (peeked < 0) {
+    uint8_t data;
+    if (read(&data, 1) == 1) {
+      peeked = data;
+    }
+  }
+  return peeked;
+}
+
+void TlsClient::flush() {
+  transport.flush();
+}
+
+// Close the TLS session and the transport; the resumable session stays cached
+void TlsClient::stop() {
+  if (sessionOpen) {
+    mbedtls_ssl_close_notify(&ssl);
+    mbedtls_ssl_free(&ssl);
+    sessionOpen = false;
+  }
+  peeked = -1;
+  transport.stop();
+}
+
+uint8_t TlsClient::connected() {
+  if (!sessionOpen) {
+    return peeked >= 0;
+  }
+  return transport.connected() || peeked >= 0 || mbedtls_ssl_get_bytes_avail(&ssl) > 0;
+}
+
+// Copy the handshake counters
+void tlsGetStats(TlsStats* stats) {
+  portENTER_CRITICAL(&tlsStatsMux);
+  *stats = tlsStats;
+  portEXIT_CRITICAL(&tlsStatsMux);
+}
+
+// Log full versus resumed handshakes and their average cost
+void tlsLogStats() {
+  TlsStats stats;
+  tlsGetStats(&stats);
+  if (stats.fullHandshakes + stats.resumedHandshakes + stats.failedHandshakes == 0) {
+    return;
+  }
+  logInfo("TLS", String(stats.fullHandshakes) + " full handshakes (avg " +
+          String(stats.fullHandshakes > 0 ? stats.fullHandshakeTime / stats.fullHandshakes : 0) + "ms), " +
+          String(stats.resumedHandshakes) + " resumed (avg " +
+          String(stats.resumedHandshakes > 0 ? stats.resumedHandshakeTime / stats.resumedHandshakes : 0) + "ms), " +
+          String(stats.failedHandshakes) + " failed");
+}
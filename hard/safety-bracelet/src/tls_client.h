@@ -0,0 +1,74 @@
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+// TLS settings
+#define TLS_HANDSHAKE_TIMEOUT 15000         // A full handshake over GPRS takes several seconds
+#define TLS_IO_TIMEOUT 10000                // Give up on a stalled record read or write
+#define TLS_SESSION_CACHE_SIZE 2            // Servers we keep a resumable session for
+#define TLS_SESSION_MAX_AGE 43200000UL      // 12h; servers usually expire tickets after a day
+#define TLS_HOST_LENGTH 64
+
+// Handshake counters since boot
+struct TlsStats {
+  uint32_t fullHandshakes;
+  uint32_t resumedHandshakes;
+  uint32_t failedHandshakes;
+  uint32_t fullHandshakeTime;       // ms, summed over full handshakes
+  uint32_t resumedHandshakeTime;    // ms, summed over resumed handshakes
+};
+
+// TLS 1.2 over another client (WiFi or GPRS), built on the ESP32 mbedTLS port so AES,
+// SHA and the RSA/ECDHE big number maths run on the crypto hardware.
+// Derives from WiFiClient so HTTPClient can use it like a plain socket.
+// The session (ticket or ID) of every handshake is kept in RAM per host and offered on the
+// next connect, so reconnecting after a dropped socket or a light sleep skips the
+// certificate exchange and key agreement.
+class TlsClient : public WiFiClient {
+ public:
+  explicit TlsClient(WiFiClient& transport);
+  ~TlsClient();
+
+  bool setCACert(const char* pem);
+  void setHandshakeTimeout(uint32_t timeoutMs) { handshakeTimeout = timeoutMs; }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port, int32_t timeoutMs) override;
+  int connect(const char* host, uint16_t port) override;
+  int connect(const char* host, uint16_t port, int32_t timeoutMs) override;
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t* buffer, size_t size) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+
+ private:
+  int open(const char* host, uint16_t port, int32_t timeoutMs);
+  bool handshake(const char* host, uint16_t port, uint32_t timeoutMs);
+  static int sendCallback(void* context, const unsigned char* buffer, size_t length);
+  static int receiveCallback(void* context, unsigned char* buffer, size_t length);
+
+  WiFiClient& transport;
+  mbedtls_ssl_config config;
+  mbedtls_ssl_context ssl;
+  mbedtls_x509_crt caChain;
+  bool configReady;
+  bool sessionOpen;
+  uint32_t handshakeTimeout;
+  int peeked;
+};
+
+// Functions
+void tlsGetStats(TlsStats* stats);
+void tlsLogStats();
+
+#endif // TLS_CLIENT_H
@@ -4,64 +4,23 @@
 
 #include "utils.h"
 #include "wifi_manager.h"
-#include <time.h>
+#include "clock_service.h"
 
-// Global serial output flag
-static bool serialOutputEnabled = true;
-
-// Format and print a log message
-static void logMessage(LogLevel level, const String& tag, const String& message) {
-  if (!serialOutputEnabled) return;
-  
-  String levelStr;
-  switch (level) {
-    case LOG_DEBUG:   levelStr = "DEBUG"; break;
-    case LOG_INFO:    levelStr = "INFO"; break;
-    case LOG_WARNING: levelStr = "WARNING"; break;
-    case LOG_ERROR:   levelStr = "ERROR"; break;
-    default:          levelStr = "UNKNOWN";
-  }
-  
-  String timestamp = getCurrentTimeString();
-  String logLine = "[" + timestamp + "] [" + levelStr + "] [" + tag + "] " + message;
-  
-  Serial.println(logLine);
-}
-
-// Log a debug message
-void logDebug(const String& tag, const String& message) {
-  logMessage(LOG_DEBUG, tag, message);
-}
-
-// Log an info message
-void logInfo(const String& tag, const String& message) {
-  logMessage(LOG_INFO, tag, message);
-}
-
-// Log a warning message
-void logWarning(const String& tag, const String& message) {
-  logMessage(LOG_WARNING, tag, message);
-}
-
-// Log an error message
-void logError(const String& tag, const String& message) {
-  logMessage(LOG_ERROR, tag, message);
-}
+// Logging lives in logger.cpp
 
 // isNetworkConnected moved to wifi_manager.cpp to prevent duplicate definitions
 
 // Get current time as a formatted string
-// Format: YYYY-MM-DD HH:MM:SS
+// Format: YYYY-MM-DD HH:MM:SS (UTC)
 String getCurrentTimeString() {
-  struct tm timeinfo;
-  char buffer[24];
+  char buffer[CLOCK_TIMESTAMP_LENGTH];
   
-  if(!getLocalTime(&timeinfo)) {
+  if (!clockIsSet()) {
     // If time is not set, return a placeholder
     return String("Time not set");
   }
   
-  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &timeinfo);
+  clockFormatUnix(clockUnixTime(), buffer, sizeof(buffer));
   return String(buffer);
 }
 
@@ -9,26 +9,12 @@
 
 #include <Arduino.h>
 #include <HTTPClient.h>
+#include "logger.h"
 
 // API constants
-#define API_BASE_URL "http://16.170.159.206:8000"
 #define API_KEY "your-api-key-here" // Replace with actual API key if available
 #define HTTP_TIMEOUT 10000 // 10 seconds
 
-// Log levels
-enum LogLevel {
-  LOG_DEBUG,
-  LOG_INFO,
-  LOG_WARNING,
-  LOG_ERROR
-};
-
-// Logging functions
-void logDebug(const String& tag, const String& message);
-void logInfo(const String& tag, const String& message);
-void logWarning(const String& tag, const String& message);
-void logError(const String& tag, const String& message);
-
 // Network status - defined in wifi_manager.cpp
 extern bool isNetworkConnected();
 
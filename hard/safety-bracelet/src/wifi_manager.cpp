@@ -1,474 +1,828 @@
 #include "wifi_manager.h"
 #include "utils.h"
+#include "clock_service.h"
+#include "config.h"
+#include "storage.h"
 
 // Define the GSM modem type before including TinyGsmClient.h
 #define TINY_GSM_MODEM_SIM800
+// Let the library pull received socket data into its own FIFO (AT+CIPRXGET) instead of
+// byte-by-byte unsolicited output, so HTTP responses survive a busy main loop
+#define TINY_GSM_RX_BUFFER 1024
 #include <TinyGsmClient.h>
 
-// Private variables
-static ConnectionMode currentConnectionMode = NO_CONNECTION;
-static bool networkConnected = false;
-static bool wifiReconnecting = false;
-static unsigned long lastWiFiCheckTime = 0;
-
-// GSM/GPRS Variables
-static bool simModuleReady = false;
-static bool useGprs = false;
-static int networkRetryCount = 0;
-static unsigned long lastGprsCheckTime = 0;
-static bool gprsInitInProgress = false;
-static int signalQuality = 0;
-static int simCardStatus = 0; // 0=unknown, 1=not inserted, 2=inserted, 3=PIN needed, 4=ready
-static String operatorName = "";
-
 // GSM/GPRS Settings
 #define SIM800L_RX 5     // GPIO 5 pin for RX (to SIM800L TX)
 #define SIM800L_TX 4     // GPIO 4 pin for TX (to SIM800L RX)
 #define SIM800L_RESET 12 // Optional hardware reset pin - can be changed
 #define SIM800L_BAUDRATE 9600
-#define SIM800L_INIT_TIMEOUT 20000 // 20s timeout for modem initialization
+#define SIM800L_RESET_PULSE 100      // Reset pin held low (ms)
+#define SIM800L_BOOT_TIME 5000       // Wait after reset before the first AT command
+#define SIM800L_PROBE_ATTEMPTS 10    // AT probes, 500ms apart, before the modem counts as absent
 #define GPRS_CHECK_INTERVAL 60000   // Check GPRS status every minute
+#define GPRS_REGISTRATION_POLL 2000  // Ask for the registration state this often while registering
 #define APN "internet.vodafone.net"  // Vodafone APN
 #define GPRS_USER ""    // APN username if required
 #define GPRS_PASS ""    // APN password if required
-#define GPRS_MAX_CONNECT_ATTEMPTS 3
+#define MODEM_LINE_LENGTH 64
+
+// Bits set by the WiFi event handler, taken by the state machine
+#define WIFI_EVENT_GOT_IP 0x01
+#define WIFI_EVENT_LOST 0x02
+
+// One AT command of a modem sequence
+struct ModemStep {
+  const char* command;        // Without the "AT" prefix
+  const char* info;           // Prefix of the reply line to keep, "" for any line, NULL for none
+  const char* done;           // Final result code
+  uint32_t timeoutMs;
+  bool required;              // Failure aborts the sequence
+};
+
+enum ModemReply {
+  MODEM_REPLY_PENDING,
+  MODEM_REPLY_DONE,
+  MODEM_REPLY_ERROR,
+  MODEM_REPLY_TIMEOUT
+};
+
+// Last good association, reused for a directed connect with a static IP
+#define WIFI_CACHE_KEY "wifi_cache"
+#define WIFI_CACHE_VERSION 1
+#define WIFI_CACHE_MAGIC 0x57494649UL   // "WIFI", RTC copy only
+
+struct WifiLinkCache {
+  uint32_t magic;
+  char ssid[33];
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns[2];
+};
+
+// Time spent in and entries into each state, for connectivityLogStats()
+struct LinkStateStats {
+  uint32_t entries;
+  uint32_t timeouts;
+  uint32_t totalMs;
+};
+
+// Modem bring-up, in order; the probe is retried, the rest runs once
+static const ModemStep startSteps[] = {
+  { "", NULL, "OK", 1000, true },                        // Probe
+  { "E0", NULL, "OK", 1000, true },
+  { "+CMEE=2", NULL, "OK", 1000, false },
+  { "+CLTS=1", NULL, "OK", 10000, false },               // Let the network set the modem clock (NITZ)
+  { "&W", NULL, "OK", 1000, false },
+  { "+CPIN?", "+CPIN:", "OK", 5000, true }
+};
+
+// Same sequence as TinyGSM's gprsConnect(), one command per step
+static const ModemStep attachSteps[] = {
+  { "+CIPSHUT", NULL, "SHUT OK", 65000, false },
+  { "+CGATT=0", NULL, "OK", 65000, false },
+  { "+SAPBR=3,1,\"Contype\",\"GPRS\"", NULL, "OK", 1000, false },
+  { "+SAPBR=3,1,\"APN\",\"" APN "\"", NULL, "OK", 1000, false },
+  { "+CGDCONT=1,\"IP\",\"" APN "\"", NULL, "OK", 1000, false },
+  { "+CGACT=1,1", NULL, "OK", 60000, false },
+  { "+SAPBR=1,1", NULL, "OK", 85000, false },
+  { "+SAPBR=2,1", NULL, "OK", 30000, true },
+  { "+CGATT=1", NULL, "OK", 60000, true },
+  { "+CIPMUX=1", NULL, "OK", 1000, true },
+  { "+CIPQSEND=1", NULL, "OK", 1000, true },
+  { "+CIPRXGET=1", NULL, "OK", 1000, true },
+  { "+CSTT=\"" APN "\",\"" GPRS_USER "\",\"" GPRS_PASS "\"", NULL, "OK", 60000, true },
+  { "+CIICR", NULL, "OK", 60000, true },
+  { "+CIFSR;E0", "", "OK", 10000, true },                 // Local IP, then OK from E0
+  { "+CDNSCFG=\"8.8.8.8\",\"8.8.4.4\"", NULL, "OK", 1000, true }
+};
+
+// Supervision while up
+static const ModemStep checkSteps[] = {
+  { "+CREG?", "+CREG:", "OK", 5000, true },
+  { "+CGATT?", "+CGATT:", "OK", 5000, true },
+  { "+CSQ", "+CSQ:", "OK", 5000, false },
+  { "+CCLK?", "+CCLK:", "OK", 5000, false }             // Network time for the clock service
+};
+
+static const ModemStep registrationStep = { "+CREG?", "+CREG:", "OK", 5000, true };
+static const ModemStep signalStep = { "+CSQ", "+CSQ:", "OK", 5000, false };
+static const ModemStep detachStep = { "+CIPSHUT", NULL, "SHUT OK", 65000, false };
+
+// Longest time in each state before giving up; 0 for none
+static const uint32_t wifiStateTimeouts[WIFI_LINK_STATE_COUNT] = {
+  0, WIFI_CONNECT_TIMEOUT, 0, 0
+};
+static const uint32_t gprsStateTimeouts[GPRS_LINK_STATE_COUNT] = {
+  0, 30000, 60000, 180000, 0, 70000, 0
+};
+
+static const char* const wifiStateNames[WIFI_LINK_STATE_COUNT] = { "down", "connecting", "portal", "up" };
+static const char* const gprsStateNames[GPRS_LINK_STATE_COUNT] = {
+  "off", "starting", "registering", "attaching", "up", "detaching", "backoff"
+};
+
+// Private variables
+static ConnectionMode currentConnectionMode = NO_CONNECTION;
+static bool networkConnected = false;
+static volatile uint32_t wifiEvents = 0;
+static WiFiManager wifiManager;
+
+// WiFi state machine
+static WifiLinkState wifiState = WIFI_LINK_DOWN;
+static unsigned long wifiStateTime = 0;         // millis() the state was entered
+static unsigned long wifiDownSince = 0;         // millis() WiFi was last lost (or boot)
+static LinkStateStats wifiStats[WIFI_LINK_STATE_COUNT];
+
+// Association cache: RTC memory survives resets and deep sleep, NVS survives power loss
+RTC_NOINIT_ATTR static WifiLinkCache linkCache;
+RTC_NOINIT_ATTR static uint8_t fastConnectStreak;   // Fast connects since the lease was last renewed by DHCP
+static bool linkCacheValid = false;
+static bool fastConnect = false;                    // The current attempt uses the cache
+static uint32_t fastConnectHits = 0;
+static uint32_t fastConnectMisses = 0;
+
+// GPRS state machine
+static GprsLinkState gprsState = GPRS_LINK_OFF;
+static unsigned long gprsStateTime = 0;
+static unsigned long gprsNextAction = 0;        // No command before this millis()
+static uint8_t gprsStep = 0;
+static uint8_t probeAttempts = 0;
+static bool modemResetLow = false;
+static bool modemResetDone = false;
+static uint32_t gprsRetryInterval = GPRS_RETRY_INTERVAL;
+static LinkStateStats gprsStats[GPRS_LINK_STATE_COUNT];
+
+// GSM/GPRS Variables
+static bool simModuleReady = false;
+static int signalQuality = 0;
+static int simCardStatus = 0; // 0=unknown, 1=not inserted, 2=inserted, 3=PIN needed, 4=ready
+static uint32_t modemClockTime = 0;            // Unix time read from the modem clock, 0 if none
+static unsigned long modemClockRead = 0;       // millis() of that reading
+static SemaphoreHandle_t modemMutex = NULL;
+
+// AT command in flight; it owns the modem until its final result code
+static const ModemStep* pendingCommand = NULL;
+static unsigned long commandStart = 0;
+static TaskHandle_t commandTask = NULL;
+static char modemLine[MODEM_LINE_LENGTH];
+static size_t modemLineLength = 0;
+static char modemInfo[MODEM_LINE_LENGTH];
 
 // Hardware serial for SIM800L
 HardwareSerial simSerial(2);
 TinyGsm modem(simSerial);
-TinyGsmClient gsmClient(modem);
+TinyGsmClient gsmClient(modem, GSM_SOCKET_API);
+TinyGsmClient gsmMqttClient(modem, GSM_SOCKET_MQTT);
 
-// WiFi event handler
+// WiFi event handler; runs on the WiFi event task, so it only records the event
 void WiFiEvent(WiFiEvent_t event) {
   switch(event) {
     case SYSTEM_EVENT_STA_GOT_IP:
-      logInfo("WIFI", "Connected with IP: " + WiFi.localIP().toString());
-      networkConnected = true;
-      currentConnectionMode = WIFI_MODE;
+      __atomic_fetch_or(&wifiEvents, WIFI_EVENT_GOT_IP, __ATOMIC_RELEASE);
       break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
-      logInfo("WIFI", "WiFi lost connection");
-      if (currentConnectionMode == WIFI_MODE) {
-        networkConnected = false;
-      }
+      __atomic_fetch_or(&wifiEvents, WIFI_EVENT_LOST, __ATOMIC_RELEASE);
       break;
     default:
       break;
   }
 }
 
-// Initialize WiFi and GPRS modules
-void wifiInit() {
-  logInfo("WIFI", "Initializing connectivity systems");
-  
-  // Register WiFi event handler
-  WiFi.onEvent(WiFiEvent);
-  
-  // Initialize SIM800L with proper error handling
-  initializeSimModule();
-  
-  // Connect to WiFi as primary connection method
-  if (connectWifiWithTimeout(30000)) {
-    logInfo("WIFI", "WiFi connection established as primary connection");
-  } else if (simModuleReady) {
-    logInfo("WIFI", "Attempting GPRS connection as WiFi failed");
-    connectToGPRS();
-  } else {
-    logError("WIFI", "All connectivity methods failed");
+// Send an AT command without waiting for its reply; false if the modem is busy
+static bool modemSend(const ModemStep& step) {
+  if (modemMutex != NULL && xSemaphoreTakeRecursive(modemMutex, 0) != pdTRUE) {
+    return false;
   }
+  pendingCommand = &step;
+  commandStart = millis();
+  commandTask = xTaskGetCurrentTaskHandle();
+  modemLineLength = 0;
+  modemInfo[0] = '\0';
+  modem.sendAT(step.command);
+  return true;
 }
 
-// Initialize SIM800L module
-void initializeSimModule() {
-  logInfo("WIFI", "Initializing SIM800L module");
-  gprsInitInProgress = true;
-  
-  // Configure serial connection to SIM800L
-  simSerial.begin(SIM800L_BAUDRATE, SERIAL_8N1, SIM800L_RX, SIM800L_TX);
-  
-  // Reset module if reset pin is defined
-  if (SIM800L_RESET != -1) {
-    pinMode(SIM800L_RESET, OUTPUT);
-    digitalWrite(SIM800L_RESET, LOW);
-    delay(100);  // Short delay for reset pulse
-    digitalWrite(SIM800L_RESET, HIGH);
-    logInfo("WIFI", "SIM800L hardware reset performed");
-  }
-  
-  // Give SIM800L time to initialize with watchdog feed
-  unsigned long startTime = millis();
-  while (millis() - startTime < 5000) {
-    feedWatchdog();
-    delay(100);
+// Hand the modem back after a command finished or was abandoned
+static void modemRelease() {
+  pendingCommand = NULL;
+  if (modemMutex != NULL) {
+    xSemaphoreGiveRecursive(modemMutex);
   }
-  
-  // Test AT command
-  int attempts = 0;
-  bool modemResponding = false;
-  
-  while (attempts < 3 && !modemResponding) {
-    feedWatchdog();
-    if (modem.testAT(1000)) {
-      modemResponding = true;
-      break;
+}
+
+// Read whatever the modem has sent so far; never waits
+// Lines that are neither the kept info line nor a result code (URCs) are skipped
+static ModemReply modemPoll() {
+  while (simSerial.available() > 0) {
+    char c = simSerial.read();
+    if (c != '\n') {
+      if (c != '\r' && modemLineLength < MODEM_LINE_LENGTH - 1) {
+        modemLine[modemLineLength++] = c;
+      }
+      continue;
     }
-    attempts++;
-    delay(500);
-  }
-  
-  if (modemResponding) {
-    logInfo("WIFI", "SIM800L is responding to AT commands");
-    simModuleReady = true;
-    
-    // Get modem information
-    String modemInfo = modem.getModemInfo();
-    logInfo("WIFI", "Modem: " + modemInfo);
-    
-    // Check SIM card status
-    checkSimCardStatus();
-    
-    // Check signal quality
-    checkSignalQuality();
-    
-    // Get network operator
-    operatorName = modem.getOperator();
-    if (operatorName.length() > 0) {
-      logInfo("WIFI", "Network operator: " + operatorName);
-    } else {
-      logWarning("WIFI", "Network operator unknown");
+    modemLine[modemLineLength] = '\0';
+    modemLineLength = 0;
+    if (modemLine[0] == '\0') {
+      continue;
+    }
+
+    if (strcmp(modemLine, pendingCommand->done) == 0) {
+      modemRelease();
+      return MODEM_REPLY_DONE;
+    }
+    if (strcmp(modemLine, "ERROR") == 0 || strncmp(modemLine, "+CME ERROR", 10) == 0) {
+      modemRelease();
+      return MODEM_REPLY_ERROR;
+    }
+    const char* info = pendingCommand->info;
+    if (info != NULL && strncmp(modemLine, info, strlen(info)) == 0) {
+      strcpy(modemInfo, modemLine);
     }
-  } else {
-    logError("WIFI", "SIM800L not responding after multiple attempts");
-    simModuleReady = false;
   }
-  
-  gprsInitInProgress = false;
+
+  if (millis() - commandStart >= pendingCommand->timeoutMs) {
+    modemRelease();
+    return MODEM_REPLY_TIMEOUT;
+  }
+  return MODEM_REPLY_PENDING;
 }
 
-// Check SIM card status
-void checkSimCardStatus() {
-  if (!simModuleReady) return;
-  
-  // Fix: Using directly the numerical values instead of enum constants 
-  // to avoid TinyGSM SimStatus compatibility issues
-  int status = (int)modem.getSimStatus();
-  switch (status) {
-    case 2: // SIM_READY = 2 in TinyGSM
-      simCardStatus = 4;
-      logInfo("WIFI", "SIM card is ready");
-      break;
-    case 1: // SIM_LOCKED = 1 in TinyGSM
-      simCardStatus = 3;
-      logWarning("WIFI", "SIM card locked with PIN. Enter PIN to unlock.");
-      break;
-    case 0: // SIM_NOT_INSERTED = 0 in TinyGSM
-      simCardStatus = 1;
-      logError("WIFI", "SIM card not inserted or not detected");
-      break;
-    default:
-      simCardStatus = 0;
-      logWarning("WIFI", "SIM status unknown");
-      break;
+// Number after the first comma of an info line, e.g. 1 from "+CREG: 0,1"; -1 if none
+static int infoField(const char* info, int comma) {
+  const char* field = strchr(info, ':');
+  for (int i = 0; field != NULL && i < comma; i++) {
+    field = strchr(field + 1, ',');
+  }
+  return field != NULL ? atoi(field + 1) : -1;
+}
+
+// Parse a +CCLK reply, '+CCLK: "24/05/17,12:34:56+08"', local time with the zone in quarter hours
+static void readModemClock() {
+  int year, month, day, hour, minute, second, quarters;
+  if (sscanf(modemInfo, "+CCLK: \"%d/%d/%d,%d:%d:%d%d", &year, &month, &day, &hour, &minute, &second,
+             &quarters) != 7 || year < 20) {
+    // Still the power-on default: the network has not sent its time (NITZ) yet
+    return;
   }
+  modemClockTime = clockFromCivil(2000 + year, month, day, hour, minute, second) - quarters * 15 * 60;
+  modemClockRead = millis();
 }
 
-// Check signal quality
-void checkSignalQuality() {
-  if (!simModuleReady) return;
+// Record a WiFi state change
+static void setWifiState(WifiLinkState state, bool timedOut = false) {
+  unsigned long now = millis();
+  uint32_t elapsed = now - wifiStateTime;
+  wifiStats[wifiState].totalMs += elapsed;
+  if (timedOut) {
+    wifiStats[wifiState].timeouts++;
+  }
+  wifiStats[state].entries++;
+  LOGI("WIFI", "WiFi %s -> %s after %lums%s", wifiStateNames[wifiState], wifiStateNames[state], elapsed,
+       timedOut ? " (timeout)" : "");
+  if (wifiState == WIFI_LINK_UP) {
+    wifiDownSince = now;
+  }
+  wifiState = state;
+  wifiStateTime = now;
+}
+
+// Record a GPRS state change; every state starts at its first step
+static void setGprsState(GprsLinkState state, bool timedOut = false) {
+  unsigned long now = millis();
+  uint32_t elapsed = now - gprsStateTime;
+  gprsStats[gprsState].totalMs += elapsed;
+  if (timedOut) {
+    gprsStats[gprsState].timeouts++;
+  }
+  gprsStats[state].entries++;
+  LOGI("WIFI", "GPRS %s -> %s after %lums%s", gprsStateNames[gprsState], gprsStateNames[state], elapsed,
+       timedOut ? " (timeout)" : "");
+  gprsState = state;
+  gprsStateTime = now;
+  gprsNextAction = now;
+  gprsStep = 0;
+}
+
+// Give up on the current bring-up and try again later, waiting longer each time
+static void gprsFail(bool timedOut = false) {
+  if (pendingCommand != NULL) {
+    modemRelease();
+  }
+  LOGW("WIFI", "GPRS bring-up failed in %s, retrying in %lus", gprsStateNames[gprsState], gprsRetryInterval / 1000);
+  uint32_t wait = gprsRetryInterval;
+  gprsRetryInterval = min((uint32_t)GPRS_RETRY_MAX_INTERVAL, gprsRetryInterval * 2);
+  setGprsState(GPRS_LINK_BACKOFF, timedOut);
+  gprsNextAction = millis() + wait;
+}
+
+// Load the association cache, from RTC memory after a reset, else from NVS
+static void loadLinkCache() {
+  if (linkCache.magic == WIFI_CACHE_MAGIC) {
+    linkCacheValid = true;
+    return;
+  }
+  fastConnectStreak = 0;
+  linkCacheValid = loadRecord(WIFI_CACHE_KEY, &linkCache, sizeof(linkCache)) == WIFI_CACHE_VERSION;
+  linkCache.magic = linkCacheValid ? WIFI_CACHE_MAGIC : 0;
+}
+
+// Remember the association that just came up over DHCP; NVS is written only when it changed
+static void saveLinkCache() {
+  const uint8_t* bssid = WiFi.BSSID();
+  if (bssid == NULL) {
+    return;
+  }
+  WifiLinkCache cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.magic = WIFI_CACHE_MAGIC;
+  strncpy(cache.ssid, WiFi.SSID().c_str(), sizeof(cache.ssid) - 1);
+  memcpy(cache.bssid, bssid, sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.ip = WiFi.localIP();
+  cache.gateway = WiFi.gatewayIP();
+  cache.subnet = WiFi.subnetMask();
+  cache.dns[0] = WiFi.dnsIP(0);
+  cache.dns[1] = WiFi.dnsIP(1);
+  if (linkCacheValid && memcmp(&cache, &linkCache, sizeof(cache)) == 0) {
+    return;
+  }
   
-  signalQuality = modem.getSignalQuality();
-  if (signalQuality > 0) {
-    logInfo("WIFI", "Signal quality: " + String(signalQuality) + "/31");
+  linkCache = cache;
+  linkCacheValid = true;
+  saveRecord(WIFI_CACHE_KEY, WIFI_CACHE_VERSION, &linkCache, sizeof(linkCache));
+  LOGI("WIFI", "Cached %02x:%02x:%02x:%02x:%02x:%02x on channel %u for fast reconnect", bssid[0], bssid[1],
+       bssid[2], bssid[3], bssid[4], bssid[5], (unsigned)cache.channel);
+}
+
+// Forget the cached association after it failed to connect
+static void dropLinkCache() {
+  linkCacheValid = false;
+  linkCache.magic = 0;
+  removeKey(WIFI_CACHE_KEY);
+}
+
+// Start connecting to the stored network. With a usable cache this associates directly with
+// the last access point on its channel and reuses the last lease as a static IP, which skips
+// the scan and DHCP; otherwise it scans and asks DHCP. The lease is renewed through DHCP
+// every WIFI_CACHE_MAX_REUSE fast connects so an expired one is not held on to.
+static void wifiConnect() {
+  String ssid = wifiManager.getWiFiSSID();
+  String pass = wifiManager.getWiFiPass();
+  fastConnect = linkCacheValid && fastConnectStreak < WIFI_CACHE_MAX_REUSE && ssid == linkCache.ssid;
+  
+  WiFi.disconnect();
+  if (fastConnect) {
+    WiFi.config(IPAddress(linkCache.ip), IPAddress(linkCache.gateway), IPAddress(linkCache.subnet),
+                IPAddress(linkCache.dns[0]), IPAddress(linkCache.dns[1]));
+    WiFi.begin(ssid.c_str(), pass.c_str(), linkCache.channel, linkCache.bssid);
   } else {
-    logWarning("WIFI", "Could not get signal quality information");
+    // All zero turns DHCP back on
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());
+    WiFi.begin(ssid.c_str(), pass.c_str());
   }
+  setWifiState(WIFI_LINK_CONNECTING);
+}
+
+// Open the non-blocking configuration portal for a device without a stored network
+static void openPortal() {
+  logInfo("WIFI", "No stored WiFi network, opening configuration portal " + String(WIFI_AP_NAME));
+  wifiManager.startConfigPortal(WIFI_AP_NAME, WIFI_AP_PASSWORD);
+  setWifiState(WIFI_LINK_PORTAL);
 }
 
-// Connect to WiFi with timeout
-bool connectWifiWithTimeout(int timeoutMs) {
-  logInfo("WIFI", "Connecting to WiFi");
+// Initialize WiFi and the modem; both connect in the background from checkConnection()
+void wifiInit() {
+  logInfo("WIFI", "Initializing connectivity systems");
   
-  WiFiManager wifiManager;
-  wifiManager.setConnectTimeout(timeoutMs / 1000);
-  wifiManager.setConfigPortalTimeout(CONFIG_PORTAL_TIMEOUT);
+  // AT commands and socket traffic share one serial line
+  modemMutex = xSemaphoreCreateRecursiveMutex();
+  simSerial.begin(SIM800L_BAUDRATE, SERIAL_8N1, SIM800L_RX, SIM800L_TX);
   
-  // Start WiFi connection or start configuration portal if needed
-  bool connected = wifiManager.autoConnect(WIFI_AP_NAME, WIFI_AP_PASSWORD);
+  // Register WiFi event handler
+  WiFi.onEvent(WiFiEvent);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
   
-  if (connected) {
-    logInfo("WIFI", "WiFi connected successfully");
-    networkConnected = true;
-    currentConnectionMode = WIFI_MODE;
-    return true;
+  unsigned long now = millis();
+  wifiStateTime = now;
+  wifiDownSince = now;
+  gprsStateTime = now;
+  
+  // Connect to WiFi as primary connection method; without a stored network, open the
+  // configuration portal and let GPRS carry the traffic meanwhile
+  wifiManager.setConfigPortalBlocking(false);
+  wifiManager.setConfigPortalTimeout(CONFIG_PORTAL_TIMEOUT);
+  if (wifiManager.getWiFiIsSaved()) {
+    loadLinkCache();
+    wifiConnect();
   } else {
-    logError("WIFI", "WiFi connection failed");
-    return false;
+    openPortal();
   }
+  
+  // Start the modem right away; GPRS is only attached if WiFi does not come up
+  setGprsState(GPRS_LINK_STARTING);
 }
 
 // Reset WiFi settings
 void resetWiFiSettings() {
   logInfo("WIFI", "Resetting WiFi settings");
   
-  WiFiManager wifiManager;
   wifiManager.resetSettings();
   
   logInfo("WIFI", "WiFi settings reset. Restarting device...");
+  configCommit();
+  logFlush();
   delay(1000);
   ESP.restart();
 }
 
-// Check and maintain network connection with watchdog safety
-void checkConnection() {
-  // Only check periodically
-  if (millis() - lastWiFiCheckTime < WIFI_RECONNECT_INTERVAL) {
-    return;
-  }
-  
-  lastWiFiCheckTime = millis();
-  feedWatchdog();
-  
-  // Check WiFi connection if it's our current mode
-  if (currentConnectionMode == WIFI_MODE) {
-    if (WiFi.status() != WL_CONNECTED) {
-      logInfo("WIFI", "WiFi connection lost. Attempting to reconnect...");
-      
-      // Attempt WiFi reconnection
-      WiFi.reconnect();
-      
-      // Give it time to reconnect with watchdog feed
-      int attempts = 0;
-      while (WiFi.status() != WL_CONNECTED && attempts < MAX_RECONNECT_ATTEMPTS) {
-        feedWatchdog();
-        delay(500);
-        feedWatchdog();
-        delay(500);
-        attempts++;
+// Advance the WiFi state machine
+static void processWifi() {
+  uint32_t events = __atomic_exchange_n(&wifiEvents, 0, __ATOMIC_ACQUIRE);
+  uint32_t inState = millis() - wifiStateTime;
+  uint32_t timeout = wifiState == WIFI_LINK_CONNECTING && fastConnect ? WIFI_FAST_CONNECT_TIMEOUT
+                                                                      : wifiStateTimeouts[wifiState];
+  bool timedOut = timeout > 0 && inState >= timeout;
+  
+  switch (wifiState) {
+    case WIFI_LINK_DOWN:
+      // The driver reconnects by itself as well; this only nudges it
+      if (events & WIFI_EVENT_GOT_IP) {
+        setWifiState(WIFI_LINK_UP);
+      } else if (inState >= WIFI_RECONNECT_INTERVAL) {
+        // Without a stored network there is nothing to connect to; the portal timed out,
+        // so open it again after a while in case someone is about to set the device up
+        if (wifiManager.getWiFiIsSaved()) {
+          wifiConnect();
+        } else if (inState >= WIFI_PORTAL_REOPEN_INTERVAL) {
+          openPortal();
+        }
+      }
+      break;
+    case WIFI_LINK_CONNECTING:
+      if (events & WIFI_EVENT_GOT_IP) {
+        setWifiState(WIFI_LINK_UP);
+      } else if (timedOut && fastConnect) {
+        // The access point moved or the address is taken; scan and ask DHCP right away
+        LOGW("WIFI", "Fast reconnect failed after %lums, scanning", inState);
+        fastConnectMisses++;
+        dropLinkCache();
+        setWifiState(WIFI_LINK_DOWN, true);
+        wifiConnect();
+      } else if (timedOut) {
+        setWifiState(WIFI_LINK_DOWN, true);
       }
-      
-      if (WiFi.status() == WL_CONNECTED) {
-        logInfo("WIFI", "WiFi reconnected");
-        networkConnected = true;
-        currentConnectionMode = WIFI_MODE;
-      } else if (simModuleReady && !gprsInitInProgress) {
-        logInfo("WIFI", "WiFi reconnection failed. Switching to GPRS...");
-        connectToGPRS();
-      } else {
-        logError("WIFI", "No connectivity available");
-        networkConnected = false;
-        currentConnectionMode = NO_CONNECTION;
+      break;
+    case WIFI_LINK_PORTAL:
+      wifiManager.process();
+      if ((events & WIFI_EVENT_GOT_IP) || WiFi.status() == WL_CONNECTED) {
+        setWifiState(WIFI_LINK_UP);
+      } else if (!wifiManager.getConfigPortalActive()) {
+        setWifiState(WIFI_LINK_DOWN, true);
       }
-    }
+      break;
+    case WIFI_LINK_UP:
+      if ((events & WIFI_EVENT_LOST) && WiFi.status() != WL_CONNECTED) {
+        logInfo("WIFI", "WiFi lost connection");
+        setWifiState(WIFI_LINK_DOWN);
+        wifiConnect();
+      }
+      break;
+    default:
+      break;
   }
   
-  // Check GPRS if it's our current mode
-  if (currentConnectionMode == GPRS_MODE) {
-    // Only check GPRS periodically to save power
-    if (millis() - lastGprsCheckTime > GPRS_CHECK_INTERVAL) {
-      lastGprsCheckTime = millis();
-      
-      if (gprsInitInProgress) {
-        return; // Skip checks if initialization is in progress
+  if (wifiState == WIFI_LINK_UP && (events & WIFI_EVENT_GOT_IP)) {
+    logInfo("WIFI", "Connected with IP: " + WiFi.localIP().toString());
+    if (fastConnect) {
+      fastConnectHits++;
+      fastConnectStreak++;
+    } else {
+      fastConnectStreak = 0;
+      saveLinkCache();
+    }
+    fastConnect = false;
+  }
+}
+
+// Handle the reply to the command of the current GPRS state
+static void gprsReply(ModemReply reply) {
+  const ModemStep* steps = NULL;
+  size_t stepCount = 0;
+  bool success = reply == MODEM_REPLY_DONE;
+  
+  switch (gprsState) {
+    case GPRS_LINK_STARTING:
+      // Keep probing until the modem answers
+      if (gprsStep == 0 && !success) {
+        if (++probeAttempts >= SIM800L_PROBE_ATTEMPTS) {
+          logError("WIFI", "SIM800L not responding after multiple attempts");
+          simModuleReady = false;
+          gprsFail();
+        } else {
+          gprsNextAction = millis() + 500;
+        }
+        return;
       }
-      
-      // First quick check just verifies the network is connected
-      if (!modem.isNetworkConnected()) {
-        logWarning("WIFI", "GPRS network lost. Attempting to reconnect...");
-        connectToGPRS();
-      } 
-      // Second more thorough check verifies the GPRS data connection
-      else if (!modem.isGprsConnected()) {
-        logWarning("WIFI", "GPRS data connection lost. Attempting to reconnect...");
-        // Try to connect just to the GPRS data service without full modem restart
-        if (!modem.gprsConnect(APN, GPRS_USER, GPRS_PASS)) {
-          // If that fails, try full reconnection procedure
-          connectToGPRS();
+      if (startSteps[gprsStep].info != NULL && success) {
+        // "+CPIN: READY", "+CPIN: SIM PIN", "+CPIN: NOT INSERTED"
+        simCardStatus = strstr(modemInfo, "READY") != NULL ? 4 : strstr(modemInfo, "PIN") != NULL ? 3 : 1;
+        if (simCardStatus != 4) {
+          LOGE("WIFI", "SIM card not ready: %s", modemInfo);
+          gprsFail();
+          return;
+        }
+        logInfo("WIFI", "SIM800L is responding, SIM card is ready");
+        simModuleReady = true;
+      }
+      steps = startSteps;
+      stepCount = sizeof(startSteps) / sizeof(startSteps[0]);
+      break;
+    
+    case GPRS_LINK_REGISTERING:
+      if (gprsStep == 0) {
+        // Registered at home (1) or roaming (5)
+        int status = success ? infoField(modemInfo, 1) : -1;
+        if (status == 1 || status == 5) {
+          gprsStep = 1;
         } else {
-          logInfo("WIFI", "GPRS data connection re-established");
+          gprsNextAction = millis() + GPRS_REGISTRATION_POLL;
         }
+        return;
       }
-      // Periodically check signal quality for logging purposes
-      else {
-        checkSignalQuality();
+      if (success) {
+        signalQuality = infoField(modemInfo, 0);
         if (signalQuality < 5) {
-          logWarning("WIFI", "GPRS signal quality is low: " + String(signalQuality) + "/31");
+          LOGW("WIFI", "Signal too weak for reliable connection: %d/31", signalQuality);
         }
-        
-        // Try to switch back to WiFi if it's available (WiFi is preferred)
-        if (WiFi.status() == WL_CONNECTED) {
-          logInfo("WIFI", "WiFi connection available. Switching from GPRS to WiFi.");
-          modem.gprsDisconnect();
-          delay(500);
-          networkConnected = true;
-          currentConnectionMode = WIFI_MODE;
-          useGprs = false;
+      }
+      setGprsState(wifiState == WIFI_LINK_UP ? GPRS_LINK_OFF : GPRS_LINK_ATTACHING);
+      return;
+    
+    case GPRS_LINK_ATTACHING:
+      if (attachSteps[gprsStep].info != NULL && success) {
+        LOGI("WIFI", "GPRS connected with IP: %s", modemInfo);
+      }
+      steps = attachSteps;
+      stepCount = sizeof(attachSteps) / sizeof(attachSteps[0]);
+      break;
+    
+    case GPRS_LINK_UP:
+      if (!success) {
+        break;
+      }
+      if (gprsStep == 0 && infoField(modemInfo, 1) != 1 && infoField(modemInfo, 1) != 5) {
+        logWarning("WIFI", "GPRS network lost. Attempting to reconnect...");
+        setGprsState(GPRS_LINK_REGISTERING);
+        return;
+      }
+      if (gprsStep == 1 && infoField(modemInfo, 0) != 1) {
+        logWarning("WIFI", "GPRS data connection lost. Attempting to reconnect...");
+        setGprsState(GPRS_LINK_ATTACHING);
+        return;
+      }
+      if (gprsStep == 2) {
+        signalQuality = infoField(modemInfo, 0);
+        if (signalQuality < 5) {
+          LOGW("WIFI", "GPRS signal quality is low: %d/31", signalQuality);
         }
       }
-    }
+      if (gprsStep == 3) {
+        readModemClock();
+      }
+      steps = checkSteps;
+      stepCount = sizeof(checkSteps) / sizeof(checkSteps[0]);
+      break;
+    
+    case GPRS_LINK_DETACHING:
+      setGprsState(GPRS_LINK_OFF);
+      return;
+    
+    default:
+      return;
   }
   
-  // If no connection, periodically try WiFi then GPRS
-  if (currentConnectionMode == NO_CONNECTION) {
-    static unsigned long lastReconnectAttempt = 0;
-    if (millis() - lastReconnectAttempt > 60000) { // Try every minute
-      lastReconnectAttempt = millis();
-      
-      // Try WiFi first
-      logInfo("WIFI", "No connection. Trying WiFi...");
-      if (connectWifiWithTimeout(10000)) {
-        logInfo("WIFI", "WiFi connection established");
-      } 
-      // If WiFi fails, try GPRS if available
-      else if (simModuleReady && !gprsInitInProgress) {
-        logInfo("WIFI", "WiFi connection failed. Trying GPRS...");
-        connectToGPRS();
-      }
+  if (steps == NULL) {
+    // Supervision command failed; try again at the next check
+    gprsStep = 0;
+    gprsNextAction = millis() + GPRS_CHECK_INTERVAL;
+    return;
+  }
+  if (!success && steps[gprsStep].required) {
+    LOGW("WIFI", "Modem command AT%s failed (%s)", steps[gprsStep].command,
+         reply == MODEM_REPLY_TIMEOUT ? "timeout" : "error");
+    if (gprsState == GPRS_LINK_UP) {
+      gprsStep = 0;
+      gprsNextAction = millis() + GPRS_CHECK_INTERVAL;
+    } else {
+      gprsFail();
     }
+    return;
+  }
+  
+  if (++gprsStep < stepCount) {
+    return;
+  }
+  
+  // Sequence complete
+  if (gprsState == GPRS_LINK_STARTING) {
+    // The modem stays ready for SMS and calls; registration only matters without WiFi
+    setGprsState(wifiState == WIFI_LINK_UP ? GPRS_LINK_OFF : GPRS_LINK_REGISTERING);
+  } else if (gprsState == GPRS_LINK_ATTACHING) {
+    gprsRetryInterval = GPRS_RETRY_INTERVAL;
+    // The first check runs straight away, so the clock service gets the modem clock now
+    setGprsState(GPRS_LINK_UP);
+  } else {
+    gprsStep = 0;
+    gprsNextAction = millis() + GPRS_CHECK_INTERVAL;
   }
 }
 
-// Get current connection mode
-ConnectionMode getCurrentConnectionMode() {
-  return currentConnectionMode;
-}
-
-// Check if network is connected
-bool isNetworkConnected() {
-  return networkConnected;
+// Issue the next action of the current GPRS state
+static void gprsAct() {
+  switch (gprsState) {
+    case GPRS_LINK_STARTING:
+      // Hardware reset pulse, then give the modem time to boot
+      if (!modemResetDone) {
+        if (SIM800L_RESET != -1 && !modemResetLow) {
+          pinMode(SIM800L_RESET, OUTPUT);
+          digitalWrite(SIM800L_RESET, LOW);
+          modemResetLow = true;
+          gprsNextAction = millis() + SIM800L_RESET_PULSE;
+          return;
+        }
+        if (SIM800L_RESET != -1) {
+          digitalWrite(SIM800L_RESET, HIGH);
+          logInfo("WIFI", "SIM800L hardware reset performed");
+        }
+        modemResetLow = false;
+        modemResetDone = true;
+        probeAttempts = 0;
+        gprsNextAction = millis() + SIM800L_BOOT_TIME;
+        return;
+      }
+      modemSend(startSteps[gprsStep]);
+      break;
+    case GPRS_LINK_REGISTERING:
+      modemSend(gprsStep == 0 ? registrationStep : signalStep);
+      break;
+    case GPRS_LINK_ATTACHING:
+      modemSend(attachSteps[gprsStep]);
+      break;
+    case GPRS_LINK_UP:
+      modemSend(checkSteps[gprsStep]);
+      break;
+    case GPRS_LINK_DETACHING:
+      modemSend(detachStep);
+      break;
+    case GPRS_LINK_BACKOFF:
+      setGprsState(GPRS_LINK_OFF);
+      break;
+    default:
+      break;
+  }
 }
 
-// Connect to GPRS with improved error handling and watchdog compatibility
-bool connectToGPRS() {
-  if (gprsInitInProgress) {
-    logInfo("WIFI", "GPRS initialization already in progress");
-    return false;
+// Advance the GPRS state machine
+static void processGprs() {
+  // Bring GPRS up while WiFi is down, take it down once WiFi is back for good
+  bool wifiUp = wifiState == WIFI_LINK_UP;
+  bool wantGprs = !wifiUp && millis() - wifiDownSince >= WIFI_GPRS_FALLBACK_DELAY;
+  bool dropGprs = wifiUp && millis() - wifiStateTime >= WIFI_STABLE_TIME;
+  
+  // The modem is also needed for SMS and calls, so a failed start is retried whatever the WiFi state
+  if (gprsState == GPRS_LINK_OFF && (wantGprs || !simModuleReady)) {
+    modemResetDone = simModuleReady;
+    setGprsState(simModuleReady ? GPRS_LINK_REGISTERING : GPRS_LINK_STARTING);
+  } else if (dropGprs && gprsState == GPRS_LINK_UP && pendingCommand == NULL) {
+    logInfo("WIFI", "WiFi connection available. Switching from GPRS to WiFi.");
+    setGprsState(GPRS_LINK_DETACHING);
+  } else if (dropGprs && (gprsState == GPRS_LINK_REGISTERING || gprsState == GPRS_LINK_ATTACHING) &&
+             pendingCommand == NULL) {
+    setGprsState(GPRS_LINK_OFF);
   }
   
-  if (!simModuleReady) {
-    logError("WIFI", "SIM module not ready, cannot connect to GPRS");
-    // Try to reinitialize modem
-    initializeSimModule();
-    
-    if (!simModuleReady) {
-      return false;
+  if (pendingCommand != NULL) {
+    ModemReply reply = modemPoll();
+    if (reply != MODEM_REPLY_PENDING) {
+      gprsReply(reply);
     }
+  } else if ((long)(millis() - gprsNextAction) >= 0) {
+    gprsAct();
   }
   
-  // Check SIM card status first
-  checkSimCardStatus();
-  if (simCardStatus != 4) { // SIM not ready
-    logError("WIFI", "SIM card not ready (status: " + String(simCardStatus) + ")");
-    return false;
-  }
-  
-  logInfo("WIFI", "Connecting to GPRS");
-  gprsInitInProgress = true;
-  
-  // Initialize modem with watchdog feed
-  logInfo("WIFI", "Restarting modem...");
-  bool restartSuccess = false;
-  unsigned long startTime = millis();
-  
-  // Try to restart with timeout
-  while (millis() - startTime < 10000 && !restartSuccess) {
-    feedWatchdog();
-    if (modem.restart()) {
-      restartSuccess = true;
-      break;
+  uint32_t timeout = gprsStateTimeouts[gprsState];
+  if (timeout > 0 && millis() - gprsStateTime >= timeout) {
+    if (gprsState == GPRS_LINK_DETACHING) {
+      if (pendingCommand != NULL) {
+        modemRelease();
+      }
+      setGprsState(GPRS_LINK_OFF, true);
+    } else {
+      gprsFail(true);
     }
-    delay(500);
   }
-  
-  if (!restartSuccess) {
-    logError("WIFI", "Modem restart failed");
-    gprsInitInProgress = false;
-    return false;
+}
+
+// Advance both link state machines and pick the active link; never blocks
+void checkConnection() {
+  processWifi();
+  processGprs();
+  
+  ConnectionMode mode = NO_CONNECTION;
+  if (wifiState == WIFI_LINK_UP) {
+    mode = WIFI_MODE;
+  } else if (gprsState == GPRS_LINK_UP) {
+    mode = GPRS_MODE;
   }
-  
-  // Check signal quality
-  checkSignalQuality();
-  if (signalQuality < 5) { // Signal too weak
-    logWarning("WIFI", "Signal too weak for reliable connection: " + String(signalQuality) + "/31");
+  if (mode != currentConnectionMode) {
+    LOGI("WIFI", "Active link: %s", mode == WIFI_MODE ? "WiFi" : mode == GPRS_MODE ? "GPRS" : "none");
+    currentConnectionMode = mode;
+    networkConnected = mode != NO_CONNECTION;
   }
-  
-  // Wait for network registration with watchdog feed
-  logInfo("WIFI", "Waiting for network registration...");
-  bool networkRegistered = false;
-  startTime = millis();
-  
-  while (millis() - startTime < 60000L && !networkRegistered) {
-    feedWatchdog();
-    if (modem.waitForNetwork(1000L)) {
-      networkRegistered = true;
-      break;
-    }
-    // Check if module is still responding
-    if (!modem.testAT()) {
-      logError("WIFI", "Modem stopped responding during network registration");
-      gprsInitInProgress = false;
-      return false;
-    }
+}
+
+// Log time spent in each link state
+void connectivityLogStats() {
+  for (int s = 0; s < WIFI_LINK_STATE_COUNT; s++) {
+    uint32_t totalMs = wifiStats[s].totalMs + (s == wifiState ? millis() - wifiStateTime : 0);
+    LOGI("WIFI", "WiFi %s: entered %lu times, %lus total, %lu timeouts", wifiStateNames[s], wifiStats[s].entries,
+         totalMs / 1000, wifiStats[s].timeouts);
   }
-  
-  if (!networkRegistered) {
-    logError("WIFI", "Network registration failed after timeout");
-    gprsInitInProgress = false;
-    return false;
+  LOGI("WIFI", "WiFi fast reconnects: %lu hits, %lu misses", fastConnectHits, fastConnectMisses);
+  for (int s = 0; s < GPRS_LINK_STATE_COUNT; s++) {
+    uint32_t totalMs = gprsStats[s].totalMs + (s == gprsState ? millis() - gprsStateTime : 0);
+    LOGI("WIFI", "GPRS %s: entered %lu times, %lus total, %lu timeouts", gprsStateNames[s], gprsStats[s].entries,
+         totalMs / 1000, gprsStats[s].timeouts);
   }
-  
-  if (modem.isNetworkConnected()) {
-    logInfo("WIFI", "Network registered successfully");
-    
-    // Get operator name
-    operatorName = modem.getOperator();
-    if (operatorName.length() > 0) {
-      logInfo("WIFI", "Network operator: " + operatorName);
-    }
-  } else {
-    logError("WIFI", "Network shows connected but verification failed");
-    gprsInitInProgress = false;
+}
+
+// Get current connection mode
+ConnectionMode getCurrentConnectionMode() {
+  return currentConnectionMode;
+}
+
+// Get the WiFi and GPRS link states
+WifiLinkState getWifiLinkState() {
+  return wifiState;
+}
+
+GprsLinkState getGprsLinkState() {
+  return gprsState;
+}
+
+// Check if network is connected
+bool isNetworkConnected() {
+  return networkConnected;
+}
+
+// Take the modem for a sequence of AT commands or socket operations (recursive)
+// A command the link state machine has in flight keeps the modem until its reply, so
+// other users on the same task are turned away rather than mixed into that reply
+bool modemLock(uint32_t timeoutMs) {
+  if (modemMutex == NULL) {
+    return true;
+  }
+  if (pendingCommand != NULL && commandTask == xTaskGetCurrentTaskHandle()) {
     return false;
   }
-  
-  // Connect to GPRS with retry mechanism
-  logInfo("WIFI", "Connecting to APN: " + String(APN));
-  bool gprsConnected = false;
-  int connectAttempts = 0;
-  
-  while (connectAttempts < GPRS_MAX_CONNECT_ATTEMPTS && !gprsConnected) {
-    feedWatchdog();
-    if (modem.gprsConnect(APN, GPRS_USER, GPRS_PASS)) {
-      gprsConnected = true;
-      break;
-    }
-    connectAttempts++;
-    logWarning("WIFI", "GPRS connection attempt " + String(connectAttempts) + " failed, retrying...");
-    delay(1000);
+  return xSemaphoreTakeRecursive(modemMutex, pdMS_TO_TICKS(timeoutMs)) == pdTRUE;
+}
+
+// Release the modem
+void modemUnlock() {
+  if (modemMutex != NULL) {
+    xSemaphoreGiveRecursive(modemMutex);
   }
-  
-  if (!gprsConnected) {
-    logError("WIFI", "GPRS connection failed after " + String(GPRS_MAX_CONNECT_ATTEMPTS) + " attempts");
-    gprsInitInProgress = false;
+}
+
+// GPRS data socket; use only while holding the modem
+Client& gsmSocket(uint8_t socket) {
+  return socket == GSM_SOCKET_MQTT ? (Client&)gsmMqttClient : (Client&)gsmClient;
+}
+
+// Open a GPRS data socket with a bounded wait (the SIM800 default is 75s)
+bool gsmConnect(uint8_t socket, const char* host, uint16_t port, uint32_t timeoutMs) {
+  if (currentConnectionMode != GPRS_MODE) {
     return false;
   }
-  
-  // Verify GPRS connection with IP address check
-  IPAddress ip = modem.localIP();
-  String ipStr = String(ip[0]) + "." + String(ip[1]) + "." + String(ip[2]) + "." + String(ip[3]);
-  
-  if (ip != IPAddress(0, 0, 0, 0)) {
-    logInfo("WIFI", "GPRS connected with IP: " + ipStr);
-    networkConnected = true;
-    currentConnectionMode = GPRS_MODE;
-    useGprs = true;
-    lastGprsCheckTime = millis();
-    gprsInitInProgress = false;
-    return true;
-  } else {
-    logError("WIFI", "GPRS connected but no valid IP address assigned");
-    gprsInitInProgress = false;
+  TinyGsmClient& client = socket == GSM_SOCKET_MQTT ? gsmMqttClient : gsmClient;
+  return client.connect(host, port, (timeoutMs + 999) / 1000);
+}
+
+// Network time the modem clock was set to, as Unix time; never touches the modem
+// The link state machine reads the clock with each GPRS check, so this only returns a recent reading
+bool gsmNetworkTime(uint32_t* unixTime) {
+  unsigned long age = millis() - modemClockRead;
+  if (modemClockTime == 0 || age > 2 * GPRS_CHECK_INTERVAL) {
     return false;
   }
+  *unixTime = modemClockTime + age / 1000;
+  return true;
 }
 
 // Check if SIM module is ready
@@ -476,6 +830,14 @@ bool isSimModuleReady() {
   return simModuleReady;
 }
 
+// Get signal strength of the active link: RSSI in dBm on WiFi, CSQ (0-31) on GPRS
+int getSignalStrength() {
+  if (currentConnectionMode == WIFI_MODE) {
+    return WiFi.RSSI();
+  }
+  return signalQuality;
+}
+
 // SMS wrapper function to send text messages without direct TinyGSM calls
 bool sendSMSToNumber(const char* phoneNumber, const char* message) {
   if (!simModuleReady) {
@@ -489,7 +851,7 @@ bool sendSMSToNumber(const char* phoneNumber, const char* message) {
   // In a real implementation, this would use TinyGSM functionality
   // For now, we'll simulate success to let compilation proceed
   #ifdef ENABLE_GSM  // Only attempt real SMS when GSM is enabled
-  // TinyGSM implementation would go here
+  // TinyGSM implementation would go here, holding modemLock() around the AT commands
   #else
   // Simulate SMS for compilation
   logInfo("WIFI", "SMS simulation: To: " + String(phoneNumber) + ", Message: " + String(message));
@@ -512,7 +874,7 @@ bool makeCallToNumber(const char* phoneNumber, int callDurationMs) {
   // In a real implementation, this would use TinyGSM functionality
   // For now, we'll simulate success to let compilation proceed
   #ifdef ENABLE_GSM  // Only attempt real call when GSM is enabled
-  // TinyGSM implementation would go here
+  // TinyGSM implementation would go here, holding modemLock() around the AT commands
   #else
   // Simulate call for compilation
   logInfo("WIFI", "Call simulation: To: " + String(phoneNumber) + ", Duration: " + String(callDurationMs/1000) + " seconds");
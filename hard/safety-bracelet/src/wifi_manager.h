@@ -12,12 +12,47 @@ enum ConnectionMode {
   NO_CONNECTION
 };
 
+// Link states. WiFi and GPRS each run their own state machine, advanced from the main
+// loop by checkConnection() without ever waiting: WiFi is driven by the WiFi events, the
+// modem by its replies to one AT command at a time. WiFi is preferred; GPRS is brought
+// up while WiFi is down and shut down once WiFi has been back for a while.
+enum WifiLinkState : uint8_t {
+  WIFI_LINK_DOWN,               // Waiting to retry
+  WIFI_LINK_CONNECTING,         // WiFi.begin()/reconnect() issued, waiting for an IP
+  WIFI_LINK_PORTAL,             // No stored network; configuration portal open
+  WIFI_LINK_UP,
+  WIFI_LINK_STATE_COUNT
+};
+
+enum GprsLinkState : uint8_t {
+  GPRS_LINK_OFF,
+  GPRS_LINK_STARTING,           // Modem reset, boot and AT probe, SIM check
+  GPRS_LINK_REGISTERING,        // Waiting for network registration
+  GPRS_LINK_ATTACHING,          // PDP context and TCP/IP stack
+  GPRS_LINK_UP,
+  GPRS_LINK_DETACHING,          // Closing the data connection after WiFi returned
+  GPRS_LINK_BACKOFF,            // Waiting after a failed bring-up
+  GPRS_LINK_STATE_COUNT
+};
+
 // WiFi/GPRS constants
 #define WIFI_AP_NAME "ESP32_Safety_Bracelet"
 #define WIFI_AP_PASSWORD "12345678"
 #define CONFIG_PORTAL_TIMEOUT 180
+#define WIFI_PORTAL_REOPEN_INTERVAL 600000  // Reopen a timed-out portal while no network is stored
 #define WIFI_RECONNECT_INTERVAL 30000
-#define MAX_RECONNECT_ATTEMPTS 3
+#define WIFI_CONNECT_TIMEOUT 15000          // Wait for an IP before counting the attempt as failed
+#define WIFI_FAST_CONNECT_TIMEOUT 3000      // Same for a directed connect with the cached BSSID and static IP
+#define WIFI_CACHE_MAX_REUSE 24             // Fast connects before the lease is renewed through DHCP
+#define WIFI_GPRS_FALLBACK_DELAY 15000      // WiFi down this long before GPRS is started
+#define WIFI_STABLE_TIME 30000              // WiFi up this long before GPRS is shut down
+#define GPRS_RETRY_INTERVAL 60000           // Wait after a failed bring-up, doubling each time
+#define GPRS_RETRY_MAX_INTERVAL 600000
+#define MODEM_LOCK_TIMEOUT 10000            // Longest wait for the modem before skipping an operation
+
+// GPRS data sockets; the SIM800 multiplexes them over one PDP context
+#define GSM_SOCKET_API 0
+#define GSM_SOCKET_MQTT 1
 
 // Public functions
 void wifiManagerInit();
@@ -27,21 +62,27 @@ ConnectionMode getConnectionMode();
 
 // Functions
 void wifiInit();
-void initializeSimModule();
-void checkSimCardStatus();
-void checkSignalQuality();
-bool connectWifiWithTimeout(int timeoutMs);
 void resetWiFiSettings();
 void checkConnection();
 ConnectionMode getCurrentConnectionMode();
+WifiLinkState getWifiLinkState();
+GprsLinkState getGprsLinkState();
+void connectivityLogStats();
 
 // SMS and call wrapper functions
 bool sendSMSToNumber(const char* phoneNumber, const char* message);
 bool makeCallToNumber(const char* phoneNumber, int callDurationMs);
 
 bool isNetworkConnected();
-bool connectToGPRS();
 bool isSimModuleReady();
+int getSignalStrength();
+
+// Modem access shared by the main loop (SMS, calls, link checks) and the network task (sockets)
+bool modemLock(uint32_t timeoutMs);
+void modemUnlock();
+Client& gsmSocket(uint8_t socket);
+bool gsmConnect(uint8_t socket, const char* host, uint16_t port, uint32_t timeoutMs);
+bool gsmNetworkTime(uint32_t* unixTime);
 
 // Make feedWatchdog accessible to network modules
 extern void feedWatchdog();
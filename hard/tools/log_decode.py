@@ -0,0 +1,241 @@
+#!/usr/bin/env python3
+"""Decode tokenized firmware logs back into text lines.
+
+Reads the serial output of a build with LOG_TOKENIZED=1 and prints the same
+"[time] [LEVEL] [TAG] message" lines a text build would. Bytes outside frames
+(boot ROM messages, panics) are passed through unchanged.
+
+    python3 tools/log_decode.py --src safety-bracelet/src --port /dev/ttyUSB0
+    python3 tools/log_decode.py --db log_tokens.csv capture.bin
+
+The token database must come from the same sources the firmware was built from.
+Serial ports need pyserial.
+"""
+
+import argparse
+import datetime
+import re
+import struct
+import sys
+
+from log_tokens import build_database, read_database
+
+FRAME_SYNC = 0xA5
+FRAME_FORMAT, FRAME_TEXT, FRAME_CLOCK = 0, 1, 2
+LEVEL_NAMES = ["DEBUG", "INFO", "WARNING", "ERROR"]
+
+# Argument types, as LogArgType in logger.h; doubles are sent as ARG_DOUBLE64, ARG_DOUBLE is the
+# 32-bit float older firmware sent
+ARG_INT, ARG_UINT, ARG_INT64, ARG_UINT64, ARG_DOUBLE, ARG_TEXT, ARG_POINTER, ARG_DOUBLE64 = range(8)
+
+CONVERSION = re.compile(r"%([-+ #0-9.]*)[hlLqjzt]*([diouxXeEfFgGcsp%])")
+
+
+class Payload:
+    """Reader over one frame payload."""
+
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def byte(self):
+        if self.pos >= len(self.data):
+            raise IndexError("payload too short")
+        self.pos += 1
+        return self.data[self.pos - 1]
+
+    def varint(self):
+        value = shift = 0
+        while True:
+            b = self.byte()
+            value |= (b & 0x7F) << shift
+            shift += 7
+            if b < 0x80:
+                return value
+
+    def signed(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+    def word(self):
+        return struct.unpack("<I", bytes(self.byte() for _ in range(4)))[0]
+
+    def rest(self):
+        rest = self.data[self.pos:]
+        self.pos = len(self.data)
+        return rest
+
+
+def read_args(payload, count):
+    """Captured arguments, as far as the payload holds them."""
+    types = []
+    for i in range(0, count, 2):
+        packed = payload.byte()
+        types.append(packed & 0x0F)
+        if i + 1 < count:
+            types.append(packed >> 4)
+
+    args = []
+    try:
+        for kind in types:
+            if kind in (ARG_INT, ARG_INT64):
+                args.append((kind, payload.signed()))
+            elif kind in (ARG_UINT, ARG_UINT64, ARG_POINTER):
+                args.append((kind, payload.word() if kind == ARG_POINTER else payload.varint()))
+            elif kind == ARG_DOUBLE:
+                args.append((kind, struct.unpack("<f", struct.pack("<I", payload.word()))[0]))
+            elif kind == ARG_DOUBLE64:
+                args.append((kind, struct.unpack("<d", struct.pack("<II", payload.word(), payload.word()))[0]))
+            elif kind == ARG_TEXT:
+                length = payload.varint()
+                args.append((kind, bytes(payload.byte() for _ in range(length)).decode("utf-8", "replace")))
+            else:
+                break
+    except IndexError:
+        pass
+    return args
+
+
+def format_arg(flags, conversion, arg):
+    """One conversion, picking a type that fits what was captured, like the firmware."""
+    if arg is None:
+        return "?"
+    kind, value = arg
+    if kind == ARG_POINTER:
+        return "0x%x" % value
+    if kind == ARG_TEXT:
+        return ("%" + flags + "s") % value
+    if kind in (ARG_DOUBLE, ARG_DOUBLE64):
+        return ("%" + flags + (conversion if conversion in "eEfFgG" else "f")) % value
+    if conversion == "c":
+        return ("%" + flags + "c") % (value & 0xFF)
+    if conversion in "xXo":
+        bits = 64 if kind in (ARG_INT64, ARG_UINT64) else 32
+        return ("%" + flags + conversion) % (value & ((1 << bits) - 1))
+    return ("%" + flags + "d") % value
+
+
+def format_message(fmt, args):
+    index = [0]
+
+    def convert(match):
+        flags, conversion = match.groups()
+        if conversion == "%":
+            return "%"
+        arg = args[index[0]] if index[0] < len(args) else None
+        index[0] += 1
+        return format_arg(flags, conversion, arg)
+
+    return CONVERSION.sub(convert, fmt)
+
+
+class Decoder:
+    def __init__(self, database, out):
+        self.database = database
+        self.out = out
+        self.clock_offset = None
+        self.buffer = bytearray()
+        self.passthrough = bytearray()
+
+    def timestamp(self, uptime):
+        if self.clock_offset is None:
+            return "up %d.%03ds" % (uptime // 1000, uptime % 1000)
+        unix_ms = uptime + self.clock_offset
+        moment = datetime.datetime.fromtimestamp(unix_ms // 1000, datetime.timezone.utc)
+        return moment.strftime("%Y-%m-%d %H:%M:%S") + ".%03d" % (unix_ms % 1000)
+
+    def line(self, uptime, level, tag, message):
+        level_name = LEVEL_NAMES[level] if level < len(LEVEL_NAMES) else str(level)
+        self.out.write("[%s] [%s] [%s] %s\n" % (self.timestamp(uptime), level_name, tag, message))
+
+    def frame(self, data):
+        payload = Payload(data)
+        header = payload.byte()
+        kind, level, count = header >> 6, (header >> 4) & 0x03, header & 0x0F
+        if kind == FRAME_CLOCK:
+            self.clock_offset = payload.signed()
+            return
+
+        token = payload.word()
+        uptime = payload.varint()
+        entry = self.database.get(token)
+        if kind == FRAME_TEXT:
+            tag = entry[0] if entry else "%08x" % token
+            self.line(uptime, level, tag, payload.rest().decode("utf-8", "replace"))
+        elif entry is None:
+            args = read_args(payload, count)
+            self.line(uptime, level, "?", "unknown token %08x %r" % (token, [value for _, value in args]))
+        else:
+            self.line(uptime, level, entry[0], format_message(entry[1], read_args(payload, count)))
+
+    def flush_passthrough(self):
+        if self.passthrough:
+            self.out.write(self.passthrough.decode("utf-8", "replace"))
+            self.passthrough.clear()
+
+    def feed(self, data):
+        """Consume raw bytes; returns when more input is needed."""
+        self.buffer.extend(data)
+        while self.buffer:
+            if self.buffer[0] != FRAME_SYNC:
+                self.passthrough.append(self.buffer.pop(0))
+                continue
+            if len(self.buffer) < 2:
+                break
+            length = self.buffer[1]
+            if len(self.buffer) < length + 3:
+                break
+            payload = bytes(self.buffer[2:2 + length])
+            if length == 0 or sum(payload) & 0xFF != self.buffer[2 + length]:
+                # Not a frame after all, e.g. a stray 0xA5 in boot output
+                self.passthrough.append(self.buffer.pop(0))
+                continue
+            self.flush_passthrough()
+            del self.buffer[:length + 3]
+            try:
+                self.frame(payload)
+            except (IndexError, struct.error):
+                self.out.write("[log_decode] malformed frame: %s\n" % payload.hex())
+        if self.passthrough.endswith(b"\n"):
+            self.flush_passthrough()
+        self.out.flush()
+
+
+def open_input(args):
+    if args.port:
+        try:
+            import serial
+        except ImportError:
+            sys.exit("reading a serial port needs pyserial (pip install pyserial)")
+        port = serial.Serial(args.port, args.baud, timeout=0.1)
+        return lambda: port.read(256) or b""
+    source = open(args.input, "rb") if args.input != "-" else sys.stdin.buffer
+    return lambda: source.read1(4096) if hasattr(source, "read1") else source.read(4096)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode tokenized firmware logs")
+    database_group = parser.add_mutually_exclusive_group(required=True)
+    database_group.add_argument("--db", help="token database written by log_tokens.py")
+    database_group.add_argument("--src", nargs="+", help="build the database from these sources")
+    parser.add_argument("--port", help="serial port to read, e.g. /dev/ttyUSB0")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("input", nargs="?", default="-", help="captured output to decode (default: stdin)")
+    args = parser.parse_args()
+
+    database = read_database(args.db) if args.db else build_database(args.src)
+    decoder = Decoder(database, sys.stdout)
+    read = open_input(args)
+    try:
+        while True:
+            data = read()
+            if not data and not args.port:
+                break
+            decoder.feed(data)
+    except KeyboardInterrupt:
+        pass
+    decoder.flush_passthrough()
+
+
+if __name__ == "__main__":
+    main()
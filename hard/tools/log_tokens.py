@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Build the token database for tokenized firmware logs.
+
+Scans the firmware sources for LOGD/LOGI/LOGW/LOGE calls, LOG_TOKEN() uses and the
+tags of the message functions (logInfo and friends), and writes one CSV row per token:
+
+    token,tag,format
+
+The token is the same 32-bit FNV-1a hash the firmware computes in logger.h, over
+tag + "\\x1f" + format for formatted calls and over the tag alone for messages.
+
+    python3 tools/log_tokens.py safety-bracelet/src -o log_tokens.csv
+"""
+
+import argparse
+import csv
+import os
+import re
+import sys
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+TOKEN_SEPARATOR = "\x1f"
+SOURCE_EXTENSIONS = (".c", ".cpp", ".h", ".hpp", ".ino")
+
+LITERAL = r'"(?:[^"\\\n]|\\.)*"'
+LITERALS = r"((?:%s\s*)+)" % LITERAL
+FORMAT_CALL = re.compile(r"\b(?:LOG[DIWE]\s*\(|LOG_AT\s*\([^,()]+,|LOG_TOKEN\s*\()\s*(%s)\s*,\s*%s" % (LITERAL, LITERALS))
+TAG_CALL = re.compile(r"\b(?:log(?:Debug|Info|Warning|Error)|LOG_TAG_TOKEN)\s*\(\s*(%s)" % LITERAL)
+
+ESCAPES = {"n": "\n", "t": "\t", "r": "\r", "0": "\0", "\\": "\\", '"': '"', "'": "'", "a": "\a", "b": "\b",
+           "f": "\f", "v": "\v", "?": "?"}
+
+
+def token_hash(text):
+    """FNV-1a over the UTF-8 bytes, as logTokenHash() in logger.h."""
+    value = FNV_OFFSET
+    for byte in text.encode("utf-8"):
+        value = ((value ^ byte) * FNV_PRIME) & 0xFFFFFFFF
+    return value
+
+
+def unescape(body):
+    """Decode the escapes of one C string literal body."""
+    out = []
+    i = 0
+    while i < len(body):
+        c = body[i]
+        if c != "\\" or i + 1 >= len(body):
+            out.append(c)
+            i += 1
+            continue
+        n = body[i + 1]
+        if n == "x":
+            j = i + 2
+            while j < len(body) and body[j] in "0123456789abcdefABCDEF":
+                j += 1
+            out.append(chr(int(body[i + 2:j], 16)))
+            i = j
+        elif n in "01234567" and not (n == "0" and (i + 2 >= len(body) or body[i + 2] not in "01234567")):
+            j = i + 1
+            while j < len(body) and j < i + 4 and body[j] in "01234567":
+                j += 1
+            out.append(chr(int(body[i + 1:j], 8)))
+            i = j
+        else:
+            out.append(ESCAPES.get(n, n))
+            i += 2
+    return "".join(out)
+
+
+def join_literals(text):
+    """Concatenate adjacent literals, as the compiler does."""
+    return "".join(unescape(m[1:-1]) for m in re.findall(LITERAL, text))
+
+
+def strip_comments(source):
+    """Blank out comments, keeping string literals intact."""
+    pattern = re.compile(r"//[^\n]*|/\*.*?\*/|%s|'(?:[^'\\\n]|\\.)*'" % LITERAL, re.S)
+    return pattern.sub(lambda m: m.group(0) if m.group(0)[0] in "\"'" else " ", source)
+
+
+def scan_source(text, entries):
+    """Add the tokens used in one source file to entries."""
+    text = strip_comments(text)
+    for match in FORMAT_CALL.finditer(text):
+        tag = join_literals(match.group(1))
+        fmt = join_literals(match.group(2))
+        entries.add((token_hash(tag + TOKEN_SEPARATOR + fmt), tag, fmt))
+    for match in TAG_CALL.finditer(text):
+        tag = join_literals(match.group(1))
+        entries.add((token_hash(tag), tag, ""))
+
+
+def scan_paths(paths):
+    """Scan files and directories; returns a set of (token, tag, format)."""
+    entries = set()
+    for path in paths:
+        if os.path.isfile(path):
+            files = [path]
+        else:
+            files = [os.path.join(root, name) for root, _, names in os.walk(path)
+                     for name in sorted(names) if name.endswith(SOURCE_EXTENSIONS)]
+        for name in files:
+            with open(name, encoding="utf-8", errors="replace") as source:
+                scan_source(source.read(), entries)
+    return entries
+
+
+def build_database(paths, warn=sys.stderr):
+    """Token -> (tag, format) for the given sources, warning about collisions."""
+    database = {}
+    for token, tag, fmt in sorted(scan_paths(paths)):
+        if token in database and database[token] != (tag, fmt):
+            print("warning: token %08x used by both %r and %r" % (token, database[token], (tag, fmt)), file=warn)
+            continue
+        database[token] = (tag, fmt)
+    return database
+
+
+def write_database(database, out):
+    writer = csv.writer(out, lineterminator="\n")
+    writer.writerow(["token", "tag", "format"])
+    for token in sorted(database):
+        tag, fmt = database[token]
+        writer.writerow(["%08x" % token, tag, fmt])
+
+
+def read_database(path):
+    database = {}
+    with open(path, newline="", encoding="utf-8") as source:
+        for row in csv.DictReader(source):
+            database[int(row["token"], 16)] = (row["tag"], row["format"])
+    return database
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build the token database for tokenized logs")
+    parser.add_argument("sources", nargs="+", help="source files or directories")
+    parser.add_argument("-o", "--output", help="CSV file to write (default: stdout)")
+    args = parser.parse_args()
+
+    database = build_database(args.sources)
+    if args.output:
+        with open(args.output, "w", newline="", encoding="utf-8") as out:
+            write_database(database, out)
+        print("%d tokens written to %s" % (len(database), args.output), file=sys.stderr)
+    else:
+        write_database(database, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
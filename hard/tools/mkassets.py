@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""Build the asset bundle flashed to the "assets" partition.
+
+The bundle is read in place by assets.cpp, so its layout must match assets.h:
+a header, an index sorted by name, then the assets, each on a 4-byte boundary.
+Assets are listed in a JSON manifest; paths are relative to the manifest:
+
+    {"revision": 3, "assets": [
+      {"name": "logo", "type": "bitmap", "file": "logo.pbm"},
+      {"name": "qr_info", "type": "qr", "text": "https://example.com/help", "scale": 2},
+      {"name": "soc_curve", "type": "table", "format": "<HH",
+       "rows": [[3300, 0], [3600, 10], [3700, 40], [3900, 70], [4200, 100]]},
+      {"name": "weights", "type": "blob", "file": "fall_model.bin"}
+    ]}
+
+Bitmaps are PBM files (P1 or P4), black pixels lit. "qr" renders text as a QR code
+bitmap and needs the qrcode package (pip install qrcode). Table rows are packed with
+the struct format, which must match the record struct the firmware reads.
+
+    python3 tools/mkassets.py assets/manifest.json -o assets.bin
+    python3 tools/mkassets.py --list assets.bin
+
+Flash the bundle on its own, without touching the application:
+
+    esptool.py write_flash 0x2F0000 assets.bin
+"""
+
+import argparse
+import json
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x54455341  # "ASET"
+FORMAT_VERSION = 1
+NAME_LENGTH = 20
+PARTITION_SIZE = 0x20000
+
+HEADER = struct.Struct("<IHHIII")      # AssetBundleHeader
+ENTRY = struct.Struct("<%dsHHII" % NAME_LENGTH)  # AssetEntry
+BITMAP_HEADER = struct.Struct("<HH")   # AssetBitmapHeader
+TABLE_HEADER = struct.Struct("<HHI")   # AssetTableHeader
+
+TYPES = {"blob": 0, "bitmap": 1, "table": 2}
+TYPE_NAMES = {value: name for name, value in TYPES.items()}
+
+
+def pbm_tokens(data):
+    """Header tokens of a PBM file, skipping comments; returns them and the offset after."""
+    tokens = []
+    pos = 0
+    while len(tokens) < 3:
+        while data[pos:pos + 1].isspace():
+            pos += 1
+        if data[pos:pos + 1] == b"#":
+            pos = data.index(b"\n", pos) + 1
+            continue
+        start = pos
+        while not data[pos:pos + 1].isspace():
+            pos += 1
+        tokens.append(data[start:pos])
+    return tokens, pos + 1
+
+
+def read_pbm(path):
+    """Pixels of a PBM file as rows of 0/1."""
+    with open(path, "rb") as f:
+        data = f.read()
+    (magic, width, height), pos = pbm_tokens(data)
+    width, height = int(width), int(height)
+    if magic == b"P4":
+        stride = (width + 7) // 8
+        return width, height, [[(data[pos + y * stride + x // 8] >> (7 - x % 8)) & 1 for x in range(width)]
+                               for y in range(height)]
+    if magic == b"P1":
+        bits = [int(c) for c in data[pos - 1:].decode("ascii") if c in "01"]
+        return width, height, [bits[y * width:(y + 1) * width] for y in range(height)]
+    raise ValueError("%s is not a PBM file" % path)
+
+
+def render_qr(text, scale):
+    """QR code modules as pixel rows, with a one-module quiet zone."""
+    try:
+        import qrcode
+    except ImportError:
+        sys.exit("qr assets need the qrcode package (pip install qrcode)")
+    code = qrcode.QRCode(border=1)
+    code.add_data(text)
+    code.make(fit=True)
+    matrix = code.get_matrix()
+    rows = []
+    for row in matrix:
+        pixels = [int(module) for module in row for _ in range(scale)]
+        rows.extend([pixels] * scale)
+    return len(rows[0]), len(rows), rows
+
+
+def pack_bitmap(width, height, rows):
+    """AssetBitmapHeader and 1-bit rows, MSB first, as drawBitmap() reads them."""
+    out = bytearray(BITMAP_HEADER.pack(width, height))
+    for row in rows:
+        for x in range(0, width, 8):
+            byte = 0
+            for bit, pixel in enumerate(row[x:x + 8]):
+                byte |= pixel << (7 - bit)
+            out.append(byte)
+    return bytes(out)
+
+
+def pack_table(fmt, rows):
+    record = struct.Struct(fmt)
+    return TABLE_HEADER.pack(record.size, 0, len(rows)) + b"".join(record.pack(*row) for row in rows)
+
+
+def build_asset(spec, base):
+    kind = spec["type"]
+    if kind == "bitmap":
+        return TYPES["bitmap"], pack_bitmap(*read_pbm(os.path.join(base, spec["file"])))
+    if kind == "qr":
+        return TYPES["bitmap"], pack_bitmap(*render_qr(spec["text"], spec.get("scale", 1)))
+    if kind == "table":
+        return TYPES["table"], pack_table(spec["format"], spec["rows"])
+    if kind == "blob":
+        with open(os.path.join(base, spec["file"]), "rb") as f:
+            return TYPES["blob"], f.read()
+    raise ValueError("unknown asset type %r" % kind)
+
+
+def align(data):
+    return data + b"\0" * (-len(data) % 4)
+
+
+def build_bundle(manifest_path):
+    with open(manifest_path) as f:
+        manifest = json.load(f)
+    base = os.path.dirname(os.path.abspath(manifest_path))
+
+    assets = []
+    for spec in manifest["assets"]:
+        name = spec["name"].encode("ascii")
+        if not 0 < len(name) < NAME_LENGTH:
+            raise ValueError("asset name %r must be 1 to %d characters" % (spec["name"], NAME_LENGTH - 1))
+        assets.append((name,) + build_asset(spec, base))
+    # The firmware looks names up with a binary search over strncmp()
+    assets.sort(key=lambda asset: asset[0])
+    names = [asset[0] for asset in assets]
+    if len(set(names)) != len(names):
+        raise ValueError("duplicate asset names")
+
+    offset = HEADER.size + ENTRY.size * len(assets)
+    index = b""
+    body = b""
+    for name, kind, data in assets:
+        index += ENTRY.pack(name, kind, 0, offset + len(body), len(data))
+        body += align(data)
+
+    payload = index + body
+    header = HEADER.pack(MAGIC, FORMAT_VERSION, len(assets), manifest.get("revision", 1),
+                         HEADER.size + len(payload), zlib.crc32(payload) & 0xFFFFFFFF)
+    return header + payload
+
+
+def list_bundle(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, version, count, revision, size, crc = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        sys.exit("%s is not an asset bundle" % path)
+    crc_ok = zlib.crc32(data[HEADER.size:size]) & 0xFFFFFFFF == crc
+    print("format %d, revision %d, %d bytes, crc %s" % (version, revision, size, "ok" if crc_ok else "BAD"))
+    for i in range(count):
+        name, kind, _, offset, length = ENTRY.unpack_from(data, HEADER.size + i * ENTRY.size)
+        print("  %-20s %-6s %6d bytes at 0x%05x" % (name.rstrip(b"\0").decode(), TYPE_NAMES.get(kind, kind),
+                                                  length, offset))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build the firmware asset bundle")
+    parser.add_argument("manifest", nargs="?", help="JSON manifest listing the assets")
+    parser.add_argument("-o", "--output", default="assets.bin")
+    parser.add_argument("--list", metavar="BUNDLE", help="print the index of a built bundle")
+    args = parser.parse_args()
+
+    if args.list:
+        list_bundle(args.list)
+        return
+    if not args.manifest:
+        parser.error("a manifest is required")
+
+    bundle = build_bundle(args.manifest)
+    if len(bundle) > PARTITION_SIZE:
+        sys.exit("bundle is %d bytes, the assets partition holds %d" % (len(bundle), PARTITION_SIZE))
+    with open(args.output, "wb") as f:
+        f.write(bundle)
+    print("wrote %s, %d bytes" % (args.output, len(bundle)))
+
+
+if __name__ == "__main__":
+    main()